@@ -0,0 +1,275 @@
+/*
+ * REPL hot path benchmarks: line reading, parsing, builtin and command
+ * lookup, command completion, and running /bin/true end to end.
+ *
+ * The shell is compiled into this file, so its internals are measured
+ * directly rather than through a child. Build and run with
+ *     make bench
+ * which also builds a second copy with -DSH_USE_STD_GETLINE, for the read
+ * benchmark to compare against. By hand:
+ *     cc -O2 -o sh_bench bench/sh_bench.c
+ *     ./sh_bench [scale]
+ *
+ * scale multiplies every iteration count (default 1). Results are printed
+ * as tab-separated columns, one benchmark per line, after a header line:
+ * benchmark, iterations, ns_per_op, ops_per_s and mib_per_s (bytes
+ * processed, "-" where that means nothing).
+ */
+#define main sh_main
+#include "../src/main.c"
+#undef main
+
+#ifdef SH_USE_STD_GETLINE
+#define BENCH_READ_NAME "read_getline"
+#else
+#define BENCH_READ_NAME "read"
+#endif
+
+#define BENCH_READ_LINES 200000
+#define BENCH_HUGE_WORDS 100000
+#define BENCH_COMPLETE_FILES 10000
+
+/**
+ * @brief Print one result line.
+ * @param name Name of the benchmark.
+ * @param iterations Number of operations timed.
+ * @param elapsed_ns Time they took.
+ * @param bytes Bytes they processed, or 0.
+ */
+static void bench_report(const char *name, long iterations, long long elapsed_ns,
+                         size_t bytes) {
+    printf("%s\t%ld\t%.1f\t%.0f\t", name, iterations, (double) elapsed_ns / iterations,
+           iterations * 1e9 / elapsed_ns);
+    if (bytes > 0) {
+        printf("%.1f\n", bytes / (1024.0 * 1024.0) / (elapsed_ns / 1e9));
+    } else {
+        printf("-\n");
+    }
+    fflush(stdout);
+}
+
+/**
+ * @brief Read a file of typical command lines through sh_read_line on
+ * stdin, which is where the two line reading paths differ.
+ * @param reps How many times to read the whole file.
+ */
+static void bench_read(int reps) {
+    char path[] = "/tmp/sh_bench.XXXXXX";
+    const char *line = "cc -O2 -Wall -o build/sh src/main.c # build it\n";
+    int fd = mkstemp(path), saved_stdin = dup(STDIN_FILENO);
+    size_t bytes = 0;
+    long lines = 0;
+    long long start;
+    FILE *file;
+
+    if (fd == -1 || saved_stdin == -1) {
+        perror("sh_bench: read");
+        return;
+    }
+    unlink(path);
+    file = fdopen(fd, "w");
+    for (int i = 0; i < BENCH_READ_LINES; i++) {
+        fputs(line, file);
+    }
+    fflush(file);
+    dup2(fd, STDIN_FILENO);
+
+    start = sh_clock_ns();
+    for (int rep = 0; rep < reps; rep++) {
+        lseek(STDIN_FILENO, 0, SEEK_SET);
+        fseek(stdin, 0, SEEK_SET);
+        sh_stdin.start = sh_stdin.end = 0;
+        sh_stdin.eof = 0;
+        while (sh_read_line(&sh_stdin, NULL) != NULL) {
+            lines++;
+        }
+    }
+    bytes = (size_t) reps * BENCH_READ_LINES * strlen(line);
+    bench_report(BENCH_READ_NAME, lines, sh_clock_ns() - start, bytes);
+
+    fclose(file);
+    dup2(saved_stdin, STDIN_FILENO);
+    close(saved_stdin);
+    clearerr(stdin);
+}
+
+/**
+ * @brief Lex and parse one line over and over.
+ *
+ * Parsing unquotes in place, so every iteration starts from a fresh copy;
+ * the copy is part of what is timed.
+ * @param name Name of the benchmark.
+ * @param line The line.
+ * @param iterations Number of parses.
+ */
+static void bench_parse(const char *name, const char *line, long iterations) {
+    size_t len = strlen(line);
+    char *copy = sh_xmalloc(len + 1);
+    long long start = sh_clock_ns();
+
+    for (long i = 0; i < iterations; i++) {
+        memcpy(copy, line, len + 1);
+        if (sh_parse_line(copy) == NULL) {
+            fprintf(stderr, "sh_bench: %s: parse failed\n", name);
+            break;
+        }
+        sh_arena_reset(&sh_parse_arena);
+    }
+    bench_report(name, iterations, sh_clock_ns() - start, len * iterations);
+    free(copy);
+}
+
+/**
+ * @brief Build a line of many quoted and plain words, joined into short
+ * pipelines.
+ * @param words Number of words.
+ * @return The line, allocated.
+ */
+static char *bench_make_line(int words) {
+    static const char *samples[] = {"grep", "-n", "'a quoted word'", "\"$HOME/dir\"",
+                                    "file\\ name.txt", "--long-option=value", "|", "x"};
+    size_t size = 1, used = 0;
+    char *line;
+
+    for (int i = 0; i < words; i++) {
+        size += strlen(samples[i % 8]) + 1;
+    }
+    line = sh_xmalloc(size);
+    for (int i = 0; i < words; i++) {
+        used += sprintf(line + used, "%s%s", i ? " " : "", samples[i % 8]);
+    }
+    return line;
+}
+
+/**
+ * @brief Look names up in the builtin table or the command hash table.
+ * @param name Name of the benchmark.
+ * @param names The names, NULL terminated; cycled through.
+ * @param builtin Whether to look in the builtin table.
+ * @param iterations Number of lookups.
+ */
+static void bench_lookup(const char *name, const char **names, int builtin,
+                         long iterations) {
+    volatile const void *sink;
+    int count = 0;
+    long long start;
+
+    while (names[count] != NULL) {
+        count++;
+    }
+    start = sh_clock_ns();
+    for (long i = 0; i < iterations; i++) {
+        if (builtin) {
+            sink = sh_builtin_find(names[i % count]);
+        } else {
+            sink = sh_hash_lookup(names[i % count]);
+        }
+    }
+    (void) sink;
+    bench_report(name, iterations, sh_clock_ns() - start, 0);
+}
+
+/**
+ * @brief Complete command prefixes against a $PATH directory of many
+ * executables. The index is built before timing starts; each query also
+ * checks for inotify events, as it does when typing.
+ * @param iterations Number of queries.
+ */
+static void bench_complete(long iterations) {
+    static const char *prefixes[] = {"c", "cmd12", "cmd4567", "z", "e"};
+    char dir[] = "/tmp/sh_bench_path.XXXXXX", file[64];
+    const char *saved = sh_var_get("PATH");
+    char *saved_path = saved != NULL ? sh_xstrdup(saved) : NULL;
+    volatile size_t sink = 0;
+    long long start;
+
+    if (mkdtemp(dir) == NULL) {
+        perror("sh_bench: complete");
+        return;
+    }
+    for (int i = 0; i < BENCH_COMPLETE_FILES; i++) {
+        int fd;
+
+        snprintf(file, sizeof(file), "%s/cmd%d", dir, i);
+        if ((fd = open(file, O_WRONLY | O_CREAT, 0755)) != -1) {
+            close(fd);
+        }
+    }
+    sh_var_set("PATH", dir, 0);
+
+    start = sh_clock_ns();
+    sh_complete_refresh();
+    bench_report("complete_build", BENCH_COMPLETE_FILES, sh_clock_ns() - start, 0);
+
+    start = sh_clock_ns();
+    for (long i = 0; i < iterations; i++) {
+        const char *prefix = prefixes[i % 5];
+        size_t count;
+
+        sh_complete_find(prefix, strlen(prefix), &count);
+        sink += count;
+    }
+    (void) sink;
+    bench_report("complete_prefix", iterations, sh_clock_ns() - start, 0);
+
+    for (int i = 0; i < BENCH_COMPLETE_FILES; i++) {
+        snprintf(file, sizeof(file), "%s/cmd%d", dir, i);
+        unlink(file);
+    }
+    rmdir(dir);
+    if (saved_path != NULL) {
+        sh_var_set("PATH", saved_path, SH_VAR_EXPORT);
+        free(saved_path);
+    }
+}
+
+/**
+ * @brief Run /bin/true as a foreground command, the way a script line
+ * does, with one launch engine.
+ * @param name Name of the benchmark.
+ * @param engine The launch engine.
+ * @param iterations Number of commands.
+ */
+static void bench_exec(const char *name, enum sh_engine engine, long iterations) {
+    char *args[] = {"/bin/true", NULL};
+    long long start;
+
+    sh_launch_engine = engine;
+    start = sh_clock_ns();
+    for (long i = 0; i < iterations; i++) {
+        sh_execute(args);
+    }
+    bench_report(name, iterations, sh_clock_ns() - start, 0);
+}
+
+int main(int argc, char **argv) {
+    long scale = argc > 1 ? atol(argv[1]) : 1;
+    const char *builtin_names[] = {"cd", "exit", "wait", "jobs", "ls", "grep", NULL};
+    const char *command_names[] = {"true", "ls", "cat", "grep", NULL};
+    char *long_line = bench_make_line(100);
+    char *huge_line = bench_make_line(BENCH_HUGE_WORDS);
+
+    if (scale < 1) {
+        fprintf(stderr, "usage: sh_bench [scale]\n");
+        return EXIT_FAILURE;
+    }
+    sh_launch_init();
+    sh_pipe_init();
+    sh_jobs_init(0);
+
+    printf("benchmark\titerations\tns_per_op\tops_per_s\tmib_per_s\n");
+    bench_read(5 * scale);
+    bench_parse("parse_short", "ls -l /tmp", 1000000 * scale);
+    bench_parse("parse_long", long_line, 20000 * scale);
+    bench_parse("parse_huge", huge_line, 20 * scale);
+    bench_lookup("dispatch_builtin", builtin_names, 1, 10000000 * scale);
+    bench_lookup("lookup_command", command_names, 0, 10000000 * scale);
+    bench_complete(1000000 * scale);
+    bench_exec("exec_true_spawn", SH_ENGINE_SPAWN, 2000 * scale);
+    bench_exec("exec_true_vfork", SH_ENGINE_VFORK, 2000 * scale);
+    bench_exec("exec_true_fork", SH_ENGINE_FORK, 2000 * scale);
+
+    free(long_line);
+    free(huge_line);
+    return EXIT_SUCCESS;
+}
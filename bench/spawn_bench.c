@@ -0,0 +1,115 @@
+/*
+ * Spawn latency benchmark: compares the launch engines used by sh_launch.
+ *
+ * Build and run:
+ *     cc -O2 -o spawn_bench bench/spawn_bench.c
+ *     ./spawn_bench [iterations] [heap MiB] [program]
+ *
+ * The heap argument grows this process before measuring, to show how fork
+ * degrades as the parent gets bigger while posix_spawn and vfork do not.
+ */
+#include <errno.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+/**
+ * @brief Read the monotonic clock.
+ * @return Current time in nanoseconds.
+ */
+static double bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static pid_t launch_spawn(char **args) {
+    pid_t pid;
+    if (posix_spawnp(&pid, args[0], NULL, NULL, args, environ) != 0) {
+        return -1;
+    }
+    return pid;
+}
+
+static pid_t launch_vfork(char **args) {
+    pid_t pid = vfork();
+    if (pid == 0) {
+        execvp(args[0], args);
+        _exit(127);
+    }
+    return pid;
+}
+
+static pid_t launch_fork(char **args) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(args[0], args);
+        _exit(127);
+    }
+    return pid;
+}
+
+struct engine {
+    const char *name;
+    pid_t (*launch)(char **args);
+};
+
+static struct engine engines[] = {
+        {"spawn", &launch_spawn},
+        {"vfork", &launch_vfork},
+        {"fork",  &launch_fork}
+};
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+    size_t heap_mib = argc > 2 ? strtoul(argv[2], NULL, 10) : 256;
+    char *args[] = {argc > 3 ? argv[3] : "/bin/true", NULL};
+    size_t heap_size = heap_mib << 20;
+    char *heap = NULL;
+
+    if (heap_size > 0) {
+        // Touch every page so it really is mapped in the parent.
+        heap = malloc(heap_size);
+        if (!heap) {
+            fprintf(stderr, "spawn_bench: allocation error\n");
+            return EXIT_FAILURE;
+        }
+        memset(heap, 1, heap_size);
+    }
+
+    printf("engine\titerations\theap_mib\tmean_us\tmin_us\n");
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+        double total = 0, min = -1;
+
+        for (int i = 0; i < iterations; i++) {
+            double start = bench_now_ns();
+            pid_t pid = engines[e].launch(args);
+            int status;
+
+            if (pid < 0) {
+                fprintf(stderr, "spawn_bench: %s: %s\n", engines[e].name,
+                        strerror(errno));
+                return EXIT_FAILURE;
+            }
+            waitpid(pid, &status, 0);
+
+            double elapsed = bench_now_ns() - start;
+            total += elapsed;
+            if (min < 0 || elapsed < min) {
+                min = elapsed;
+            }
+        }
+
+        printf("%s\t%d\t%zu\t%.1f\t%.1f\n", engines[e].name, iterations,
+               heap_mib, total / iterations / 1e3, min / 1e3);
+    }
+
+    free(heap);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,74 @@
+/*
+ * Cold start benchmark: how long the shell takes to run one command, the
+ * way it is run as a subprocess, next to starting that command directly.
+ *
+ * Build and run:
+ *     cc -O2 -o startup_bench bench/startup_bench.c
+ *     ./startup_bench [shell] [iterations]
+ *
+ * shell defaults to build/sh. Each case is started with posix_spawn and
+ * waited for; the difference between "sh -c /bin/true" and "/bin/true" is
+ * what the shell costs on the way to its first exec. For a breakdown of
+ * the shell's own part, run it with --startup-trace.
+ */
+#include <errno.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+/**
+ * @brief Read the monotonic clock.
+ * @return Current time in nanoseconds.
+ */
+static double bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    char *shell = argc > 1 ? argv[1] : "build/sh";
+    int iterations = argc > 2 ? atoi(argv[2]) : 500;
+    char *cases[][4] = {
+            {"/bin/true", NULL},
+            {shell, "-c", "exit", NULL},
+            {shell, "-c", "/bin/true", NULL},
+            {shell, "-c", "true; true", NULL},
+    };
+
+    printf("command\titerations\tmean_us\tmin_us\n");
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        double total = 0, min = -1;
+
+        for (int i = 0; i < iterations; i++) {
+            double start = bench_now_ns();
+            pid_t pid;
+            int status, err = posix_spawn(&pid, cases[c][0], NULL, NULL, cases[c], environ);
+
+            if (err != 0) {
+                fprintf(stderr, "startup_bench: %s: %s\n", cases[c][0], strerror(err));
+                return EXIT_FAILURE;
+            }
+            waitpid(pid, &status, 0);
+
+            double elapsed = bench_now_ns() - start;
+            total += elapsed;
+            if (min < 0 || elapsed < min) {
+                min = elapsed;
+            }
+        }
+
+        printf("%s", cases[c][0]);
+        for (int j = 1; cases[c][j] != NULL; j++) {
+            printf(" %s", cases[c][j]);
+        }
+        printf("\t%d\t%.1f\t%.1f\n", iterations, total / iterations / 1e3, min / 1e3);
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,271 +1,11029 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-/*
- * Function Declarations for builtin shell commands:
+extern char **environ;
+
+/*
+ * Memory allocation. Running out of memory is fatal, so callers of the
+ * sh_x* wrappers never see NULL and do not check for it.
+ */
+/**
+ * @brief Report an allocation failure and terminate.
+ */
+void sh_alloc_failed() {
+    fprintf(stderr, "sh: allocation error\n");
+    exit(EXIT_FAILURE);
+}
+
+void *sh_xmalloc(size_t size) {
+    void *ptr = malloc(size);
+    if (!ptr) {
+        sh_alloc_failed();
+    }
+    return ptr;
+}
+
+void *sh_xcalloc(size_t count, size_t size) {
+    void *ptr = calloc(count, size);
+    if (!ptr) {
+        sh_alloc_failed();
+    }
+    return ptr;
+}
+
+void *sh_xrealloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (!ptr) {
+        sh_alloc_failed();
+    }
+    return ptr;
+}
+
+char *sh_xstrdup(const char *str) {
+    char *copy = strdup(str);
+    if (!copy) {
+        sh_alloc_failed();
+    }
+    return copy;
+}
+
+char *sh_xstrndup(const char *str, size_t len) {
+    char *copy = strndup(str, len);
+    if (!copy) {
+        sh_alloc_failed();
+    }
+    return copy;
+}
+
+/**
+ * @brief Make room for one more element in a growable array.
+ * @param array The array.
+ * @param size Its capacity in elements; updated.
+ * @param count Elements in use.
+ * @param elem_size Size of one element.
+ * @return The (possibly moved) array.
+ */
+void *sh_grow(void *array, size_t *size, size_t count, size_t elem_size) {
+    if (count < *size) {
+        return array;
+    }
+    *size = *size ? *size * 2 : 16;
+    return sh_xrealloc(array, *size * elem_size);
+}
+
+/*
+ * Arena allocator. Everything built while handling one command (the token
+ * array, and later parse trees and expansions) is bump allocated from
+ * sh_parse_arena, which sh_loop resets once the command has run. Nothing
+ * allocated there is ever freed on its own.
+ */
+#define SH_ARENA_CHUNK_SIZE 65536
+#define SH_ARENA_ALIGN 16
+
+struct sh_arena_chunk {
+    struct sh_arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct sh_arena {
+    struct sh_arena_chunk *chunk; // current chunk, earlier ones follow
+    size_t total;                 // bytes handed out since the last reset
+};
+
+struct sh_arena sh_parse_arena;
+
+// A point in an arena to release back to.
+struct sh_arena_mark {
+    struct sh_arena_chunk *chunk;
+    size_t used;
+    size_t total;
+};
+
+/**
+ * @brief Allocate from an arena.
+ * @param arena The arena.
+ * @param size Number of bytes.
+ * @return Memory aligned for any type, valid until the arena is reset.
+ */
+void *sh_arena_alloc(struct sh_arena *arena, size_t size) {
+    struct sh_arena_chunk *chunk = arena->chunk;
+    size_t used;
+
+    size = (size + SH_ARENA_ALIGN - 1) & ~(size_t) (SH_ARENA_ALIGN - 1);
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = SH_ARENA_CHUNK_SIZE;
+
+        while (chunk_size < size) {
+            chunk_size *= 2;
+        }
+        chunk = sh_xmalloc(sizeof(*chunk) + chunk_size);
+        chunk->next = arena->chunk;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        arena->chunk = chunk;
+    }
+
+    used = chunk->used;
+    chunk->used += size;
+    arena->total += size;
+    return chunk->data + used;
+}
+
+/**
+ * @brief Resize the most recent allocation of an arena.
+ *
+ * Grows in place when the allocation is the last one in its chunk and the
+ * chunk has room; otherwise the contents are moved to a new allocation.
+ * @param arena The arena.
+ * @param ptr Allocation to resize, or NULL.
+ * @param old_size Current size of the allocation.
+ * @param size New size.
+ * @return The resized allocation.
+ */
+void *sh_arena_realloc(struct sh_arena *arena, void *ptr, size_t old_size, size_t size) {
+    struct sh_arena_chunk *chunk = arena->chunk;
+    void *grown;
+
+    old_size = (old_size + SH_ARENA_ALIGN - 1) & ~(size_t) (SH_ARENA_ALIGN - 1);
+    if (ptr != NULL && chunk != NULL && (char *) ptr + old_size == chunk->data + chunk->used) {
+        size_t offset = (char *) ptr - chunk->data;
+        size_t aligned = (size + SH_ARENA_ALIGN - 1) & ~(size_t) (SH_ARENA_ALIGN - 1);
+
+        if (offset + aligned <= chunk->size) {
+            arena->total += aligned - old_size;
+            chunk->used = offset + aligned;
+            return ptr;
+        }
+    }
+
+    grown = sh_arena_alloc(arena, size);
+    if (ptr != NULL) {
+        memcpy(grown, ptr, old_size < size ? old_size : size);
+    }
+    return grown;
+}
+
+/**
+ * @brief Copy a string into an arena.
+ * @param arena The arena.
+ * @param str The string; need not be NUL-terminated.
+ * @param len Number of bytes to copy.
+ * @return NUL-terminated copy, valid until the arena is reset.
+ */
+char *sh_arena_strndup(struct sh_arena *arena, const char *str, size_t len) {
+    char *copy = sh_arena_alloc(arena, len + 1);
+
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/**
+ * @brief Mark an arena's current end, to release back to later.
+ * @param arena The arena.
+ * @return The mark.
+ */
+struct sh_arena_mark sh_arena_save(struct sh_arena *arena) {
+    if (arena->chunk == NULL) {
+        // Give the mark a chunk, so releasing to it keeps one.
+        sh_arena_alloc(arena, 0);
+    }
+    return (struct sh_arena_mark) {arena->chunk, arena->chunk->used, arena->total};
+}
+
+/**
+ * @brief Release what was allocated from an arena since a mark, so work
+ * repeated in a loop runs in constant space.
+ * @param arena The arena.
+ * @param mark The mark, from sh_arena_save since the last reset.
+ */
+void sh_arena_release(struct sh_arena *arena, struct sh_arena_mark mark) {
+    while (arena->chunk != mark.chunk) {
+        struct sh_arena_chunk *next = arena->chunk->next;
+
+        free(arena->chunk);
+        arena->chunk = next;
+    }
+    arena->chunk->used = mark.used;
+    arena->total = mark.total;
+}
+
+/**
+ * @brief Release everything allocated from an arena.
+ *
+ * If the last round needed several chunks they are replaced by one chunk
+ * big enough for all of it, so a steady workload settles into a single
+ * chunk that is reused without touching malloc.
+ * @param arena The arena.
+ */
+void sh_arena_reset(struct sh_arena *arena) {
+    struct sh_arena_chunk *chunk = arena->chunk;
+
+    if (chunk == NULL) {
+        return;
+    }
+    if (chunk->next != NULL) {
+        size_t needed = arena->total;
+
+        while (chunk != NULL) {
+            struct sh_arena_chunk *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        arena->chunk = NULL;
+        arena->total = 0;
+        sh_arena_alloc(arena, needed);
+        chunk = arena->chunk;
+    }
+    chunk->used = 0;
+    arena->total = 0;
+}
+
+/*
+ * Builtin registry. Registering a builtin is one SH_BUILTIN(name, function)
+ * line here; the declarations and the lookup table are generated from it.
+ */
+#define SH_BUILTINS(SH_BUILTIN)             \
+        SH_BUILTIN("cd", sh_cd)             \
+        SH_BUILTIN("help", sh_help)         \
+        SH_BUILTIN("exit", sh_exit)         \
+        SH_BUILTIN("hash", sh_hash)         \
+        SH_BUILTIN("jobs", sh_jobs)         \
+        SH_BUILTIN("wait", sh_wait)         \
+        SH_BUILTIN("fg", sh_fg)             \
+        SH_BUILTIN("bg", sh_bg)             \
+        SH_BUILTIN("parallel", sh_parallel) \
+        SH_BUILTIN("time", sh_time)         \
+        SH_BUILTIN("limit", sh_limit)       \
+        SH_BUILTIN("timeout", sh_timeout)   \
+        SH_BUILTIN("batched", sh_batched)   \
+        SH_BUILTIN("shstats", sh_shstats)   \
+        SH_BUILTIN("echo", sh_echo)         \
+        SH_BUILTIN("printf", sh_printf)     \
+        SH_BUILTIN("test", sh_test)         \
+        SH_BUILTIN("[", sh_test)            \
+        SH_BUILTIN("true", sh_true)         \
+        SH_BUILTIN("false", sh_false)       \
+        SH_BUILTIN("pwd", sh_pwd)           \
+        SH_BUILTIN("cat", sh_cat)           \
+        SH_BUILTIN("coproc", sh_coproc)     \
+        SH_BUILTIN("export", sh_export)     \
+        SH_BUILTIN("unset", sh_unset)       \
+        SH_BUILTIN("history", sh_history)   \
+        SH_BUILTIN("complete", sh_complete)
+
+/*
+ * Function Declarations for builtin shell commands:
+ */
+#define SH_BUILTIN_DECLARE(name, func) int func(char **args);
+SH_BUILTINS(SH_BUILTIN_DECLARE)
+
+struct sh_builtin {
+    const char *name;
+    int (*func)(char **);
+};
+
+/*
+ * List of builtin commands, with their corresponding functions.
+ */
+#define SH_BUILTIN_ENTRY(name, func) {name, &func},
+struct sh_builtin builtins[] = {
+        SH_BUILTINS(SH_BUILTIN_ENTRY)
+};
+
+#define SH_NUM_BUILTINS ((int) (sizeof(builtins) / sizeof(builtins[0])))
+
+/*
+ * Perfect hash over the builtin names: every name lands in its own slot, so
+ * a lookup is one hash and at most one strcmp however many builtins exist.
+ * The seed that makes the table collision free is found on first use.
+ */
+#define SH_BUILTIN_SLOTS_MIN (4 * SH_NUM_BUILTINS)
+
+struct sh_builtin **builtin_slots;
+unsigned int builtin_mask;
+unsigned int builtin_seed;
+
+/**
+ * @brief Seeded FNV-1a hash of a builtin name.
+ * @param name The name.
+ * @param seed Seed selecting one member of the hash family.
+ * @return The hash value.
+ */
+unsigned int sh_builtin_hash(const char *name, unsigned int seed) {
+    unsigned int hash = 2166136261u ^ seed;
+
+    while (*name) {
+        hash = (hash ^ (unsigned char) *name++) * 16777619u;
+    }
+    return hash ^ (hash >> 15);
+}
+
+/**
+ * @brief Build the perfect hash table for the builtin registry.
+ */
+void sh_builtin_init() {
+    unsigned int size = 1;
+
+    while (size < SH_BUILTIN_SLOTS_MIN) {
+        size <<= 1;
+    }
+
+    while (1) {
+        builtin_slots = sh_xcalloc(size, sizeof(*builtin_slots));
+        builtin_mask = size - 1;
+
+        for (builtin_seed = 0; builtin_seed < 4096; builtin_seed++) {
+            int i;
+
+            for (i = 0; i < SH_NUM_BUILTINS; i++) {
+                unsigned int slot = sh_builtin_hash(builtins[i].name, builtin_seed) & builtin_mask;
+                if (builtin_slots[slot] != NULL) {
+                    break;
+                }
+                builtin_slots[slot] = &builtins[i];
+            }
+            if (i == SH_NUM_BUILTINS) {
+                return;
+            }
+            memset(builtin_slots, 0, size * sizeof(*builtin_slots));
+        }
+
+        // No seed works at this size; retry with a sparser table.
+        free(builtin_slots);
+        size <<= 1;
+    }
+}
+
+/**
+ * @brief Find a builtin by name.
+ * @param name Command name.
+ * @return The builtin, or NULL if name is not a builtin.
+ */
+struct sh_builtin *sh_builtin_find(const char *name) {
+    struct sh_builtin *builtin;
+
+    if (builtin_slots == NULL) {
+        sh_builtin_init();
+    }
+    builtin = builtin_slots[sh_builtin_hash(name, builtin_seed) & builtin_mask];
+    if (builtin != NULL && strcmp(builtin->name, name) == 0) {
+        return builtin;
+    }
+    return NULL;
+}
+
+/*
+ * Variables. Shell and environment variables share one open addressing
+ * table, probed linearly. A name is interned in its slot the first time it
+ * is set and stays there, set or not, until the table next grows, so
+ * unsetting leaves no tombstones behind.
+ *
+ * The environment handed to exec is kept up to date one entry at a time as
+ * exported variables change, so launching a command never rebuilds it.
+ * Until the first variable is set the table is not built at all: lookups go
+ * to getenv and children get environ as it is.
+ */
+#define SH_VARS_MIN_SIZE 64
+
+// Variable flags.
+#define SH_VAR_EXPORT 1
+
+struct sh_var {
+    char *name;    // interned; NULL for an empty slot
+    char *value;   // NULL while unset
+    unsigned int hash;
+    int flags;
+    int env_index; // position in sh_vars.envp, or -1
+};
+
+struct sh_var_table {
+    struct sh_var *slots;
+    size_t size;       // a power of two, at least twice used
+    size_t used;       // slots with a name
+    char **envp;       // "name=value" of each set, exported variable; NULL terminated
+    size_t *env_slots; // slot of each envp entry
+    size_t env_count;
+    size_t env_size;
+};
+
+struct sh_var_table sh_vars;
+
+// Bumped whenever $PATH changes, so the command hash knows to start over.
+unsigned int sh_path_version;
+
+/**
+ * @brief FNV-1a hash of a string.
+ * @param str The string.
+ * @return The hash value.
+ */
+unsigned int sh_hash_string(const char *str) {
+    unsigned int hash = 2166136261u;
+
+    while (*str) {
+        hash = (hash ^ (unsigned char) *str++) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief FNV-1a hash of a variable name.
+ * @param name The name; need not be NUL-terminated.
+ * @param len Length of the name.
+ * @return The hash value, the same as sh_hash_string() gives.
+ */
+unsigned int sh_var_hash(const char *name, size_t len) {
+    unsigned int hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Check whether a character may appear in a variable name.
+ * @param c The character.
+ * @return Nonzero if it may.
+ */
+int sh_is_name_char(int c) {
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+/**
+ * @brief Check whether a string is a valid variable name.
+ * @param name The string; need not be NUL-terminated.
+ * @param len Its length.
+ * @return Nonzero if it is a name.
+ */
+int sh_is_name(const char *name, size_t len) {
+    if (len == 0 || (name[0] >= '0' && name[0] <= '9')) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!sh_is_name_char((unsigned char) name[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Find the slot of a name.
+ * @param name The name; need not be NUL-terminated.
+ * @param len Length of the name.
+ * @param hash Its hash.
+ * @return The slot holding the name, or the empty slot where it would go.
+ */
+size_t sh_var_probe(const char *name, size_t len, unsigned int hash) {
+    size_t mask = sh_vars.size - 1;
+    size_t slot = hash & mask;
+
+    while (sh_vars.slots[slot].name != NULL) {
+        struct sh_var *var = &sh_vars.slots[slot];
+
+        if (var->hash == hash && strncmp(var->name, name, len) == 0 && var->name[len] == '\0') {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * @brief Move the table to a new size, dropping names that are neither set
+ * nor exported.
+ * @param size The new size, a power of two.
+ */
+void sh_vars_resize(size_t size) {
+    struct sh_var *old = sh_vars.slots;
+    size_t old_size = sh_vars.size;
+
+    sh_vars.slots = sh_xcalloc(size, sizeof(*sh_vars.slots));
+    sh_vars.size = size;
+    sh_vars.used = 0;
+    for (size_t i = 0; i < old_size; i++) {
+        struct sh_var *var = &old[i];
+        size_t slot;
+
+        if (var->name == NULL) {
+            continue;
+        }
+        if (var->value == NULL && var->flags == 0) {
+            free(var->name);
+            continue;
+        }
+        slot = var->hash & (size - 1);
+        while (sh_vars.slots[slot].name != NULL) {
+            slot = (slot + 1) & (size - 1);
+        }
+        sh_vars.slots[slot] = *var;
+        sh_vars.used++;
+        if (var->env_index >= 0) {
+            sh_vars.env_slots[var->env_index] = slot;
+        }
+    }
+    free(old);
+}
+
+/**
+ * @brief Bring the environment entry of a variable in line with it.
+ * @param slot The variable's slot.
+ */
+void sh_var_env_update(size_t slot) {
+    struct sh_var *var = &sh_vars.slots[slot];
+    int wanted = (var->flags & SH_VAR_EXPORT) && var->value != NULL;
+    size_t name_len, value_len;
+    char *entry;
+
+    if (var->env_index >= 0) {
+        free(sh_vars.envp[var->env_index]);
+        if (!wanted) {
+            // The last entry fills the hole.
+            size_t last = --sh_vars.env_count;
+
+            sh_vars.envp[var->env_index] = sh_vars.envp[last];
+            sh_vars.env_slots[var->env_index] = sh_vars.env_slots[last];
+            sh_vars.slots[sh_vars.env_slots[last]].env_index = var->env_index;
+            sh_vars.envp[last] = NULL;
+            var->env_index = -1;
+            return;
+        }
+    } else if (wanted) {
+        if (sh_vars.env_count + 1 >= sh_vars.env_size) {
+            sh_vars.env_size *= 2;
+            sh_vars.envp = sh_xrealloc(sh_vars.envp, sh_vars.env_size * sizeof(*sh_vars.envp));
+            sh_vars.env_slots = sh_xrealloc(sh_vars.env_slots, sh_vars.env_size * sizeof(*sh_vars.env_slots));
+        }
+        var->env_index = sh_vars.env_count++;
+        sh_vars.env_slots[var->env_index] = slot;
+        sh_vars.envp[sh_vars.env_count] = NULL;
+    } else {
+        return;
+    }
+
+    name_len = strlen(var->name);
+    value_len = strlen(var->value);
+    entry = sh_xmalloc(name_len + value_len + 2);
+    memcpy(entry, var->name, name_len);
+    entry[name_len] = '=';
+    memcpy(entry + name_len + 1, var->value, value_len + 1);
+    sh_vars.envp[var->env_index] = entry;
+}
+
+// Defined below; importing the environment stores every variable in it.
+void sh_var_store(const char *name, size_t len, const char *value, int flags);
+
+/**
+ * @brief Build the table, importing the environment as exported variables.
+ */
+void sh_vars_init() {
+    size_t count = 0, size = SH_VARS_MIN_SIZE;
+
+    while (environ[count] != NULL) {
+        count++;
+    }
+    while (size < 2 * count) {
+        size <<= 1;
+    }
+    sh_vars.slots = sh_xcalloc(size, sizeof(*sh_vars.slots));
+    sh_vars.size = size;
+    sh_vars.env_size = count + 16;
+    sh_vars.envp = sh_xmalloc(sh_vars.env_size * sizeof(*sh_vars.envp));
+    sh_vars.env_slots = sh_xmalloc(sh_vars.env_size * sizeof(*sh_vars.env_slots));
+    sh_vars.envp[0] = NULL;
+
+    for (size_t i = 0; i < count; i++) {
+        const char *eq = strchr(environ[i], '=');
+
+        if (eq != NULL) {
+            sh_var_store(environ[i], eq - environ[i], eq + 1, SH_VAR_EXPORT);
+        }
+    }
+}
+
+/**
+ * @brief Set a variable's value and flags.
+ * @param name The name; need not be NUL-terminated.
+ * @param len Length of the name.
+ * @param value The value, copied; NULL to unset.
+ * @param flags The variable's flags from now on.
+ */
+void sh_var_store(const char *name, size_t len, const char *value, int flags) {
+    unsigned int hash;
+    size_t slot;
+    struct sh_var *var;
+    char *copy;
+
+    if (sh_vars.slots == NULL) {
+        sh_vars_init();
+    }
+    hash = sh_var_hash(name, len);
+    slot = sh_var_probe(name, len, hash);
+    var = &sh_vars.slots[slot];
+    if (var->name == NULL) {
+        if (value == NULL && flags == 0) {
+            return; // nothing to forget
+        }
+        if (2 * (sh_vars.used + 1) > sh_vars.size) {
+            sh_vars_resize(2 * sh_vars.size);
+            slot = sh_var_probe(name, len, hash);
+            var = &sh_vars.slots[slot];
+        }
+        var->name = sh_xmalloc(len + 1);
+        memcpy(var->name, name, len);
+        var->name[len] = '\0';
+        var->hash = hash;
+        var->env_index = -1;
+        sh_vars.used++;
+    }
+
+    // Copied first: value may be the old value itself.
+    copy = value != NULL ? sh_xstrdup(value) : NULL;
+    free(var->value);
+    var->value = copy;
+    var->flags = flags;
+    sh_var_env_update(slot);
+
+    if (len == 4 && memcmp(name, "PATH", 4) == 0) {
+        sh_path_version++;
+    }
+}
+
+/**
+ * @brief Set a variable.
+ * @param name The name.
+ * @param value The value, copied; NULL to unset.
+ * @param flags The variable's flags from now on.
+ */
+void sh_var_set(const char *name, const char *value, int flags) {
+    sh_var_store(name, strlen(name), value, flags);
+}
+
+/**
+ * @brief Look a variable up.
+ * @param name The name; need not be NUL-terminated.
+ * @param len Length of the name.
+ * @return Its value, or NULL if it is unset.
+ */
+const char *sh_var_getn(const char *name, size_t len) {
+    if (sh_vars.slots == NULL) {
+        return getenv(sh_arena_strndup(&sh_parse_arena, name, len));
+    }
+    return sh_vars.slots[sh_var_probe(name, len, sh_var_hash(name, len))].value;
+}
+
+/**
+ * @brief Look a variable up.
+ * @param name The name.
+ * @return Its value, or NULL if it is unset.
+ */
+const char *sh_var_get(const char *name) {
+    return sh_var_getn(name, strlen(name));
+}
+
+/**
+ * @brief Get a variable's flags.
+ * @param name The name.
+ * @return Its flags, 0 if it is not known.
+ */
+int sh_var_flags(const char *name) {
+    if (sh_vars.slots == NULL) {
+        return getenv(name) != NULL ? SH_VAR_EXPORT : 0;
+    }
+    return sh_vars.slots[sh_var_probe(name, strlen(name), sh_hash_string(name))].flags;
+}
+
+/**
+ * @brief Carry out an assignment word, keeping the variable's flags.
+ * @param assignment "name=value".
+ * @param flags Flags to add.
+ */
+void sh_var_assign(const char *assignment, int flags) {
+    const char *eq = strchr(assignment, '=');
+    char *name = sh_arena_strndup(&sh_parse_arena, assignment, eq - assignment);
+
+    sh_var_store(name, eq - assignment, eq + 1, sh_var_flags(name) | flags);
+}
+
+/**
+ * @brief Get the environment for a new program.
+ * @return The exported variables as "name=value" strings, NULL terminated.
+ */
+char **sh_environ() {
+    return sh_vars.slots != NULL ? sh_vars.envp : environ;
+}
+
+/**
+ * @brief Compare variables by name, for qsort.
+ * @param a Pointer to the first variable.
+ * @param b Pointer to the second.
+ * @return Less than, equal to or greater than zero, as strcmp.
+ */
+int sh_var_compare(const void *a, const void *b) {
+    return strcmp((*(struct sh_var *const *) a)->name, (*(struct sh_var *const *) b)->name);
+}
+
+/**
+ * @brief List the variables, sorted by name.
+ * @param count Receives the number of variables.
+ * @return The variables, allocated from sh_parse_arena.
+ */
+struct sh_var **sh_vars_sorted(size_t *count) {
+    struct sh_var **list;
+
+    if (sh_vars.slots == NULL) {
+        sh_vars_init();
+    }
+    list = sh_arena_alloc(&sh_parse_arena, sh_vars.used * sizeof(*list));
+    *count = 0;
+    for (size_t i = 0; i < sh_vars.size; i++) {
+        if (sh_vars.slots[i].name != NULL) {
+            list[(*count)++] = &sh_vars.slots[i];
+        }
+    }
+    qsort(list, *count, sizeof(*list), &sh_var_compare);
+    return list;
+}
+
+/*
+ * Assignments in front of a command are in effect, exported, only while it
+ * runs; the variables they replace are saved and put back after.
+ */
+struct sh_var_save {
+    char *name;
+    char *value; // copy of the old value, or NULL if it was unset
+    int flags;
+};
+
+/**
+ * @brief Carry out a command's assignments for the duration of the command.
+ * @param assigns The assignment words.
+ * @param count Number of them.
+ * @return What sh_var_pop() restores from, allocated from sh_parse_arena.
+ */
+struct sh_var_save *sh_var_push(char **assigns, int count) {
+    struct sh_var_save *saves = sh_arena_alloc(&sh_parse_arena, count * sizeof(*saves));
+
+    for (int i = 0; i < count; i++) {
+        const char *eq = strchr(assigns[i], '=');
+        const char *value;
+
+        saves[i].name = sh_arena_strndup(&sh_parse_arena, assigns[i], eq - assigns[i]);
+        value = sh_var_get(saves[i].name);
+        saves[i].value = value != NULL ? sh_arena_strndup(&sh_parse_arena, value, strlen(value)) : NULL;
+        saves[i].flags = sh_var_flags(saves[i].name);
+        sh_var_store(assigns[i], eq - assigns[i], eq + 1, saves[i].flags | SH_VAR_EXPORT);
+    }
+    return saves;
+}
+
+/**
+ * @brief Undo sh_var_push(), in reverse order.
+ * @param saves What it saved.
+ * @param count Number of assignments.
+ */
+void sh_var_pop(struct sh_var_save *saves, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        sh_var_set(saves[i].name, saves[i].value, saves[i].flags);
+    }
+}
+
+/*
+ * Command hash: remembers where each external command was found on $PATH,
+ * so launching it does not walk every $PATH directory again.
+ */
+#define SH_HASH_SIZE 256
+#define SH_DEFAULT_PATH "/bin:/usr/bin"
+
+struct sh_hash_entry {
+    char *name;
+    char *path;
+    int hits;
+    struct sh_hash_entry *next;
+};
+
+struct sh_hash_entry *sh_hash_table[SH_HASH_SIZE];
+
+// The $PATH value the table was filled for, and sh_path_version then.
+char *sh_hash_path;
+unsigned int sh_hash_version;
+
+/**
+ * @brief Forget every remembered command location.
+ */
+void sh_hash_clear() {
+    struct sh_hash_entry *entry, *next;
+
+    for (int i = 0; i < SH_HASH_SIZE; i++) {
+        for (entry = sh_hash_table[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+        sh_hash_table[i] = NULL;
+    }
+}
+
+/**
+ * @brief Forget the remembered location of one command.
+ * @param name The command name.
+ */
+void sh_hash_forget(const char *name) {
+    struct sh_hash_entry **link = &sh_hash_table[sh_hash_string(name) % SH_HASH_SIZE];
+    struct sh_hash_entry *entry;
+
+    while ((entry = *link) != NULL) {
+        if (strcmp(entry->name, name) == 0) {
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+/**
+ * @brief Drop the table if $PATH changed since it was filled.
+ *
+ * The variable store counts changes to $PATH, so this is one comparison
+ * rather than a look at the value.
+ * @return The current search path.
+ */
+const char *sh_hash_check_path() {
+    const char *path;
+
+    if (sh_hash_path != NULL && sh_hash_version == sh_path_version) {
+        return sh_hash_path;
+    }
+    path = sh_var_get("PATH");
+    sh_hash_clear();
+    free(sh_hash_path);
+    sh_hash_path = sh_xstrdup(path != NULL ? path : SH_DEFAULT_PATH);
+    sh_hash_version = sh_path_version;
+    return sh_hash_path;
+}
+
+/**
+ * @brief Search the directories of a search path for an executable.
+ * @param path The search path, colon separated.
+ * @param name The command name.
+ * @return Newly allocated absolute path, or NULL if not found.
+ */
+char *sh_hash_search(const char *path, const char *name) {
+    size_t name_len = strlen(name);
+    struct stat st;
+
+    while (1) {
+        const char *end = strchr(path, ':');
+        size_t dir_len = end ? (size_t) (end - path) : strlen(path);
+        char *candidate = sh_xmalloc(dir_len + name_len + 3);
+
+        // An empty entry means the current directory.
+        if (dir_len == 0) {
+            candidate[0] = '.';
+            dir_len = 1;
+        } else {
+            memcpy(candidate, path, dir_len);
+        }
+        candidate[dir_len] = '/';
+        memcpy(candidate + dir_len + 1, name, name_len + 1);
+
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) &&
+            access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+
+        if (end == NULL) {
+            return NULL;
+        }
+        path = end + 1;
+    }
+}
+
+/**
+ * @brief Find the executable for a command, searching $PATH only on a miss.
+ * @param name The command name.
+ * @return Path to execute (owned by the table), or NULL if not found.
+ */
+const char *sh_hash_lookup(const char *name) {
+    const char *path = sh_hash_check_path();
+    unsigned int bucket;
+    struct sh_hash_entry *entry;
+
+    if (strchr(name, '/') != NULL) {
+        // Explicit paths are never searched for or remembered.
+        return name;
+    }
+
+    bucket = sh_hash_string(name) % SH_HASH_SIZE;
+    for (entry = sh_hash_table[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    entry = sh_xmalloc(sizeof(*entry));
+    entry->path = sh_hash_search(path, name);
+    if (entry->path == NULL) {
+        free(entry);
+        return NULL;
+    }
+    entry->name = sh_xstrdup(name);
+    entry->hits = 1;
+    entry->next = sh_hash_table[bucket];
+    sh_hash_table[bucket] = entry;
+    return entry->path;
+}
+
+/*
+ * Completion index: every builtin and every executable in the $PATH
+ * directories, in one sorted array, so the commands starting with a prefix
+ * are a binary search and a scan of the matches rather than a directory
+ * read per keystroke. The index is built on the first query; after that
+ * inotify watches on the directories keep it current, and the events
+ * pending are applied at the start of each query. Relative $PATH entries
+ * depend on the working directory and are left out.
+ */
+#define SH_COMPLETE_MAX_DIRS 64
+#define SH_COMPLETE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                            IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct sh_complete_entry {
+    char *name;
+    uint64_t dirs; // bit i: an executable of this name is in dirs[i]
+    int builtin;
+};
+
+struct sh_completion {
+    struct sh_complete_entry *entries; // sorted by name, no duplicates
+    size_t count;
+    size_t size;
+    char *dirs[SH_COMPLETE_MAX_DIRS];
+    int wds[SH_COMPLETE_MAX_DIRS]; // inotify watch per directory, or -1
+    int ndirs;
+    int fd;                        // inotify instance, or -1
+    int built;
+    unsigned int path_version;     // sh_path_version the index was built for
+} sh_completions = {.fd = -1};
+
+/**
+ * @brief Whether a directory entry is something that can be run.
+ *
+ * Any execute bit counts, as for ls -F; sh_hash_search still has the last
+ * word when the command is run.
+ * @param dir_fd The directory.
+ * @param name Name of the entry.
+ * @return 1 for an executable regular file, or a link to one, else 0.
+ */
+int sh_complete_executable(int dir_fd, const char *name) {
+    struct stat st;
+
+    return fstatat(dir_fd, name, &st, 0) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111);
+}
+
+/**
+ * @brief Find where a name is, or would go, in the index.
+ * @param name The name, or a prefix of names; need not be terminated.
+ * @param len Its length.
+ * @param after Whether to skip the entries starting with name too.
+ * @return Index of the first entry not ordered before name, or with after
+ * set, the first ordered after every entry starting with it.
+ */
+size_t sh_complete_bound(const char *name, size_t len, int after) {
+    size_t low = 0, high = sh_completions.count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+
+        if (strncmp(sh_completions.entries[mid].name, name, len) < after) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Add an entry at a position in the index.
+ * @param at The position; count to append, which leaves the index unsorted
+ * until sh_complete_sort.
+ * @param name The name, copied.
+ * @param dirs Directories it is in.
+ * @param builtin Whether it is a builtin.
+ */
+void sh_complete_insert(size_t at, const char *name, uint64_t dirs, int builtin) {
+    struct sh_complete_entry *entry;
+
+    sh_completions.entries = sh_grow(sh_completions.entries, &sh_completions.size, sh_completions.count,
+                                  sizeof(*entry));
+    entry = &sh_completions.entries[at];
+    memmove(entry + 1, entry, (sh_completions.count - at) * sizeof(*entry));
+    sh_completions.count++;
+    entry->name = sh_xstrdup(name);
+    entry->dirs = dirs;
+    entry->builtin = builtin;
+}
+
+/**
+ * @brief Compare two index entries by name, for qsort.
+ */
+int sh_complete_compare(const void *a, const void *b) {
+    return strcmp(((const struct sh_complete_entry *) a)->name,
+                  ((const struct sh_complete_entry *) b)->name);
+}
+
+/**
+ * @brief Sort the index and merge the entries a name has in several
+ * directories into one.
+ */
+void sh_complete_sort() {
+    struct sh_complete_entry *entries = sh_completions.entries;
+    size_t kept = 0;
+
+    qsort(entries, sh_completions.count, sizeof(*entries), sh_complete_compare);
+    for (size_t i = 0; i < sh_completions.count; i++) {
+        if (kept > 0 && strcmp(entries[kept - 1].name, entries[i].name) == 0) {
+            entries[kept - 1].dirs |= entries[i].dirs;
+            entries[kept - 1].builtin |= entries[i].builtin;
+            free(entries[i].name);
+        } else {
+            entries[kept++] = entries[i];
+        }
+    }
+    sh_completions.count = kept;
+}
+
+/**
+ * @brief Add the executables in one $PATH directory to the index.
+ * @param dir Index of the directory in sh_completions.dirs.
+ */
+void sh_complete_scan(int dir) {
+    int dir_fd = open(sh_completions.dirs[dir], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct dirent *entry;
+    DIR *stream;
+
+    if (dir_fd == -1 || (stream = fdopendir(dir_fd)) == NULL) {
+        if (dir_fd != -1) {
+            close(dir_fd);
+        }
+        return;
+    }
+    while ((entry = readdir(stream)) != NULL) {
+        // Directories cannot be run, whatever their mode.
+        if (entry->d_type == DT_DIR) {
+            continue;
+        }
+        if (sh_complete_executable(dir_fd, entry->d_name)) {
+            sh_complete_insert(sh_completions.count, entry->d_name, (uint64_t) 1 << dir, 0);
+        }
+    }
+    closedir(stream);
+}
+
+/**
+ * @brief Drop the index and its watches.
+ */
+void sh_complete_clear() {
+    for (size_t i = 0; i < sh_completions.count; i++) {
+        free(sh_completions.entries[i].name);
+    }
+    sh_completions.count = 0;
+    for (int i = 0; i < sh_completions.ndirs; i++) {
+        free(sh_completions.dirs[i]);
+    }
+    sh_completions.ndirs = 0;
+    if (sh_completions.fd != -1) {
+        // Closing the instance removes every watch on it.
+        close(sh_completions.fd);
+        sh_completions.fd = -1;
+    }
+    sh_completions.built = 0;
+}
+
+/**
+ * @brief Build the index from the builtins and the current $PATH, and watch
+ * the directories for changes.
+ */
+void sh_complete_build() {
+    const char *path = sh_var_get("PATH");
+
+    sh_complete_clear();
+    sh_completions.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    sh_completions.path_version = sh_path_version;
+    sh_completions.built = 1;
+
+    for (int i = 0; i < SH_NUM_BUILTINS; i++) {
+        sh_complete_insert(sh_completions.count, builtins[i].name, 0, 1);
+    }
+
+    path = path != NULL ? path : SH_DEFAULT_PATH;
+    while (*path != '\0' && sh_completions.ndirs < SH_COMPLETE_MAX_DIRS) {
+        const char *end = strchrnul(path, ':');
+        int dir = sh_completions.ndirs, wd = -1, repeat = 0;
+
+        if (path[0] == '/') {
+            sh_completions.dirs[dir] = sh_xstrndup(path, end - path);
+            if (sh_completions.fd != -1) {
+                wd = inotify_add_watch(sh_completions.fd, sh_completions.dirs[dir], SH_COMPLETE_EVENTS);
+            }
+            // A directory listed twice gets the first one's watch back.
+            for (int j = 0; j < dir && wd != -1; j++) {
+                repeat |= sh_completions.wds[j] == wd;
+            }
+            if (repeat) {
+                free(sh_completions.dirs[dir]);
+            } else {
+                sh_completions.wds[dir] = wd;
+                sh_completions.ndirs++;
+                sh_complete_scan(dir);
+            }
+        }
+        path = *end == ':' ? end + 1 : end;
+    }
+    sh_complete_sort();
+}
+
+/**
+ * @brief Apply one inotify event to the index.
+ * @param event The event.
+ * @return 0, or -1 if the index has to be built again.
+ */
+int sh_complete_event(const struct inotify_event *event) {
+    int dir, dir_fd, executable;
+    size_t at;
+
+    if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        // Events were lost or a directory went away.
+        return -1;
+    }
+    for (dir = 0; dir < sh_completions.ndirs && sh_completions.wds[dir] != event->wd; dir++) {
+    }
+    if (dir == sh_completions.ndirs || event->len == 0) {
+        return 0;
+    }
+
+    executable = 0;
+    if (event->mask & (IN_CREATE | IN_MOVED_TO | IN_ATTRIB)) {
+        dir_fd = open(sh_completions.dirs[dir], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd != -1) {
+            executable = sh_complete_executable(dir_fd, event->name);
+            close(dir_fd);
+        }
+    }
+
+    at = sh_complete_bound(event->name, strlen(event->name) + 1, 0);
+    if (at < sh_completions.count && strcmp(sh_completions.entries[at].name, event->name) == 0) {
+        struct sh_complete_entry *entry = &sh_completions.entries[at];
+
+        if (executable) {
+            entry->dirs |= (uint64_t) 1 << dir;
+        } else {
+            entry->dirs &= ~((uint64_t) 1 << dir);
+        }
+        if (entry->dirs == 0 && !entry->builtin) {
+            free(entry->name);
+            memmove(entry, entry + 1, (sh_completions.count - at - 1) * sizeof(*entry));
+            sh_completions.count--;
+        }
+    } else if (executable) {
+        sh_complete_insert(at, event->name, (uint64_t) 1 << dir, 0);
+    }
+    return 0;
+}
+
+/**
+ * @brief Bring the index up to date: build it on first use or after $PATH
+ * changed, otherwise apply the inotify events that came in since the last
+ * query.
+ */
+void sh_complete_refresh() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+
+    if (!sh_completions.built || sh_completions.path_version != sh_path_version) {
+        sh_complete_build();
+        return;
+    }
+    while (sh_completions.fd != -1 && (n = read(sh_completions.fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *event = (const struct inotify_event *) p;
+
+            if (sh_complete_event(event) == -1) {
+                sh_complete_build();
+                return;
+            }
+            p += sizeof(*event) + event->len;
+        }
+    }
+}
+
+/**
+ * @brief Find the commands starting with a prefix.
+ * @param prefix The prefix; need not be terminated.
+ * @param len Its length.
+ * @param count Set to the number of matches.
+ * @return The first match; the others follow it in sh_completions.entries, in
+ * order. Valid until the next query.
+ */
+struct sh_complete_entry *sh_complete_find(const char *prefix, size_t len, size_t *count) {
+    size_t first;
+
+    sh_complete_refresh();
+    first = sh_complete_bound(prefix, len, 0);
+    *count = sh_complete_bound(prefix, len, 1) - first;
+    return sh_completions.entries + first;
+}
+
+/*
+ * Profiling. Built with -DSH_PROFILE, the shell times every phase of running
+ * a command and keeps a histogram per phase for the shstats builtin. Without
+ * it the SH_PROFILE_* macros expand to nothing, so they cost nothing.
+ */
+enum sh_phase {
+    SH_PHASE_READ,   // reading a line (includes waiting for the user)
+    SH_PHASE_PARSE,  // lexing and parsing it
+    SH_PHASE_LOOKUP, // finding a builtin or a program
+    SH_PHASE_LAUNCH, // starting a child
+    SH_PHASE_WAIT,   // waiting for a foreground job
+    SH_NUM_PHASES
+};
+
+const char *sh_phase_names[SH_NUM_PHASES] = {"read", "parse", "lookup", "launch", "wait"};
+
+/**
+ * @brief Read the monotonic clock.
+ * @return Current time in nanoseconds.
+ */
+long long sh_clock_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#ifdef SH_PROFILE
+// Log-linear buckets: four per power of two of nanoseconds, so a percentile
+// read off them is at most 25% above the true value.
+#define SH_PROFILE_SUB_BITS 2
+#define SH_PROFILE_BUCKETS (64 << SH_PROFILE_SUB_BITS)
+
+#define SH_PROFILE_START(phase) long long sh_profile_##phase = sh_clock_ns()
+#define SH_PROFILE_STOP(phase) \
+        sh_profile_record(SH_PHASE_##phase, sh_clock_ns() - sh_profile_##phase)
+
+struct sh_profile {
+    uint64_t buckets[SH_PROFILE_BUCKETS];
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+struct sh_profile sh_profiles[SH_NUM_PHASES];
+
+/**
+ * @brief Get the histogram bucket of a duration.
+ * @param ns The duration in nanoseconds.
+ * @return The bucket.
+ */
+int sh_profile_bucket(uint64_t ns) {
+    int log;
+
+    if (ns < (1 << SH_PROFILE_SUB_BITS)) {
+        return ns;
+    }
+    log = 63 - __builtin_clzll(ns);
+    return (log - SH_PROFILE_SUB_BITS + 1) << SH_PROFILE_SUB_BITS
+           | ((ns >> (log - SH_PROFILE_SUB_BITS)) & ((1 << SH_PROFILE_SUB_BITS) - 1));
+}
+
+/**
+ * @brief Get the largest duration that falls in a bucket.
+ * @param bucket The bucket.
+ * @return The duration in nanoseconds.
+ */
+uint64_t sh_profile_bucket_max(int bucket) {
+    int log = (bucket >> SH_PROFILE_SUB_BITS) + SH_PROFILE_SUB_BITS - 1;
+    uint64_t mantissa = (1 << SH_PROFILE_SUB_BITS) | (bucket & ((1 << SH_PROFILE_SUB_BITS) - 1));
+
+    if (bucket < (1 << SH_PROFILE_SUB_BITS)) {
+        return bucket;
+    }
+    return ((mantissa + 1) << (log - SH_PROFILE_SUB_BITS)) - 1;
+}
+
+/**
+ * @brief Record how long one run of a phase took.
+ * @param phase The phase.
+ * @param ns The duration in nanoseconds.
+ */
+void sh_profile_record(enum sh_phase phase, long long ns) {
+    struct sh_profile *profile = &sh_profiles[phase];
+
+    profile->buckets[sh_profile_bucket(ns)]++;
+    profile->count++;
+    profile->total_ns += ns;
+    if ((uint64_t) ns > profile->max_ns) {
+        profile->max_ns = ns;
+    }
+}
+
+/**
+ * @brief Find a percentile of a phase's durations.
+ * @param profile The phase's histogram.
+ * @param percent The percentile, 0 to 100.
+ * @return The upper end of the bucket it falls in, in nanoseconds.
+ */
+uint64_t sh_profile_percentile(const struct sh_profile *profile, int percent) {
+    uint64_t rank = (profile->count * percent + 99) / 100, seen = 0;
+
+    for (int i = 0; i < SH_PROFILE_BUCKETS; i++) {
+        seen += profile->buckets[i];
+        if (seen >= rank && seen > 0) {
+            return sh_profile_bucket_max(i) < profile->max_ns ? sh_profile_bucket_max(i)
+                                                                : profile->max_ns;
+        }
+    }
+    return 0;
+}
+#else
+#define SH_PROFILE_START(phase)
+#define SH_PROFILE_STOP(phase)
+#endif
+
+/*
+ * Startup trace. With --startup-trace the shell reports on stderr how far
+ * into main each phase of startup ended, up to the first external command
+ * it runs; the time before main (exec and dynamic linking) is not seen.
+ */
+int sh_startup_trace;
+long long sh_startup_ns; // when main was entered
+
+/**
+ * @brief Report the end of a startup phase, with --startup-trace.
+ * @param phase Name of the phase.
+ */
+void sh_trace_startup(const char *phase) {
+    static long long last;
+    long long now;
+
+    if (!sh_startup_trace) {
+        return;
+    }
+    now = sh_clock_ns();
+    fprintf(stderr, "sh: startup: %-12s %9.1f us  (+%.1f us)\n", phase,
+            (now - sh_startup_ns) / 1e3, (now - (last ? last : sh_startup_ns)) / 1e3);
+    last = now;
+}
+
+/*
+ * Jobs. Every pipeline the shell starts is a job. Children are reaped
+ * asynchronously: every process has a pidfd, all of them sit in one epoll
+ * set, and sh_reap() collects whatever changed state whenever the shell
+ * gets to it, so any number of background jobs run while the shell goes
+ * on, and waiting for all of them is a single epoll_wait. A process is
+ * only ever reaped through its own pidfd, never by a wait for any child,
+ * so a pid cannot be mistaken for a process that reused it.
+ *
+ * A pidfd only tells of exits. With job control, stops and continues come
+ * from SIGCHLD, whose handler writes a byte to a self-pipe in the same
+ * epoll set; so does a child that got no pidfd, which is then waited for
+ * by pid. A shell without job control normally has no SIGCHLD handler.
+ *
+ * A job run by the timeout builtin also has a timerfd in the set, so the
+ * same wait notices when its time is up, and a builtin stage run on a
+ * pipeline thread has an eventfd there that it signals when it returns.
+ *
+ * Exits are reaped with waitid, which also gives the resource usage of the
+ * process, and every job adds it up. With $SH_USAGE_LOG naming a file, one
+ * JSON line per finished job is appended to it.
+ */
+#define SH_JOBS_MAX_DONE 256
+#define SH_REAP_EVENTS 64
+
+enum sh_job_state {
+    SH_JOB_RUNNING,
+    SH_JOB_STOPPED,
+    SH_JOB_DONE
+};
+
+// What an entry of the child epoll set is for: its data.ptr points to one
+// of these, the first member of a struct sh_process or sh_job_timer. The
+// SIGCHLD self-pipe's is NULL.
+enum sh_watch {
+    SH_WATCH_PROCESS,
+    SH_WATCH_THREAD,
+    SH_WATCH_TIMER
+};
+
+struct sh_process {
+    enum sh_watch watch;
+    pid_t pid;  // 0 for a pipeline thread
+    int pidfd;  // -1 once reaped, or if there is none; a thread's eventfd
+    int status; // wait status, once done
+    enum sh_job_state state;
+    struct sh_job *job;
+    struct sh_stage *stage; // the thread, until it is joined
+};
+
+struct sh_job {
+    int id;
+    pid_t pgid;
+    struct sh_process *procs;
+    int nprocs;
+    enum sh_job_state state;
+    int background;
+    int notified; // the current state has been reported
+    char *command;
+    long long started;    // sh_clock_ns() when it was created
+    long long finished;   // and when its last process was reaped
+    struct rusage usage;  // of its processes that have finished
+    struct sh_job_timer *timer; // its time limit; NULL without one
+    struct sh_job *next;
+};
+
+// A job's time limit, as set by the timeout builtin.
+struct sh_job_timer {
+    enum sh_watch watch;
+    int fd;                 // timerfd
+    int signal;             // sent when the time is up
+    long long kill_after;   // ns after that until SIGKILL; 0 for never
+    int fired;              // 1 once signal was sent, 2 once SIGKILL was
+    struct sh_job *job;
+};
+
+// Jobs in the order they were started.
+struct sh_job *sh_job_table;
+
+// Exit status of the last command, as in $?. Per thread, like
+// sh_prev_status, so that a builtin on a pipeline thread has its own.
+__thread int sh_last_status;
+
+// Pid of the last job started in the background, as in $!; 0 for none.
+pid_t sh_last_background;
+
+// The shell's own pid, as in $$, and name, as in $0.
+pid_t sh_shell_pid;
+const char *sh_name = "sh";
+
+// $? from before the running builtin started; builtins report their own
+// status by setting sh_last_status, which starts out as 0.
+__thread int sh_prev_status;
+
+// The stdin fd and stdout stream of a builtin running on a pipeline
+// thread; the shell's own thread has neither and uses its own.
+__thread int sh_stage_stdin = -1;
+__thread FILE *sh_stage_stdout;
+
+// Whether the shell reads commands from a terminal, and so prompts.
+int sh_interactive;
+
+// Set when the shell is interactive: each job gets its own process group
+// and is handed the terminal while it runs in the foreground.
+int sh_job_control;
+pid_t sh_pgid;
+struct termios sh_tmodes;
+
+// The epoll set of every live child's pidfd, and of the SIGCHLD self-pipe's
+// read end when there is one; -1 until the first job.
+int sh_child_epoll = -1;
+
+// The SIGCHLD self-pipe; both ends are non-blocking and close-on-exec.
+int sh_sigchld_pipe[2] = {-1, -1};
+
+// Usage of the foreground jobs that finished since the time builtin last
+// cleared it.
+struct rusage sh_fg_usage;
+
+// Where finished jobs are logged, from $SH_USAGE_LOG; -1 for nowhere.
+int sh_usage_log_fd = -1;
+
+// Signals the shell ignores itself, restored to default in every child.
+const int sh_job_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU};
+
+#define SH_NUM_JOB_SIGNALS ((int) (sizeof(sh_job_signals) / sizeof(sh_job_signals[0])))
+
+/**
+ * @brief SIGCHLD handler: wake up whoever is waiting on the self-pipe.
+ * @param sig Not examined.
+ */
+void sh_sigchld(int sig) {
+    int saved_errno = errno;
+
+    (void) sig;
+    // The pipe is non-blocking: if it is full a wakeup is pending anyway.
+    if (write(sh_sigchld_pipe[1], "", 1) == -1) {
+    }
+    errno = saved_errno;
+}
+
+/**
+ * @brief Install the SIGCHLD handler, if it is not installed yet.
+ */
+void sh_sigchld_start() {
+    struct epoll_event event = {EPOLLIN, {.ptr = NULL}};
+    struct sigaction action;
+
+    if (sh_sigchld_pipe[0] != -1) {
+        return;
+    }
+    if (pipe2(sh_sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1 ||
+        epoll_ctl(sh_child_epoll, EPOLL_CTL_ADD, sh_sigchld_pipe[0], &event) == -1) {
+        perror("sh: pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &sh_sigchld;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+}
+
+/**
+ * @brief Set up child tracking and open the usage log. Done when the first
+ * job is created, so a shell that never starts one never pays for it.
+ */
+void sh_jobs_start() {
+    char *log = getenv("SH_USAGE_LOG");
+
+    if ((sh_child_epoll = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("sh: epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    if (sh_job_control) {
+        sh_sigchld_start();
+    }
+
+    if (log != NULL && log[0] != '\0') {
+        sh_usage_log_fd = open(log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (sh_usage_log_fd == -1) {
+            fprintf(stderr, "sh: %s: %s\n", log, strerror(errno));
+        }
+    }
+}
+
+/**
+ * @brief When interactive, take control of the terminal for job control.
+ * @param interactive Whether the shell reads commands from a terminal.
+ */
+void sh_jobs_init(int interactive) {
+    if (!interactive) {
+        return;
+    }
+
+    // Wait until we are in the foreground, then move into our own group.
+    while (tcgetpgrp(STDIN_FILENO) != (sh_pgid = getpgrp())) {
+        kill(-sh_pgid, SIGTTIN);
+    }
+    for (int i = 0; i < SH_NUM_JOB_SIGNALS; i++) {
+        signal(sh_job_signals[i], SIG_IGN);
+    }
+    sh_pgid = getpid();
+    if (setpgid(sh_pgid, sh_pgid) == -1 && errno != EPERM) {
+        perror("sh: setpgid");
+        return;
+    }
+    tcsetpgrp(STDIN_FILENO, sh_pgid);
+    tcgetattr(STDIN_FILENO, &sh_tmodes);
+    sh_job_control = 1;
+}
+
+/**
+ * @brief Convert a wait status to an exit status, as in $?.
+ * @param status The wait status.
+ * @return The exit status.
+ */
+int sh_exit_status(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    } else if (WIFSTOPPED(status)) {
+        return 128 + WSTOPSIG(status);
+    }
+    return 0;
+}
+
+/**
+ * @brief Get the exit status of a job, from its last process.
+ * @param job The job.
+ * @return The exit status.
+ */
+int sh_job_status(struct sh_job *job) {
+    struct sh_process *last = &job->procs[job->nprocs - 1];
+
+    if (job->state == SH_JOB_STOPPED) {
+        return 128 + SIGTSTP;
+    }
+    if (job->timer != NULL && job->timer->fired) {
+        // As GNU timeout.
+        return job->timer->fired == 2 ? 128 + SIGKILL : 124;
+    }
+    return sh_exit_status(last->status);
+}
+
+/**
+ * @brief Add the resource usage of a process to a total.
+ *
+ * Times and context switches add up; the maximum RSS of the total is the
+ * largest of any one process.
+ * @param total The total.
+ * @param usage Usage of the process.
+ */
+void sh_rusage_add(struct rusage *total, const struct rusage *usage) {
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+/**
+ * @brief Append a line about a finished job to the usage log.
+ * @param job The job.
+ */
+void sh_job_log(struct sh_job *job) {
+    const struct rusage *usage = &job->usage;
+    char *line = sh_xmalloc(6 * strlen(job->command) + 256), *p = line;
+
+    p = stpcpy(p, "{\"command\":\"");
+    for (const unsigned char *c = (const unsigned char *) job->command; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            *p++ = '\\';
+            *p++ = *c;
+        } else if (*c < 0x20) {
+            p += sprintf(p, "\\u%04x", *c);
+        } else {
+            *p++ = *c;
+        }
+    }
+    p += sprintf(p, "\",\"pid\":%ld,\"status\":%d,\"real_us\":%lld,"
+                    "\"user_us\":%lld,\"sys_us\":%lld,\"maxrss_kb\":%ld,"
+                    "\"nvcsw\":%ld,\"nivcsw\":%ld}\n",
+                 (long) job->procs[job->nprocs - 1].pid, sh_job_status(job),
+                 (job->finished - job->started) / 1000,
+                 usage->ru_utime.tv_sec * 1000000LL + usage->ru_utime.tv_usec,
+                 usage->ru_stime.tv_sec * 1000000LL + usage->ru_stime.tv_usec,
+                 usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+
+    // One write with O_APPEND, so concurrent shells never mix their lines.
+    if (write(sh_usage_log_fd, line, p - line) == -1) {
+    }
+    free(line);
+}
+
+/**
+ * @brief Create a job and add it to the job table.
+ * @param nprocs Number of processes it will have.
+ * @param command Text of the command, for display. Copied.
+ * @param background Whether it runs in the background.
+ * @return The job.
+ */
+struct sh_job *sh_job_new(int nprocs, const char *command, int background) {
+    struct sh_job *job = sh_xcalloc(1, sizeof(*job));
+    struct sh_job **link = &sh_job_table;
+
+    if (sh_child_epoll == -1) {
+        sh_jobs_start();
+    }
+    job->id = 1;
+    while (*link != NULL) {
+        if ((*link)->id >= job->id) {
+            job->id = (*link)->id + 1;
+        }
+        link = &(*link)->next;
+    }
+    *link = job;
+
+    job->procs = sh_xcalloc(nprocs, sizeof(struct sh_process));
+    job->command = sh_xstrdup(command);
+    job->background = background;
+    job->state = SH_JOB_DONE;
+    job->started = sh_clock_ns();
+    return job;
+}
+
+/**
+ * @brief Stop watching a process: close its pidfd.
+ * @param proc The process.
+ */
+void sh_process_forget(struct sh_process *proc) {
+    if (proc->pidfd == -1) {
+        return;
+    }
+    // A forked child may hold the pidfd too, which would keep it in the set.
+    epoll_ctl(sh_child_epoll, EPOLL_CTL_DEL, proc->pidfd, NULL);
+    close(proc->pidfd);
+    proc->pidfd = -1;
+}
+
+/**
+ * @brief Remove a job from the job table and free it.
+ * @param job The job.
+ */
+void sh_job_free(struct sh_job *job) {
+    struct sh_job **link = &sh_job_table;
+
+    while (*link != job) {
+        link = &(*link)->next;
+    }
+    *link = job->next;
+    for (int i = 0; i < job->nprocs; i++) {
+        sh_process_forget(&job->procs[i]);
+    }
+    if (job->timer != NULL) {
+        epoll_ctl(sh_child_epoll, EPOLL_CTL_DEL, job->timer->fd, NULL);
+        close(job->timer->fd);
+        free(job->timer);
+    }
+    free(job->procs);
+    free(job->command);
+    free(job);
+}
+
+/**
+ * @brief Recompute a job's state from the state of its processes.
+ * @param job The job.
+ */
+void sh_job_update_state(struct sh_job *job) {
+    enum sh_job_state state = SH_JOB_DONE;
+
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].state == SH_JOB_RUNNING) {
+            state = SH_JOB_RUNNING;
+            break;
+        } else if (job->procs[i].state == SH_JOB_STOPPED) {
+            state = SH_JOB_STOPPED;
+        }
+    }
+    if (state != job->state) {
+        job->state = state;
+        job->notified = 0;
+        if (state == SH_JOB_DONE) {
+            job->finished = sh_clock_ns();
+            if (sh_usage_log_fd != -1) {
+                sh_job_log(job);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Record a process of a job.
+ * @param job The job.
+ * @param pid Pid of the process, or -1 if it failed to start; that counts
+ * as a process which exited with status 127.
+ */
+void sh_job_add(struct sh_job *job, pid_t pid) {
+    struct sh_process *proc = &job->procs[job->nprocs++];
+
+    proc->watch = SH_WATCH_PROCESS;
+    proc->pid = pid;
+    proc->job = job;
+    proc->pidfd = -1;
+    if (pid > 0) {
+        // Not reaped yet, so pid is still this child.
+        struct epoll_event event = {EPOLLIN, {.ptr = proc}};
+
+        proc->state = SH_JOB_RUNNING;
+        if (job->pgid == 0) {
+            job->pgid = pid;
+        }
+        proc->pidfd = syscall(SYS_pidfd_open, pid, 0);
+        if (proc->pidfd != -1 && epoll_ctl(sh_child_epoll, EPOLL_CTL_ADD, proc->pidfd, &event) == -1) {
+            close(proc->pidfd);
+            proc->pidfd = -1;
+        }
+        if (proc->pidfd == -1) {
+            // Waited for by pid on SIGCHLD instead. It may have exited
+            // before the handler was there, so look once in any case.
+            sh_sigchld_start();
+            sh_sigchld(SIGCHLD);
+        }
+    } else {
+        proc->state = SH_JOB_DONE;
+        proc->status = 127 << 8;
+    }
+    sh_job_update_state(job);
+}
+
+/**
+ * @brief Send a signal to every process of a job that is still running.
+ * @param job The job.
+ * @param sig The signal.
+ */
+void sh_job_kill(struct sh_job *job, int sig) {
+    if (sh_job_control) {
+        // A job of only pipeline threads has no process group.
+        if (job->pgid > 0) {
+            kill(-job->pgid, sig);
+        }
+        return;
+    }
+    // Without job control the job shares the shell's process group.
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].state != SH_JOB_DONE && job->procs[i].pid > 0) {
+            kill(job->procs[i].pid, sig);
+        }
+    }
+}
+
+/**
+ * @brief Give a job a time limit.
+ * @param job The job, just started.
+ * @param ns Time it may run for.
+ * @param sig Signal sent to it when the time is up.
+ * @param kill_after How long after that it is sent SIGKILL; 0 for never.
+ */
+void sh_job_timer_start(struct sh_job *job, long long ns, int sig, long long kill_after) {
+    struct sh_job_timer *timer = sh_xcalloc(1, sizeof(*timer));
+    struct itimerspec when = {{0, 0}, {ns / 1000000000, ns % 1000000000}};
+    struct epoll_event event = {EPOLLIN, {.ptr = timer}};
+
+    if (job->state != SH_JOB_RUNNING) {
+        free(timer);
+        return;
+    }
+    timer->watch = SH_WATCH_TIMER;
+    timer->signal = sig;
+    timer->kill_after = kill_after;
+    timer->job = job;
+    timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer->fd == -1 || timerfd_settime(timer->fd, 0, &when, NULL) == -1 ||
+        epoll_ctl(sh_child_epoll, EPOLL_CTL_ADD, timer->fd, &event) == -1) {
+        perror("sh: timeout");
+        if (timer->fd != -1) {
+            close(timer->fd);
+        }
+        free(timer);
+        return;
+    }
+    job->timer = timer;
+}
+
+/**
+ * @brief Act on a job's time being up: signal it, and arm the timer again
+ * for SIGKILL if there is to be one.
+ * @param timer The job's time limit.
+ */
+void sh_job_timer_fire(struct sh_job_timer *timer) {
+    uint64_t expirations;
+
+    if (read(timer->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    if (timer->fired == 0) {
+        timer->fired = timer->signal == SIGKILL ? 2 : 1;
+        sh_job_kill(timer->job, timer->signal);
+        if (timer->signal != SIGKILL && timer->kill_after > 0) {
+            struct itimerspec when = {{0, 0}, {timer->kill_after / 1000000000,
+                                               timer->kill_after % 1000000000}};
+
+            timerfd_settime(timer->fd, 0, &when, NULL);
+        }
+    } else {
+        timer->fired = 2;
+        sh_job_kill(timer->job, SIGKILL);
+    }
+    // A stopped job would never get to act on it.
+    if (timer->job->state == SH_JOB_STOPPED) {
+        sh_job_kill(timer->job, SIGCONT);
+    }
+}
+
+/**
+ * @brief Convert what waitid reports to a wait status.
+ * @param info What waitid filled in.
+ * @return The wait status.
+ */
+int sh_wait_status(const siginfo_t *info) {
+    switch (info->si_code) {
+    case CLD_EXITED:
+        return (info->si_status & 0xff) << 8;
+    case CLD_KILLED:
+        return info->si_status;
+    case CLD_DUMPED:
+        return info->si_status | 0x80;
+    case CLD_CONTINUED:
+        return 0xffff;
+    default: // stopped or trapped
+        return (info->si_status << 8) | 0x7f;
+    }
+}
+
+/**
+ * @brief Record a process's change of state.
+ * @param proc The process.
+ * @param status Its wait status.
+ * @param usage Its resource usage, if it has exited.
+ */
+void sh_process_update(struct sh_process *proc, int status, const struct rusage *usage) {
+    if (WIFSTOPPED(status)) {
+        proc->state = SH_JOB_STOPPED;
+    } else if (WIFCONTINUED(status)) {
+        proc->state = SH_JOB_RUNNING;
+    } else {
+        proc->state = SH_JOB_DONE;
+        proc->status = status;
+        sh_rusage_add(&proc->job->usage, usage);
+        sh_process_forget(proc);
+    }
+    sh_job_update_state(proc->job);
+}
+
+/**
+ * @brief Find the process of a job with a pid.
+ * @param pid The pid.
+ * @return The process, or NULL if no job has it.
+ */
+struct sh_process *sh_process_find(pid_t pid) {
+    for (struct sh_job *job = sh_job_table; job != NULL; job = job->next) {
+        for (int i = 0; i < job->nprocs; i++) {
+            if (job->procs[i].pid == pid && job->procs[i].state != SH_JOB_DONE) {
+                return &job->procs[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Collect the stops and continues SIGCHLD told of, and the children
+ * without a pidfd that changed state.
+ */
+void sh_reap_sigchld() {
+    char drain[64];
+    struct rusage usage;
+    siginfo_t info;
+    int status;
+
+    // Drain first: a SIGCHLD arriving after this leaves a byte behind, so
+    // no state change can slip between the drain and the next wait.
+    while (read(sh_sigchld_pipe[0], drain, sizeof(drain)) > 0) {
+    }
+
+    // Leaves exits alone: those are for each process's pidfd.
+    while (sh_job_control) {
+        struct sh_process *proc;
+
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WSTOPPED | WCONTINUED | WNOHANG) == -1 || info.si_pid == 0) {
+            break;
+        }
+        if ((proc = sh_process_find(info.si_pid)) != NULL) {
+            sh_process_update(proc, sh_wait_status(&info), NULL);
+        }
+    }
+
+    for (struct sh_job *job = sh_job_table; job != NULL; job = job->next) {
+        for (int i = 0; i < job->nprocs; i++) {
+            struct sh_process *proc = &job->procs[i];
+
+            if (proc->pidfd == -1 && proc->state != SH_JOB_DONE &&
+                wait4(proc->pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage) > 0) {
+                sh_process_update(proc, status, &usage);
+            }
+        }
+    }
+}
+
+// Defined with the pipelines, further down.
+void sh_stage_reap(struct sh_process *proc);
+
+/**
+ * @brief Collect every child that has changed state.
+ * @param timeout How long to wait for one to, in milliseconds: 0 not to
+ * block, -1 to block until one does or a signal arrives.
+ */
+void sh_reap_events(int timeout) {
+    struct epoll_event events[SH_REAP_EVENTS];
+    int count, sigchld = 0;
+
+    if (sh_child_epoll == -1) {
+        return; // no job has been started
+    }
+    do {
+        count = epoll_wait(sh_child_epoll, events, SH_REAP_EVENTS, timeout);
+        for (int i = 0; i < count; i++) {
+            enum sh_watch *watch = events[i].data.ptr;
+            struct sh_process *proc = (struct sh_process *) watch;
+            struct rusage usage;
+            siginfo_t info;
+
+            if (watch == NULL) {
+                sigchld = 1;
+                continue;
+            } else if (*watch == SH_WATCH_TIMER) {
+                sh_job_timer_fire((struct sh_job_timer *) watch);
+                continue;
+            } else if (*watch == SH_WATCH_THREAD) {
+                sh_stage_reap(proc);
+                continue;
+            }
+            info.si_pid = 0;
+            if (syscall(SYS_waitid, P_PIDFD, proc->pidfd, &info, WEXITED | WNOHANG, &usage) == 0 &&
+                info.si_pid != 0) {
+                sh_process_update(proc, sh_wait_status(&info), &usage);
+            }
+        }
+        timeout = 0;
+    } while (count == SH_REAP_EVENTS);
+
+    if (sigchld) {
+        sh_reap_sigchld();
+    }
+}
+
+/**
+ * @brief Collect every child that has changed state, without blocking.
+ */
+void sh_reap() {
+    sh_reap_events(0);
+}
+
+/**
+ * @brief Block until a child changes state or a signal arrives.
+ */
+void sh_reap_wait() {
+    sh_reap_events(-1);
+}
+
+/**
+ * @brief Print a job's state, as listed by the jobs builtin.
+ * @param job The job.
+ */
+void sh_job_print(struct sh_job *job) {
+    const char *state = job->state == SH_JOB_RUNNING ? "Running"
+                        : job->state == SH_JOB_STOPPED ? "Stopped" : "Done";
+
+    printf("[%d]%c  %-22s  %s\n", job->id, job->next == NULL ? '+' : ' ', state, job->command);
+    job->notified = 1;
+}
+
+/**
+ * @brief Run a job in the foreground until it finishes or stops.
+ *
+ * A job that finishes is removed; one that stops stays in the table as a
+ * stopped job. Either way $? is set from it.
+ * @param job The job.
+ */
+void sh_job_foreground(struct sh_job *job) {
+    job->background = 0;
+    if (sh_job_control && job->state == SH_JOB_RUNNING && job->pgid > 0) {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+
+    SH_PROFILE_START(WAIT);
+    while (job->state == SH_JOB_RUNNING) {
+        sh_reap_wait();
+    }
+    SH_PROFILE_STOP(WAIT);
+
+    if (sh_job_control) {
+        tcsetpgrp(STDIN_FILENO, sh_pgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &sh_tmodes);
+    }
+
+    sh_last_status = sh_job_status(job);
+    if (sh_job_control && sh_last_status == 128 + SIGINT) {
+        printf("\n"); // keep the prompt off the line the ^C was echoed on
+    }
+    if (job->state == SH_JOB_STOPPED) {
+        job->background = 1;
+        printf("\n");
+        sh_job_print(job);
+    } else {
+        sh_rusage_add(&sh_fg_usage, &job->usage);
+        sh_job_free(job);
+    }
+}
+
+/**
+ * @brief Report background jobs that finished or stopped since the last
+ * prompt, and forget finished ones.
+ *
+ * Without a terminal nothing is printed; finished jobs are kept for the
+ * wait builtin, up to SH_JOBS_MAX_DONE of them.
+ */
+void sh_job_notify() {
+    struct sh_job *job, *next;
+    int done = 0;
+
+    sh_reap();
+    for (job = sh_job_table; job != NULL; job = job->next) {
+        done += job->state == SH_JOB_DONE;
+    }
+
+    for (job = sh_job_table; job != NULL; job = next) {
+        next = job->next;
+        if (sh_interactive) {
+            if (!job->notified) {
+                sh_job_print(job);
+            }
+            if (job->state == SH_JOB_DONE) {
+                sh_job_free(job);
+            }
+        } else if (job->state == SH_JOB_DONE && done > SH_JOBS_MAX_DONE) {
+            sh_job_free(job);
+            done--;
+        }
+    }
+}
+
+/**
+ * @brief Find a job from a job spec.
+ * @param spec "%n" for job n, "%%" or "%+" for the current (most recent)
+ * job, a pid, or NULL for the current job.
+ * @return The job, or NULL if there is no such job.
+ */
+struct sh_job *sh_job_find(const char *spec) {
+    struct sh_job *job, *current = NULL;
+    char *end;
+    long n;
+
+    for (job = sh_job_table; job != NULL; job = job->next) {
+        current = job;
+    }
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        return current;
+    }
+
+    n = strtol(spec[0] == '%' ? spec + 1 : spec, &end, 10);
+    if (*end != '\0' || end == spec) {
+        return NULL;
+    }
+    for (job = sh_job_table; job != NULL; job = job->next) {
+        if (spec[0] == '%' && job->id == n) {
+            return job;
+        }
+        for (int i = 0; spec[0] != '%' && i < job->nprocs; i++) {
+            if (job->procs[i].pid == n) {
+                return job;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Continue a stopped job.
+ * @param job The job.
+ * @param background Whether it continues in the background.
+ */
+void sh_job_continue(struct sh_job *job, int background) {
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].state == SH_JOB_STOPPED) {
+            job->procs[i].state = SH_JOB_RUNNING;
+        }
+    }
+    sh_job_update_state(job);
+    job->notified = 1;
+    sh_job_kill(job, SIGCONT);
+
+    if (background) {
+        job->background = 1;
+        printf("[%d]+ %s &\n", job->id, job->command);
+    } else {
+        printf("%s\n", job->command);
+        sh_job_foreground(job);
+    }
+}
+
+/*
+ * Builtin function implementations.
+ */
+/**
+ * @brief Builtin command: change directory.
+ * @param args List of args. args[0] is "cd". args[1] is the directory.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_cd(char **args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "sh: expected argument to \"cd\"\n");
+        sh_last_status = 1;
+    } else {
+        if (chdir(args[1]) != 0) {
+            perror("sh");
+            sh_last_status = 1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Builtin command: print help.
+ * @param args List of args. Not examined.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_help(char **args) {
+    printf("SH\n");
+    printf("Type program names and arguments, and hit enter.\n");
+    printf("The following are built in:\n");
+
+    for (int i = 0; i < SH_NUM_BUILTINS; i++) {
+        printf("  %s\n", builtins[i].name);
+    }
+
+    printf("Use the man command for information on other programs.\n");
+    return 1;
+}
+
+/**
+ * @brief Builtin command: exit.
+ * @param args List of args. args[0] is "exit". args[1] is an optional exit
+ * status; without it the status of the last command is kept.
+ * @return Always returns 0, to terminate execution.
+ */
+int sh_exit(char **args) {
+    sh_last_status = args[1] != NULL ? atoi(args[1]) & 0xff : sh_prev_status;
+    return 0;
+}
+
+/**
+ * @brief Builtin command: remember or list command locations.
+ * @param args List of args. args[0] is "hash". "-r" forgets everything,
+ * names are looked up and remembered, no arguments lists the table.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_hash(char **args) {
+    struct sh_hash_entry *entry;
+
+    sh_hash_check_path();
+
+    if (args[1] == NULL) {
+        for (int i = 0; i < SH_HASH_SIZE; i++) {
+            for (entry = sh_hash_table[i]; entry != NULL; entry = entry->next) {
+                printf("%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+        return 1;
+    }
+
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-r") == 0) {
+            sh_hash_clear();
+        } else {
+            // Re-search so "hash name" also refreshes a stale entry.
+            sh_hash_forget(args[i]);
+            if (sh_hash_lookup(args[i]) == NULL) {
+                fprintf(stderr, "sh: hash: %s: not found\n", args[i]);
+                sh_last_status = 1;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Builtin command: list the commands starting with a prefix.
+ * @param args List of args. args[0] is "complete". args[1] is the prefix;
+ * without it every command is listed.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_complete(char **args) {
+    const char *prefix = args[1] != NULL ? args[1] : "";
+    size_t count;
+    struct sh_complete_entry *matches = sh_complete_find(prefix, strlen(prefix), &count);
+
+    for (size_t i = 0; i < count; i++) {
+        printf("%s\n", matches[i].name);
+    }
+    sh_last_status = count > 0 ? 0 : 1;
+    return 1;
+}
+
+/**
+ * @brief Builtin command: list jobs.
+ * @param args List of args. args[0] is "jobs". "-p" lists only process
+ * group ids.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_jobs(char **args) {
+    int pids_only = args[1] != NULL && strcmp(args[1], "-p") == 0;
+
+    sh_reap();
+    for (struct sh_job *job = sh_job_table; job != NULL; job = job->next) {
+        if (pids_only) {
+            printf("%ld\n", (long) job->pgid);
+        } else {
+            sh_job_print(job);
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Builtin command: wait for background jobs.
+ * @param args List of args. args[0] is "wait". Each further arg is a job
+ * spec or pid; with none, waits for every job.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_wait(char **args) {
+    struct sh_job *job, *next;
+
+    sh_last_status = 0;
+    if (args[1] == NULL) {
+        while (1) {
+            sh_reap();
+            for (job = sh_job_table; job != NULL && job->state != SH_JOB_RUNNING; job = job->next) {
+            }
+            if (job == NULL) {
+                break;
+            }
+            sh_reap_wait();
+        }
+        // Everything waited for has been collected.
+        for (job = sh_job_table; job != NULL; job = next) {
+            next = job->next;
+            if (job->state == SH_JOB_DONE) {
+                sh_job_free(job);
+            }
+        }
+        return 1;
+    }
+
+    for (int i = 1; args[i] != NULL; i++) {
+        job = sh_job_find(args[i]);
+        if (job == NULL) {
+            fprintf(stderr, "sh: wait: %s: no such job\n", args[i]);
+            sh_last_status = 127;
+            continue;
+        }
+        while (job->state == SH_JOB_RUNNING) {
+            sh_reap_wait();
+        }
+        sh_last_status = sh_job_status(job);
+        if (job->state == SH_JOB_DONE) {
+            sh_job_free(job);
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Look up the job a fg or bg builtin acts on.
+ * @param name Name of the builtin, for messages.
+ * @param spec Job spec, or NULL for the current job.
+ * @return The job, or NULL if there is none (reported).
+ */
+struct sh_job *sh_job_control_target(const char *name, const char *spec) {
+    struct sh_job *job;
+
+    if (!sh_job_control) {
+        fprintf(stderr, "sh: %s: no job control\n", name);
+        return NULL;
+    }
+    sh_reap();
+    job = sh_job_find(spec);
+    if (job == NULL || job->state == SH_JOB_DONE) {
+        fprintf(stderr, "sh: %s: %s: no such job\n", name, spec ? spec : "current");
+        return NULL;
+    }
+    return job;
+}
+
+/**
+ * @brief Builtin command: continue a job in the foreground.
+ * @param args List of args. args[0] is "fg". args[1] is an optional job spec.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_fg(char **args) {
+    struct sh_job *job = sh_job_control_target("fg", args[1]);
+
+    if (job == NULL) {
+        sh_last_status = 1;
+    } else {
+        sh_job_continue(job, 0);
+    }
+    return 1;
+}
+
+/**
+ * @brief Builtin command: continue a stopped job in the background.
+ * @param args List of args. args[0] is "bg". args[1] is an optional job spec.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_bg(char **args) {
+    struct sh_job *job = sh_job_control_target("bg", args[1]);
+
+    if (job == NULL) {
+        sh_last_status = 1;
+    } else {
+        sh_job_continue(job, 1);
+        sh_last_status = 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Builtin command: show how long each phase of running commands
+ * took, with -DSH_PROFILE builds.
+ * @param args List of args. args[0] is "shstats". args[1] may be "-r", to
+ * clear the counters instead.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_shstats(char **args) {
+#ifdef SH_PROFILE
+    if (args[1] != NULL && strcmp(args[1], "-r") == 0) {
+        memset(sh_profiles, 0, sizeof(sh_profiles));
+        return 1;
+    }
+
+    printf("phase\tcount\tmean_ns\tp50_ns\tp99_ns\tmax_ns\n");
+    for (int i = 0; i < SH_NUM_PHASES; i++) {
+        const struct sh_profile *profile = &sh_profiles[i];
+
+        printf("%s\t%llu\t%llu\t%llu\t%llu\t%llu\n", sh_phase_names[i],
+               (unsigned long long) profile->count,
+               (unsigned long long) (profile->count ? profile->total_ns / profile->count : 0),
+               (unsigned long long) sh_profile_percentile(profile, 50),
+               (unsigned long long) sh_profile_percentile(profile, 99),
+               (unsigned long long) profile->max_ns);
+    }
+#else
+    (void) args;
+    fprintf(stderr, "sh: shstats: not built with -DSH_PROFILE\n");
+    sh_last_status = 1;
+#endif
+    return 1;
+}
+
+/*
+ * Utility builtins: echo, printf, test and friends run in the shell itself,
+ * so they cost no fork or exec. Their output goes through stdout's buffer,
+ * which is written out when it fills and before any child is started, so a
+ * loop of echos makes one write per buffer rather than one per line. They
+ * write through sh_output(), which is a stream of their own when they run
+ * as a stage of a pipeline, on a thread.
+ */
+#define SH_OUTPUT_BUFFER_SIZE 65536
+
+/**
+ * @brief Find where a utility builtin writes its output.
+ * @return The pipeline thread's stdout when running on one, else stdout.
+ */
+FILE *sh_output() {
+    return sh_stage_stdout != NULL ? sh_stage_stdout : stdout;
+}
+
+/**
+ * @brief Print a string, interpreting backslash escapes as echo -e does.
+ * @param out Where to print it.
+ * @param str The string.
+ * @param octal_zero Whether octal escapes are written \0nnn (echo, %b)
+ * rather than \nnn (printf formats).
+ * @return 1 if a \c escape asked for output to stop, 0 otherwise.
+ */
+int sh_print_escaped(FILE *out, const char *str, int octal_zero) {
+    for (const char *p = str; *p != '\0'; p++) {
+        int c = *p, digits = 0;
+
+        if (c != '\\' || p[1] == '\0') {
+            putc(c, out);
+            continue;
+        }
+        switch (*++p) {
+            case 'a': c = '\a'; break;
+            case 'b': c = '\b'; break;
+            case 'c': return 1;
+            case 'e': c = '\033'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'v': c = '\v'; break;
+            case '\\': c = '\\'; break;
+            default:
+                if (*p < '0' || *p > '7' || (octal_zero && *p != '0')) {
+                    // Not an escape: keep the backslash.
+                    putc('\\', out);
+                    c = *p;
+                    break;
+                }
+                if (octal_zero) {
+                    p++;
+                }
+                for (c = 0; digits < 3 && *p >= '0' && *p <= '7'; digits++) {
+                    c = c * 8 + *p++ - '0';
+                }
+                p--;
+        }
+        putc(c, out);
+    }
+    return 0;
+}
+
+/**
+ * @brief Builtin command: print the arguments.
+ * @param args List of args. args[0] is "echo". Leading -n (no newline), -e
+ * (interpret escapes) and -E (do not) options are taken as bash does.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_echo(char **args) {
+    FILE *out = sh_output();
+    int newline = 1, escapes = 0, i;
+
+    for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        const char *option = args[i] + 1;
+
+        if (option[strspn(option, "neE")] != '\0') {
+            break; // an ordinary word
+        }
+        for (; *option != '\0'; option++) {
+            if (*option == 'n') {
+                newline = 0;
+            } else {
+                escapes = *option == 'e';
+            }
+        }
+    }
+
+    for (int first = i; args[i] != NULL; i++) {
+        if (i > first) {
+            putc(' ', out);
+        }
+        if (!escapes) {
+            fputs(args[i], out);
+        } else if (sh_print_escaped(out, args[i], 1)) {
+            return 1;
+        }
+    }
+    if (newline) {
+        putc('\n', out);
+    }
+    return 1;
+}
+
+/**
+ * @brief Convert a printf argument to a number.
+ *
+ * As POSIX has it, an argument starting with a quote stands for the value
+ * of the character after it.
+ * @param arg The argument, or NULL for a missing one (0).
+ * @param is_signed Whether to convert as signed.
+ * @param value Set to the number.
+ * @return 0 on success, -1 (reported) if arg is not a number.
+ */
+int sh_printf_number(const char *arg, int is_signed, long long *value) {
+    char *end;
+
+    if (arg == NULL || arg[0] == '\0') {
+        *value = 0;
+        return 0;
+    }
+    if (arg[0] == '\'' || arg[0] == '"') {
+        *value = (unsigned char) arg[1];
+        return 0;
+    }
+    errno = 0;
+    *value = is_signed ? strtoll(arg, &end, 0) : (long long) strtoull(arg, &end, 0);
+    if (errno != 0 || *end != '\0' || end == arg) {
+        fprintf(stderr, "sh: printf: %s: invalid number\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Print a printf format once, taking arguments as it needs them.
+ * @param out Where to print it.
+ * @param format The format.
+ * @param args The arguments; advanced past those used.
+ * @return 1 if a \c escape asked for output to stop, 0 otherwise.
+ */
+int sh_printf_format(FILE *out, const char *format, char ***args) {
+    for (const char *p = format; *p != '\0'; p++) {
+        char spec[32] = "%", *s = spec + 1, *room = spec + sizeof(spec) - 4;
+        const char *arg;
+        long long number;
+
+        if (*p == '\\') {
+            const char *end = p + 1;
+            char escape[8];
+
+            // Hand just this one escape to sh_print_escaped.
+            if (*end >= '0' && *end <= '7') {
+                while (end < p + 4 && *end >= '0' && *end <= '7') {
+                    end++;
+                }
+            } else if (*end != '\0') {
+                end++;
+            }
+            memcpy(escape, p, end - p);
+            escape[end - p] = '\0';
+            if (sh_print_escaped(out, escape, 0)) {
+                return 1;
+            }
+            p = end - 1;
+            continue;
+        }
+        if (*p != '%') {
+            putc(*p, out);
+            continue;
+        }
+        if (p[1] == '%') {
+            putc('%', out);
+            p++;
+            continue;
+        }
+
+        // Copy flags, width and precision; a '*' takes them from the args.
+        // What does not fit before room is dropped, leaving space for the
+        // length modifier and conversion.
+        for (p++; *p != '\0' && strchr("-+ #0", *p) != NULL && s < spec + 8; p++) {
+            *s++ = *p;
+        }
+        for (int part = 0; part < 2; part++) {
+            if (part == 1) {
+                if (*p != '.') {
+                    break;
+                }
+                p++;
+                if (s < room) {
+                    *s++ = '.';
+                }
+            }
+            if (*p == '*') {
+                int len;
+
+                if (sh_printf_number(**args, 1, &number) == -1) {
+                    sh_last_status = 1;
+                }
+                *args += **args != NULL;
+                if (s < room) {
+                    len = snprintf(s, room - s, "%d", (int) number);
+                    s += len < room - s ? len : room - s - 1;
+                }
+                p++;
+            } else {
+                while (*p >= '0' && *p <= '9') {
+                    if (s < room) {
+                        *s++ = *p;
+                    }
+                    p++;
+                }
+            }
+        }
+
+        arg = **args;
+        *args += arg != NULL;
+        switch (*p) {
+            case 'd':
+            case 'i':
+                if (sh_printf_number(arg, 1, &number) == -1) {
+                    sh_last_status = 1;
+                }
+                strcpy(s, "lld");
+                fprintf(out, spec, number);
+                break;
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                if (sh_printf_number(arg, 0, &number) == -1) {
+                    sh_last_status = 1;
+                }
+                s[0] = s[1] = 'l';
+                s[2] = *p;
+                s[3] = '\0';
+                fprintf(out, spec, (unsigned long long) number);
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A': {
+                char *end;
+                double value = arg != NULL ? strtod(arg, &end) : 0;
+
+                if (arg != NULL && (*end != '\0' || end == arg)) {
+                    fprintf(stderr, "sh: printf: %s: invalid number\n", arg);
+                    sh_last_status = 1;
+                }
+                s[0] = *p;
+                s[1] = '\0';
+                fprintf(out, spec, value);
+                break;
+            }
+            case 'c':
+                strcpy(s, "c");
+                fprintf(out, spec, arg != NULL ? arg[0] : '\0');
+                break;
+            case 's':
+                strcpy(s, "s");
+                fprintf(out, spec, arg != NULL ? arg : "");
+                break;
+            case 'b':
+                if (arg != NULL && sh_print_escaped(out, arg, 1)) {
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "sh: printf: %%%c: invalid conversion\n", *p ? *p : ' ');
+                sh_last_status = 1;
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Builtin command: formatted output.
+ * @param args List of args. args[0] is "printf". args[1] is the format,
+ * which is reused until all the remaining args are used up.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_printf(char **args) {
+    char **arg;
+
+    if (args[1] == NULL) {
+        fprintf(stderr, "sh: printf: usage: printf format [arguments]\n");
+        sh_last_status = 2;
+        return 1;
+    }
+    arg = args + 2;
+    do {
+        char **before = arg;
+
+        if (sh_printf_format(sh_output(), args[1], &arg) || arg == before) {
+            break; // \c, or a format that takes no arguments
+        }
+    } while (*arg != NULL);
+    return 1;
+}
+
+/*
+ * test and [ evaluate an expression by recursive descent, with -o binding
+ * more loosely than -a, and -a more loosely than !.
+ */
+struct sh_test {
+    char **args;
+    int pos;
+    int count;
+    const char *error; // first error seen
+};
+
+/**
+ * @brief Check whether a test operand is a unary operator.
+ * @param op The operand.
+ * @return Nonzero if it is.
+ */
+int sh_test_is_unary(const char *op) {
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' &&
+           strchr("bcdefghknprstuwxzGLOS", op[1]) != NULL;
+}
+
+/**
+ * @brief Check whether a test operand is a binary operator.
+ * @param op The operand.
+ * @return Nonzero if it is.
+ */
+int sh_test_is_binary(const char *op) {
+    static const char *ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le",
+                                "-gt", "-ge", "-nt", "-ot", "-ef", NULL};
+
+    for (int i = 0; ops[i] != NULL; i++) {
+        if (strcmp(op, ops[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Convert a test operand to an integer.
+ * @param test The expression being evaluated; its error is set on failure.
+ * @param str The operand.
+ * @return The integer, or 0 on failure.
+ */
+long long sh_test_integer(struct sh_test *test, const char *str) {
+    char *end;
+    long long value;
+
+    errno = 0;
+    value = strtoll(str, &end, 10);
+    while (*end == ' ' || *end == '\t') {
+        end++;
+    }
+    if (errno != 0 || end == str || *end != '\0') {
+        if (test->error == NULL) {
+            test->error = "integer expression expected";
+        }
+        return 0;
+    }
+    return value;
+}
+
+/**
+ * @brief Evaluate a unary test.
+ * @param op The operator.
+ * @param arg Its operand.
+ * @return Whether the test holds.
+ */
+int sh_test_unary(const char *op, const char *arg) {
+    struct stat st;
+    int fd;
+
+    switch (op[1]) {
+        case 'n': return arg[0] != '\0';
+        case 'z': return arg[0] == '\0';
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
+        case 't':
+            // A pipeline stage run on a thread has its own stdin and stdout.
+            fd = atoi(arg);
+            if (fd == STDIN_FILENO && sh_stage_stdin != -1) {
+                fd = sh_stage_stdin;
+            } else if (fd == STDOUT_FILENO && sh_stage_stdout != NULL) {
+                fd = fileno(sh_stage_stdout);
+            }
+            return isatty(fd);
+        case 'h':
+        case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+    if (stat(arg, &st) == -1) {
+        return 0;
+    }
+    switch (op[1]) {
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'f': return S_ISREG(st.st_mode);
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+        case 'k': return (st.st_mode & S_ISVTX) != 0;
+        case 'O': return st.st_uid == geteuid();
+        case 'G': return st.st_gid == getegid();
+        default: return 1; // -e
+    }
+}
+
+/**
+ * @brief Evaluate a binary test.
+ * @param test The expression being evaluated.
+ * @param left The left operand.
+ * @param op The operator.
+ * @param right The right operand.
+ * @return Whether the test holds.
+ */
+int sh_test_binary(struct sh_test *test, const char *left, const char *op, const char *right) {
+    struct stat left_st, right_st;
+    int left_ok, right_ok;
+    long long a, b;
+
+    if (op[0] != '-') {
+        int order = strcmp(left, right);
+
+        return op[0] == '!' ? order != 0 : op[0] == '<' ? order < 0
+               : op[0] == '>' ? order > 0 : order == 0;
+    }
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        left_ok = stat(left, &left_st) == 0;
+        right_ok = stat(right, &right_st) == 0;
+        if (op[1] == 'e') {
+            return left_ok && right_ok && left_st.st_dev == right_st.st_dev &&
+                   left_st.st_ino == right_st.st_ino;
+        }
+        if (!left_ok || !right_ok) {
+            // A file that exists is newer than one that does not.
+            return op[1] == 'n' ? left_ok : right_ok;
+        }
+        if (left_st.st_mtim.tv_sec != right_st.st_mtim.tv_sec) {
+            return (left_st.st_mtim.tv_sec > right_st.st_mtim.tv_sec) == (op[1] == 'n');
+        }
+        if (left_st.st_mtim.tv_nsec == right_st.st_mtim.tv_nsec) {
+            return 0;
+        }
+        return (left_st.st_mtim.tv_nsec > right_st.st_mtim.tv_nsec) == (op[1] == 'n');
+    }
+
+    a = sh_test_integer(test, left);
+    b = sh_test_integer(test, right);
+    if (strcmp(op, "-eq") == 0) {
+        return a == b;
+    } else if (strcmp(op, "-ne") == 0) {
+        return a != b;
+    } else if (strcmp(op, "-lt") == 0) {
+        return a < b;
+    } else if (strcmp(op, "-le") == 0) {
+        return a <= b;
+    } else if (strcmp(op, "-gt") == 0) {
+        return a > b;
+    }
+    return a >= b;
+}
+
+int sh_test_or(struct sh_test *test);
+
+/**
+ * @brief Evaluate a primary: a parenthesized expression, a unary or binary
+ * test, or a lone string (true if not empty).
+ * @param test The expression being evaluated.
+ * @return Whether it holds.
+ */
+int sh_test_primary(struct sh_test *test) {
+    char **args = test->args + test->pos;
+    int left = test->count - test->pos, value;
+
+    if (left <= 0) {
+        if (test->error == NULL) {
+            test->error = "argument expected";
+        }
+        return 0;
+    }
+    if (left >= 3 && sh_test_is_binary(args[1])) {
+        test->pos += 3;
+        return sh_test_binary(test, args[0], args[1], args[2]);
+    }
+    if (strcmp(args[0], "(") == 0 && left >= 2) {
+        test->pos++;
+        value = sh_test_or(test);
+        if (test->pos >= test->count || strcmp(test->args[test->pos], ")") != 0) {
+            if (test->error == NULL) {
+                test->error = "')' expected";
+            }
+            return 0;
+        }
+        test->pos++;
+        return value;
+    }
+    if (left >= 2 && sh_test_is_unary(args[0])) {
+        test->pos += 2;
+        return sh_test_unary(args[0], args[1]);
+    }
+    test->pos++;
+    return args[0][0] != '\0';
+}
+
+/**
+ * @brief Evaluate a negation, or a primary.
+ * @param test The expression being evaluated.
+ * @return Whether it holds.
+ */
+int sh_test_not(struct sh_test *test) {
+    if (test->count - test->pos >= 2 && strcmp(test->args[test->pos], "!") == 0) {
+        test->pos++;
+        return !sh_test_not(test);
+    }
+    return sh_test_primary(test);
+}
+
+/**
+ * @brief Evaluate a chain of -a.
+ * @param test The expression being evaluated.
+ * @return Whether it holds.
+ */
+int sh_test_and(struct sh_test *test) {
+    int value = sh_test_not(test);
+
+    while (test->pos < test->count && strcmp(test->args[test->pos], "-a") == 0) {
+        test->pos++;
+        value &= sh_test_not(test);
+    }
+    return value;
+}
+
+/**
+ * @brief Evaluate a chain of -o.
+ * @param test The expression being evaluated.
+ * @return Whether it holds.
+ */
+int sh_test_or(struct sh_test *test) {
+    int value = sh_test_and(test);
+
+    while (test->pos < test->count && strcmp(test->args[test->pos], "-o") == 0) {
+        test->pos++;
+        value |= sh_test_and(test);
+    }
+    return value;
+}
+
+/**
+ * @brief Builtin command: evaluate a conditional expression.
+ * @param args List of args. args[0] is "test" or "[", which wants a
+ * closing "]" as the last arg. The status is 0 if the expression holds, 1
+ * if not and 2 on errors.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_test(char **args) {
+    struct sh_test test = {args + 1, 0, 0, NULL};
+    int value;
+
+    while (test.args[test.count] != NULL) {
+        test.count++;
+    }
+    if (strcmp(args[0], "[") == 0) {
+        if (test.count == 0 || strcmp(test.args[test.count - 1], "]") != 0) {
+            fprintf(stderr, "sh: [: missing ']'\n");
+            sh_last_status = 2;
+            return 1;
+        }
+        test.count--;
+    }
+    if (test.count == 0) {
+        sh_last_status = 1;
+        return 1;
+    }
+
+    value = sh_test_or(&test);
+    if (test.error == NULL && test.pos < test.count) {
+        test.error = "too many arguments";
+    }
+    if (test.error != NULL) {
+        fprintf(stderr, "sh: %s: %s\n", args[0], test.error);
+        sh_last_status = 2;
+    } else {
+        sh_last_status = !value;
+    }
+    return 1;
+}
+
+/**
+ * @brief Builtin command: do nothing, successfully.
+ * @param args Not examined.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_true(char **args) {
+    (void) args;
+    return 1;
+}
+
+/**
+ * @brief Builtin command: do nothing, unsuccessfully.
+ * @param args Not examined.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_false(char **args) {
+    (void) args;
+    sh_last_status = 1;
+    return 1;
+}
+
+/**
+ * @brief Builtin command: print the working directory.
+ * @param args Not examined.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_pwd(char **args) {
+    char *cwd = getcwd(NULL, 0);
+
+    (void) args;
+    if (cwd == NULL) {
+        perror("sh: pwd");
+        sh_last_status = 1;
+        return 1;
+    }
+    fprintf(sh_output(), "%s\n", cwd);
+    free(cwd);
+    return 1;
+}
+
+/**
+ * @brief Builtin command: export variables to the commands the shell runs.
+ *
+ * "export name=value" also sets the variable; "export -n" stops exporting;
+ * with no names, or -p, the exported variables are listed in a form the
+ * shell reads back.
+ * @param args List of args.  args[0] is "export".
+ * @return Always returns 1, to continue executing.
+ */
+int sh_export(char **args) {
+    int i = 1, unexport = 0, print = 0;
+
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(args[i], "-n") == 0) {
+            unexport = 1;
+        } else if (strcmp(args[i], "-p") == 0) {
+            print = 1;
+        } else {
+            fprintf(stderr, "sh: export: %s: invalid option\n", args[i]);
+            sh_last_status = 2;
+            return 1;
+        }
+    }
+
+    if (args[i] == NULL || print) {
+        size_t count;
+        struct sh_var **vars = sh_vars_sorted(&count);
+
+        for (size_t j = 0; j < count; j++) {
+            if (!(vars[j]->flags & SH_VAR_EXPORT)) {
+                continue;
+            }
+            if (vars[j]->value == NULL) {
+                printf("export %s\n", vars[j]->name);
+                continue;
+            }
+            printf("export %s=\"", vars[j]->name);
+            for (const char *c = vars[j]->value; *c != '\0'; c++) {
+                if (strchr("\"\\$`", *c) != NULL) {
+                    putchar('\\');
+                }
+                putchar(*c);
+            }
+            printf("\"\n");
+        }
+        return 1;
+    }
+
+    for (; args[i] != NULL; i++) {
+        const char *eq = strchr(args[i], '=');
+        size_t len = eq != NULL ? (size_t) (eq - args[i]) : strlen(args[i]);
+        char *name = sh_arena_strndup(&sh_parse_arena, args[i], len);
+        int flags = sh_var_flags(name);
+
+        if (!sh_is_name(name, len)) {
+            fprintf(stderr, "sh: export: `%s': not a valid identifier\n", args[i]);
+            sh_last_status = 1;
+            continue;
+        }
+        flags = unexport ? flags & ~SH_VAR_EXPORT : flags | SH_VAR_EXPORT;
+        sh_var_set(name, eq != NULL ? eq + 1 : sh_var_get(name), flags);
+    }
+    return 1;
+}
+
+/**
+ * @brief Builtin command: unset variables.
+ * @param args List of args.  args[0] is "unset"; -v is accepted.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_unset(char **args) {
+    int i = 1;
+
+    if (args[i] != NULL && strcmp(args[i], "-v") == 0) {
+        i++;
+    }
+    for (; args[i] != NULL; i++) {
+        if (!sh_is_name(args[i], strlen(args[i]))) {
+            fprintf(stderr, "sh: unset: `%s': not a valid identifier\n", args[i]);
+            sh_last_status = 1;
+            continue;
+        }
+        sh_var_set(args[i], NULL, 0);
+    }
+    return 1;
+}
+
+#define SH_READ_BLOCK_SIZE 65536
+
+/*
+ * Buffered line reader. Input is read in whole blocks and lines are handed
+ * out as NUL-terminated slices of one buffer that is reused for the whole
+ * session, so reading a line costs no allocation and no per-byte call.
+ */
+struct sh_reader {
+    int fd;
+    char *buffer;
+    size_t size;  // bytes allocated
+    size_t start; // first byte not yet returned
+    size_t end;   // end of the bytes read so far
+    int eof;
+};
+
+struct sh_reader sh_stdin = {STDIN_FILENO};
+
+/**
+ * @brief Read the next line from a reader.
+ * @param reader The reader.
+ * @param len Set to the length of the line, without the newline.
+ * @return The line, valid until the next call; NULL at end of input.
+ */
+char *sh_reader_line(struct sh_reader *reader, size_t *len) {
+    size_t scanned = reader->start;
+
+    while (1) {
+        char *newline = reader->end > scanned
+                        ? memchr(reader->buffer + scanned, '\n', reader->end - scanned) : NULL;
+        char *line = reader->buffer + reader->start;
+        ssize_t count;
+
+        if (newline != NULL) {
+            *newline = '\0';
+            *len = newline - line;
+            reader->start = newline + 1 - reader->buffer;
+            return line;
+        }
+
+        if (reader->eof) {
+            if (reader->start == reader->end) {
+                return NULL;
+            }
+            // Last line without a newline; end < size leaves room for the NUL.
+            reader->buffer[reader->end] = '\0';
+            *len = reader->end - reader->start;
+            reader->start = reader->end;
+            return line;
+        }
+
+        // Move the partial line to the front, and grow only if it alone
+        // fills the buffer.
+        if (reader->start > 0) {
+            memmove(reader->buffer, line, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        scanned = reader->end;
+        if (reader->end + 1 >= reader->size) {
+            reader->size = reader->size ? reader->size * 2 : SH_READ_BLOCK_SIZE;
+            reader->buffer = sh_xrealloc(reader->buffer, reader->size);
+        }
+
+        count = read(reader->fd, reader->buffer + reader->end, reader->size - 1 - reader->end);
+        if (count > 0) {
+            reader->end += count;
+        } else if (count == 0) {
+            reader->eof = 1;
+        } else if (errno != EINTR) {
+            perror("sh: read");
+            reader->eof = 1;
+        }
+    }
+}
+
+/**
+ * @brief Set up a reader over a string that is already in memory.
+ * @param reader The reader.
+ * @param str The string. Lines are NUL-terminated in place.
+ */
+void sh_reader_string(struct sh_reader *reader, char *str) {
+    reader->fd = -1;
+    reader->buffer = str;
+    reader->start = 0;
+    reader->end = strlen(str);
+    reader->size = reader->end + 1;
+    reader->eof = 1;
+}
+
+/**
+ * @brief Set up a reader over a script file.
+ *
+ * Regular files are mapped copy-on-write and parsed in place, so running a
+ * script makes no read calls at all; anything else is read in blocks.
+ * @param reader The reader.
+ * @param path Path of the script.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int sh_reader_map(struct sh_reader *reader, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    char *map;
+
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        *reader = (struct sh_reader) {fd};
+        return 0;
+    }
+
+    // Reserve one byte more than the file: the last line is NUL-terminated
+    // after it even when the file ends exactly on a page boundary.
+    map = mmap(NULL, st.st_size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > 0 &&
+        mmap(map, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        int err = errno;
+        munmap(map, st.st_size + 1);
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    close(fd);
+
+    reader->fd = -1;
+    reader->buffer = map;
+    reader->start = 0;
+    reader->end = st.st_size;
+    reader->size = st.st_size + 1;
+    reader->eof = 1;
+    return 0;
+}
+
+/**
+ * @brief Give unread input back to the file before a child can read it.
+ *
+ * A child sharing our input would otherwise miss whatever was read ahead
+ * into the buffer. Only seekable input can be given back; for pipes and
+ * terminals the read-ahead stays with the shell.
+ * @param reader The reader.
+ */
+void sh_reader_sync(struct sh_reader *reader) {
+    off_t unread = reader->end - reader->start;
+
+    if (unread == 0 || reader->eof) {
+        return;
+    }
+    if (lseek(reader->fd, -unread, SEEK_CUR) != -1) {
+        reader->start = reader->end = 0;
+    }
+}
+
+/*
+ * Launch engines. posix_spawn (and vfork) avoid copying the shell's page
+ * tables, which is what makes fork slow once the shell has grown. fork is
+ * kept as the fallback for commands that need arbitrary child-side setup.
+ */
+enum sh_engine {
+    SH_ENGINE_SPAWN,
+    SH_ENGINE_VFORK,
+    SH_ENGINE_FORK
+};
+
+enum sh_engine sh_launch_engine = SH_ENGINE_SPAWN;
+
+/**
+ * @brief Select the launch engine from the SH_LAUNCH environment variable.
+ *
+ * Accepts "spawn", "vfork" or "fork". Anything else keeps the default.
+ */
+void sh_launch_init() {
+    char *engine = getenv("SH_LAUNCH");
+
+    if (engine == NULL) {
+        return;
+    }
+    if (strcmp(engine, "spawn") == 0) {
+        sh_launch_engine = SH_ENGINE_SPAWN;
+    } else if (strcmp(engine, "vfork") == 0) {
+        sh_launch_engine = SH_ENGINE_VFORK;
+    } else if (strcmp(engine, "fork") == 0) {
+        sh_launch_engine = SH_ENGINE_FORK;
+    } else {
+        fprintf(stderr, "sh: unknown SH_LAUNCH engine \"%s\"\n", engine);
+    }
+}
+
+/*
+ * Child-side setup. fd moves are applied in order as dup2(fd, target);
+ * every fd the shell opens for a child is O_CLOEXEC, so nothing else leaks
+ * into it.
+ */
+struct sh_fd_move {
+    int fd; // -1 to close target
+    int target;
+};
+
+#define SH_LIMITS_MAX 16
+
+// Resource limits and a cgroup for a child, as set by the limit builtin,
+// and the time limit the timeout builtin gives its job.
+struct sh_limits {
+    struct {
+        int resource;
+        rlim_t value;
+    } rlimits[SH_LIMITS_MAX];
+    int nrlimits;
+    int cgroup_procs;      // cgroup.procs of the cgroup to run in, or -1
+    long long timeout;     // ns; 0 for none
+    long long kill_after;  // ns
+    int timeout_signal;
+};
+
+// What the limit and timeout builtins put on the commands they launch.
+struct sh_limits sh_launch_limits = {.cgroup_procs = -1};
+
+struct sh_spawn_opts {
+    const struct sh_fd_move *moves;
+    int nmoves;
+    pid_t pgid; // group to join, 0 to lead a new one, -1 to stay in ours
+    const struct sh_limits *limits; // NULL for none
+};
+
+/**
+ * @brief Set up a child between fork and exec.
+ * @param opts What to set up, or NULL.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int sh_child_setup(const struct sh_spawn_opts *opts) {
+    for (int i = 0; i < SH_NUM_JOB_SIGNALS; i++) {
+        signal(sh_job_signals[i], SIG_DFL);
+    }
+    if (opts == NULL) {
+        return 0;
+    }
+    if (opts->pgid >= 0 && setpgid(0, opts->pgid) == -1) {
+        return -1;
+    }
+    for (int i = 0; i < opts->nmoves; i++) {
+        const struct sh_fd_move *move = &opts->moves[i];
+
+        if (move->fd == -1) {
+            close(move->target);
+        } else if (move->fd == move->target) {
+            // dup2 onto itself would leave close-on-exec set.
+            if (fcntl(move->fd, F_SETFD, 0) == -1) {
+                return -1;
+            }
+        } else if (dup2(move->fd, move->target) == -1) {
+            return -1;
+        }
+    }
+    if (opts->limits != NULL) {
+        const struct sh_limits *limits = opts->limits;
+
+        for (int i = 0; i < limits->nrlimits; i++) {
+            struct rlimit limit = {limits->rlimits[i].value, limits->rlimits[i].value};
+
+            if (setrlimit(limits->rlimits[i].resource, &limit) == -1) {
+                return -1;
+            }
+        }
+        // "0" moves the writer itself into the cgroup.
+        if (limits->cgroup_procs != -1 && write(limits->cgroup_procs, "0", 1) != 1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Start a program without waiting for it.
+ * @param path Executable to run.
+ * @param args Null terminated list of arguments (including program).
+ * @param engine Engine to start it with.
+ * @param opts Child-side setup, or NULL for none.
+ * @return Pid of the child, or -1 with errno set if it could not be started.
+ */
+pid_t sh_spawn(const char *path, char **args, enum sh_engine engine,
+               const struct sh_spawn_opts *opts) {
+    pid_t pid;
+    int err;
+
+    switch (engine) {
+    case SH_ENGINE_SPAWN: {
+        // posix_spawn reports exec failures back to us, so a stale path
+        // never leaves a child behind.
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        sigset_t defaults;
+        short flags = POSIX_SPAWN_SETSIGDEF;
+
+        sigemptyset(&defaults);
+        for (int i = 0; i < SH_NUM_JOB_SIGNALS; i++) {
+            sigaddset(&defaults, sh_job_signals[i]);
+        }
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setsigdefault(&attr, &defaults);
+        posix_spawn_file_actions_init(&actions);
+        if (opts != NULL) {
+            if (opts->pgid >= 0) {
+                flags |= POSIX_SPAWN_SETPGROUP;
+                posix_spawnattr_setpgroup(&attr, opts->pgid);
+            }
+            for (int i = 0; i < opts->nmoves; i++) {
+                if (opts->moves[i].fd == -1) {
+                    posix_spawn_file_actions_addclose(&actions, opts->moves[i].target);
+                } else {
+                    posix_spawn_file_actions_adddup2(&actions, opts->moves[i].fd, opts->moves[i].target);
+                }
+            }
+        }
+        posix_spawnattr_setflags(&attr, flags);
+
+        err = posix_spawn(&pid, path, &actions, &attr, args, sh_environ());
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+        if (err != 0) {
+            errno = err;
+            return -1;
+        }
+        return pid;
+    }
+
+    case SH_ENGINE_VFORK: {
+        // The child shares our memory until it execs, so it can hand the
+        // exec error back through this variable.
+        volatile int exec_errno = 0;
+
+        pid = vfork();
+        if (pid == 0) {
+            if (sh_child_setup(opts) == 0) {
+                execve(path, args, sh_environ());
+            }
+            exec_errno = errno;
+            _exit(127);
+        } else if (pid < 0) {
+            return -1;
+        }
+        if (exec_errno != 0) {
+            waitpid(pid, NULL, 0);
+            errno = exec_errno;
+            return -1;
+        }
+        return pid;
+    }
+
+    case SH_ENGINE_FORK:
+    default:
+        pid = fork();
+        if (pid == 0) {
+            // Child process. Errors cannot be reported back from here, so
+            // a stale path falls back to searching $PATH directly.
+            if (sh_child_setup(opts) == 0) {
+                execve(path, args, sh_environ());
+                if (errno == ENOENT) {
+                    execvpe(args[0], args, sh_environ());
+                }
+            }
+            perror("sh");
+            exit(127);
+        }
+        return pid;
+    }
+}
+
+/**
+ * @brief Find and start an external program without waiting for it.
+ * @param args Null terminated list of arguments (including program).
+ * @param opts Child-side setup, or NULL for none.
+ * @return Pid of the child, or -1 if it could not be started (reported).
+ */
+pid_t sh_start(char **args, const struct sh_spawn_opts *opts) {
+    SH_PROFILE_START(LOOKUP);
+    const char *path = sh_hash_lookup(args[0]);
+    SH_PROFILE_STOP(LOOKUP);
+    enum sh_engine engine = sh_launch_engine;
+    pid_t pid;
+
+    if (path == NULL) {
+        fprintf(stderr, "sh: %s: command not found\n", args[0]);
+        return -1;
+    }
+
+    // posix_spawn cannot set limits or join a cgroup; vfork can, as cheaply.
+    if (opts != NULL && opts->limits != NULL && engine == SH_ENGINE_SPAWN) {
+        engine = SH_ENGINE_VFORK;
+    }
+    SH_PROFILE_START(LAUNCH);
+    pid = sh_spawn(path, args, engine, opts);
+    SH_PROFILE_STOP(LAUNCH);
+    if (pid < 0 && errno == ENOENT && path != args[0]) {
+        // The remembered location is stale: search $PATH once more.
+        sh_hash_forget(args[0]);
+        path = sh_hash_lookup(args[0]);
+        if (path == NULL) {
+            fprintf(stderr, "sh: %s: command not found\n", args[0]);
+            return -1;
+        }
+        pid = sh_spawn(path, args, engine, opts);
+    }
+
+    if (pid < 0) {
+        fprintf(stderr, "sh: %s: %s\n", args[0], strerror(errno));
+        return pid;
+    }
+    if (sh_startup_trace) {
+        // Startup ends with the first command started.
+        sh_trace_startup("first exec");
+        sh_startup_trace = 0;
+    }
+    if (opts != NULL && opts->pgid >= 0) {
+        // Also done in the child; doing it here too closes the race with
+        // handing the new group the terminal.
+        setpgid(pid, opts->pgid ? opts->pgid : pid);
+    }
+    return pid;
+}
+
+#define SH_TOKEN_BUFFER_SIZE 64
+
+// Set while parsing ahead of execution, where a syntax error is not
+// reported because the line is parsed again, in context, when it runs.
+int sh_syntax_quiet;
+
+/**
+ * @brief Report a syntax error.
+ * @param message What is wrong.
+ */
+void sh_syntax_error(const char *message) {
+    if (!sh_syntax_quiet) {
+        fprintf(stderr, "sh: syntax error%s\n", message);
+    }
+}
+
+/*
+ * Character classes for the lexer. Everything not listed is part of a word.
+ */
+enum sh_char_class {
+    SH_CHAR_WORD = 0,
+    SH_CHAR_BLANK,
+    SH_CHAR_SQUOTE,
+    SH_CHAR_DQUOTE,
+    SH_CHAR_ESCAPE,
+    SH_CHAR_DOLLAR,
+    SH_CHAR_OPERATOR,
+    SH_CHAR_GLOB,
+    SH_CHAR_CONTROL, // the expansion markers, which input may not contain
+    SH_CHAR_END
+};
+
+const unsigned char sh_char_class[256] = {
+        ['\0'] = SH_CHAR_END,
+        ['\001'] = SH_CHAR_CONTROL,
+        ['\002'] = SH_CHAR_CONTROL,
+        ['\003'] = SH_CHAR_CONTROL,
+        ['\004'] = SH_CHAR_CONTROL,
+        ['\005'] = SH_CHAR_CONTROL,
+        ['\006'] = SH_CHAR_CONTROL,
+        ['\016'] = SH_CHAR_CONTROL,
+        [' '] = SH_CHAR_BLANK,
+        ['\t'] = SH_CHAR_BLANK,
+        ['\r'] = SH_CHAR_BLANK,
+        ['\n'] = SH_CHAR_OPERATOR,
+        ['\a'] = SH_CHAR_BLANK,
+        ['\''] = SH_CHAR_SQUOTE,
+        ['"'] = SH_CHAR_DQUOTE,
+        ['\\'] = SH_CHAR_ESCAPE,
+        ['$'] = SH_CHAR_DOLLAR,
+        ['|'] = SH_CHAR_OPERATOR,
+        ['&'] = SH_CHAR_OPERATOR,
+        [';'] = SH_CHAR_OPERATOR,
+        ['<'] = SH_CHAR_OPERATOR,
+        ['>'] = SH_CHAR_OPERATOR,
+        ['*'] = SH_CHAR_GLOB,
+        ['?'] = SH_CHAR_GLOB,
+        ['['] = SH_CHAR_GLOB
+};
+
+enum sh_token_kind {
+    SH_TOKEN_WORD,
+    SH_TOKEN_PIPE,
+    SH_TOKEN_AMP,
+    SH_TOKEN_SEMI,
+    SH_TOKEN_NEWLINE, // between the lines of a compound command
+    SH_TOKEN_REDIRECT
+};
+
+enum sh_redirect_kind {
+    SH_REDIRECT_INPUT,      // <
+    SH_REDIRECT_OUTPUT,     // > and >|
+    SH_REDIRECT_APPEND,     // >>
+    SH_REDIRECT_READ_WRITE, // <>
+    SH_REDIRECT_DUP_INPUT,  // <&
+    SH_REDIRECT_DUP_OUTPUT  // >&
+};
+
+const char *sh_redirect_ops[] = {"<", ">", ">>", "<>", "<&", ">&"};
+
+// The fd each kind of redirection applies to when none is given.
+const int sh_redirect_default_fd[] = {0, 1, 1, 0, 0, 1};
+
+/*
+ * Parameter expansions are marked in place: the lexer turns the '$' into
+ * one of these bytes, followed by the name as written. A name that would
+ * otherwise run on into the name characters after it (only possible where
+ * quotes or braces were removed, so there is room) is ended with
+ * SH_EXPAND_END. Input containing any of them is rejected.
+ */
+#define SH_EXPAND '\003'        // unquoted: the value is split into fields
+#define SH_EXPAND_QUOTED '\001' // in double quotes: the value is one field
+#define SH_EXPAND_END '\002'
+
+/*
+ * Quoted pattern characters are replaced in place by these, so that only
+ * the unquoted ones are left to match with. The words they are in are
+ * expanded, which puts the characters back.
+ */
+#define SH_GLOB_STAR '\004'    // a quoted '*'
+#define SH_GLOB_QUESTION '\005' // a quoted '?'
+#define SH_GLOB_BRACKET '\006' // a quoted '['
+#define SH_GLOB_CHARS "*?["
+
+// Quotes with nothing between them leave this, so that a word such as
+// ""$empty still gives a field once expanded.
+#define SH_EMPTY_QUOTES '\016'
+#define SH_EXPAND_BYTES "\001\002\003\004\005\006\016"
+
+// Parameters whose name is a single character other than a name's.
+#define SH_SPECIAL_PARAMS "?$!#0123456789"
+
+// Token flags.
+#define SH_TOKEN_ASSIGNMENT 1 // a word of the form name=value
+#define SH_TOKEN_EXPAND 2     // a word with parameter expansions
+#define SH_TOKEN_GLOB 4       // a word with unquoted pattern characters
+#define SH_TOKEN_QUOTED 8     // a word with quotes, backslashes or braces removed
+
+/*
+ * A token is a view into the line being lexed. Redirection operators also
+ * carry their kind and the fd they apply to, decoded by the lexer since the
+ * operator text can be overwritten when the word before it is terminated.
+ */
+struct sh_token {
+    unsigned int offset;
+    unsigned int length;
+    enum sh_token_kind kind;
+    enum sh_redirect_kind redirect;
+    int fd;
+    int flags;
+};
+
+struct sh_lexer {
+    char *line;
+    struct sh_token *tokens; // allocated from sh_parse_arena
+    size_t count;
+    size_t size;
+};
+
+/**
+ * @brief Append a token.
+ * @param lexer Lexer state.
+ * @param kind Token kind.
+ * @param start First byte of the token in the line.
+ * @param length Length of the token.
+ */
+void sh_lex_push(struct sh_lexer *lexer, enum sh_token_kind kind, char *start, size_t length) {
+    if (lexer->count == lexer->size) {
+        lexer->tokens = sh_arena_realloc(&sh_parse_arena, lexer->tokens,
+                                         lexer->size * sizeof(struct sh_token),
+                                         2 * lexer->size * sizeof(struct sh_token));
+        lexer->size *= 2;
+    }
+    lexer->tokens[lexer->count].offset = start - lexer->line;
+    lexer->tokens[lexer->count].length = length;
+    lexer->tokens[lexer->count].kind = kind;
+    lexer->tokens[lexer->count].flags = 0;
+    lexer->count++;
+}
+
+/**
+ * @brief Lex a redirection operator.
+ * @param lexer Lexer state; receives the token.
+ * @param read Start of the operator.
+ * @param fd The fd given right before it, or -1 for the default.
+ * @return The first byte after the operator.
+ */
+char *sh_lex_redirect(struct sh_lexer *lexer, char *read, int fd) {
+    char *start = read;
+    enum sh_redirect_kind kind;
+
+    if (*read++ == '<') {
+        kind = *read == '&' ? SH_REDIRECT_DUP_INPUT : *read == '>' ? SH_REDIRECT_READ_WRITE : SH_REDIRECT_INPUT;
+    } else {
+        kind = *read == '>' ? SH_REDIRECT_APPEND : *read == '&' ? SH_REDIRECT_DUP_OUTPUT : SH_REDIRECT_OUTPUT;
+    }
+    if (kind != SH_REDIRECT_INPUT && (kind != SH_REDIRECT_OUTPUT || *read == '|')) {
+        read++;
+    }
+
+    sh_lex_push(lexer, SH_TOKEN_REDIRECT, start, read - start);
+    lexer->tokens[lexer->count - 1].redirect = kind;
+    lexer->tokens[lexer->count - 1].fd = fd >= 0 ? fd : sh_redirect_default_fd[kind];
+    return read;
+}
+
+/**
+ * @brief Find the end of a command substitution's text.
+ *
+ * Quotes, backslashes and nested substitutions are skipped over, so a ')'
+ * inside any of them does not end it.
+ * @param text The text, right after its "$(".
+ * @return Its closing ')', or NULL on a syntax error (already reported).
+ */
+char *sh_lex_subst_end(char *text) {
+    int depth = 0, quoted = 0;
+
+    for (char *p = text;; p++) {
+        if (sh_char_class[(unsigned char) *p] == SH_CHAR_CONTROL) {
+            sh_syntax_error(": control character in input");
+            return NULL;
+        } else if (*p == '\0') {
+            sh_syntax_error(": unterminated command substitution");
+            return NULL;
+        } else if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (*p == '"') {
+            quoted = !quoted;
+        } else if (*p == '$' && p[1] == '(') {
+            if ((p = sh_lex_subst_end(p + 2)) == NULL) {
+                return NULL;
+            }
+        } else if (quoted) {
+            continue;
+        } else if (*p == '\'') {
+            while (*++p != '\'') {
+                if (*p == '\0') {
+                    sh_syntax_error(": unterminated quote");
+                    return NULL;
+                }
+            }
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && depth-- == 0) {
+            return p;
+        }
+    }
+}
+
+/**
+ * @brief Lex a parameter expansion, marking it in place.
+ *
+ * A command substitution keeps its text as it was written, between the
+ * marker and '(' and SH_EXPAND_END, to be parsed when it runs.
+ * @param read The '$'.
+ * @param write Where the marked expansion goes; advanced past it.
+ * @param marker SH_EXPAND or SH_EXPAND_QUOTED.
+ * @param open_name Set if a name character written next has to be preceded
+ * by SH_EXPAND_END.
+ * @return The first byte after the expansion, or NULL on a syntax error
+ * (already reported).
+ */
+char *sh_lex_dollar(char *read, char **write, char marker, int *open_name) {
+    char *name = read + 1, *w = *write;
+
+    *open_name = 0;
+    if (*name == '(') {
+        char *end = sh_lex_subst_end(name + 1);
+
+        if (end == NULL) {
+            return NULL;
+        }
+        *w++ = marker;
+        while (name < end) {
+            *w++ = *name++;
+        }
+        *w++ = SH_EXPAND_END;
+        read = end + 1;
+    } else if (*name == '{') {
+        char *end = ++name;
+
+        while (*end != '}' && *end != '\0') {
+            end++;
+        }
+        if (*end != '}' || !(sh_is_name(name, end - name) ||
+                             (end - name == 1 && strchr(SH_SPECIAL_PARAMS, *name) != NULL))) {
+            sh_syntax_error(": bad substitution");
+            return NULL;
+        }
+        *w++ = marker;
+        while (name < end) {
+            *w++ = *name++;
+        }
+        *w++ = SH_EXPAND_END;
+        read = end + 1;
+    } else if (*name != '\0' && strchr(SH_SPECIAL_PARAMS, *name) != NULL) {
+        *w++ = marker;
+        *w++ = *name;
+        read = name + 1;
+    } else if (sh_is_name_char((unsigned char) *name)) {
+        *w++ = marker;
+        for (read = name; sh_is_name_char((unsigned char) *read); read++) {
+            *w++ = *read;
+        }
+        *open_name = 1;
+    } else {
+        // A '$' that starts no expansion stands for itself.
+        *w++ = '$';
+        read = name;
+    }
+    *write = w;
+    return read;
+}
+
+// Write one byte of a word, first ending the name of an expansion right
+// before it if the byte would otherwise continue that name.
+#define SH_LEX_WRITE(c)                                               \
+    do {                                                              \
+        char sh_lex_c = (c);                                          \
+        if (open_name && sh_is_name_char((unsigned char) sh_lex_c)) { \
+            *write++ = SH_EXPAND_END;                                 \
+        }                                                             \
+        open_name = 0;                                                \
+        *write++ = sh_lex_c;                                          \
+    } while (0)
+
+// Write one quoted byte of a word, marking it if it is a pattern character.
+#define SH_LEX_WRITE_QUOTED(c)                                        \
+    do {                                                              \
+        char sh_lex_q = (c);                                          \
+        if (sh_char_class[(unsigned char) sh_lex_q] == SH_CHAR_GLOB) { \
+            sh_lex_q = sh_glob_quote(sh_lex_q);                       \
+            quoted_glob = 1;                                          \
+        }                                                             \
+        SH_LEX_WRITE(sh_lex_q);                                       \
+    } while (0)
+
+/**
+ * @brief Get the marker for a quoted pattern character.
+ * @param c '*', '?' or '['.
+ * @return Its marker.
+ */
+char sh_glob_quote(char c) {
+    return c == '*' ? SH_GLOB_STAR : c == '?' ? SH_GLOB_QUESTION : SH_GLOB_BRACKET;
+}
+
+/**
+ * @brief Get the pattern character a byte stands for.
+ * @param c A byte of a word.
+ * @return The character, if c is a quoted pattern character marker; else 0.
+ */
+char sh_glob_unquote(char c) {
+    return c == SH_GLOB_STAR ? '*' : c == SH_GLOB_QUESTION ? '?' : c == SH_GLOB_BRACKET ? '[' : 0;
+}
+
+/**
+ * @brief Split a line into tokens in a single pass.
+ *
+ * Quotes and backslashes are removed in place: a word is only ever rewritten
+ * within its own span of the line, so tokens need no copying. Words are not
+ * NUL-terminated here, since the byte after one may still be an operator;
+ * see sh_token_string(). Parameter expansions are only marked, to be
+ * expanded when the command runs.
+ * @param lexer Lexer state; receives the tokens.
+ * @param line The line. Modified in place.
+ * @return 0 on success, -1 on a syntax error (already reported).
+ */
+int sh_lex(struct sh_lexer *lexer, char *line) {
+    char *read = line;
+    char *number_end = NULL; // end of the last word, if it was all digits
+
+    lexer->line = line;
+    lexer->count = 0;
+    lexer->size = SH_TOKEN_BUFFER_SIZE;
+    lexer->tokens = sh_arena_alloc(&sh_parse_arena, lexer->size * sizeof(struct sh_token));
+
+    while (1) {
+        char *start, *write, *name;
+        int flags = 0, open_name = 0, quoted_glob = 0;
+
+        while (sh_char_class[(unsigned char) *read] == SH_CHAR_BLANK) {
+            read++;
+        }
+
+        // A comment runs to the end of the line.
+        if (*read == '#') {
+            read += strcspn(read, "\n");
+            continue;
+        }
+
+        switch (sh_char_class[(unsigned char) *read]) {
+        case SH_CHAR_END:
+            return 0;
+
+        case SH_CHAR_CONTROL:
+            sh_syntax_error(": control character in input");
+            return -1;
+
+        case SH_CHAR_OPERATOR:
+            if (*read == '<' || *read == '>') {
+                int fd = -1;
+
+                // Digits right before the operator, unquoted, name the fd.
+                if (read == number_end) {
+                    struct sh_token *number = &lexer->tokens[--lexer->count];
+
+                    fd = 0;
+                    for (unsigned int i = 0; i < number->length; i++) {
+                        fd = fd * 10 + line[number->offset + i] - '0';
+                    }
+                }
+                read = sh_lex_redirect(lexer, read, fd);
+                continue;
+            }
+            sh_lex_push(lexer, *read == '|' ? SH_TOKEN_PIPE : *read == '&' ? SH_TOKEN_AMP :
+                               *read == ';' ? SH_TOKEN_SEMI : SH_TOKEN_NEWLINE, read, 1);
+            read++;
+            continue;
+
+        default:
+            break;
+        }
+
+        // An assignment is an unquoted name and '=' at the start of a word.
+        for (name = read; sh_is_name_char((unsigned char) *name); name++) {
+        }
+        if (*name == '=' && sh_is_name(read, name - read)) {
+            flags = SH_TOKEN_ASSIGNMENT;
+        }
+
+        start = write = read;
+        while (1) {
+            switch (sh_char_class[(unsigned char) *read]) {
+            case SH_CHAR_WORD:
+                if (open_name) {
+                    // Quotes were removed since the name (else this would
+                    // be part of it), so there is room to end it.
+                    if (sh_is_name_char((unsigned char) *read)) {
+                        *write++ = SH_EXPAND_END;
+                    }
+                    open_name = 0;
+                }
+                // Until the first quote, the word is already in place.
+                if (write == read) {
+                    do {
+                        read++;
+                    } while (sh_char_class[(unsigned char) *read] == SH_CHAR_WORD);
+                    write = read;
+                } else {
+                    do {
+                        *write++ = *read++;
+                    } while (sh_char_class[(unsigned char) *read] == SH_CHAR_WORD);
+                }
+                continue;
+
+            case SH_CHAR_ESCAPE:
+                read++;
+                if (*read == '\0') {
+                    // A trailing backslash stands for itself.
+                    SH_LEX_WRITE('\\');
+                } else if (sh_char_class[(unsigned char) *read] == SH_CHAR_CONTROL) {
+                    sh_syntax_error(": control character in input");
+                    return -1;
+                } else {
+                    SH_LEX_WRITE_QUOTED(*read++);
+                }
+                continue;
+
+            case SH_CHAR_SQUOTE:
+                read++;
+                if (*read == '\'') {
+                    SH_LEX_WRITE(SH_EMPTY_QUOTES);
+                    flags |= SH_TOKEN_EXPAND;
+                }
+                while (*read != '\'') {
+                    if (sh_char_class[(unsigned char) *read] >= SH_CHAR_CONTROL) {
+                        sh_syntax_error(*read ? ": control character in input" : ": unterminated quote");
+                        return -1;
+                    }
+                    SH_LEX_WRITE_QUOTED(*read++);
+                }
+                read++;
+                continue;
+
+            case SH_CHAR_DQUOTE:
+                read++;
+                if (*read == '"') {
+                    SH_LEX_WRITE(SH_EMPTY_QUOTES);
+                    flags |= SH_TOKEN_EXPAND;
+                }
+                while (*read != '"') {
+                    if (sh_char_class[(unsigned char) *read] >= SH_CHAR_CONTROL) {
+                        sh_syntax_error(*read ? ": control character in input" : ": unterminated quote");
+                        return -1;
+                    }
+                    if (*read == '$') {
+                        read = sh_lex_dollar(read, &write, SH_EXPAND_QUOTED, &open_name);
+                        if (read == NULL) {
+                            return -1;
+                        }
+                        flags |= SH_TOKEN_EXPAND;
+                        continue;
+                    }
+                    // Inside double quotes a backslash only escapes these.
+                    if (*read == '\\' && read[1] != '\0' && strchr("$`\"\\", read[1]) != NULL) {
+                        read++;
+                    }
+                    SH_LEX_WRITE_QUOTED(*read++);
+                }
+                read++;
+                continue;
+
+            case SH_CHAR_DOLLAR:
+                read = sh_lex_dollar(read, &write, SH_EXPAND, &open_name);
+                if (read == NULL) {
+                    return -1;
+                }
+                flags |= SH_TOKEN_EXPAND;
+                continue;
+
+            case SH_CHAR_GLOB:
+                SH_LEX_WRITE(*read++);
+                flags |= SH_TOKEN_GLOB;
+                continue;
+
+            case SH_CHAR_CONTROL:
+                sh_syntax_error(": control character in input");
+                return -1;
+
+            default:
+                break;
+            }
+            break;
+        }
+
+        if (quoted_glob) {
+            // Expanding the word puts the characters back.
+            flags |= SH_TOKEN_EXPAND;
+        }
+        if (write != read) {
+            flags |= SH_TOKEN_QUOTED;
+        }
+        sh_lex_push(lexer, SH_TOKEN_WORD, start, write - start);
+        lexer->tokens[lexer->count - 1].flags = flags;
+        number_end = write == read && read - start <= 4 && strspn(start, "0123456789") >= (size_t) (read - start)
+                     ? read : NULL;
+    }
+}
+
+/**
+ * @brief Get a word token as a string.
+ *
+ * Only valid once the whole line has been lexed: the byte after the word
+ * is overwritten with its terminating NUL.
+ * @param lexer Lexer state.
+ * @param token The token.
+ * @return NUL-terminated word, in place in the line.
+ */
+char *sh_token_string(struct sh_lexer *lexer, struct sh_token *token) {
+    char *word = lexer->line + token->offset;
+
+    word[token->length] = '\0';
+    return word;
+}
+
+/*
+ * Parsed commands, allocated from sh_parse_arena. A list is compiled to
+ * code over its pipelines: a line of plain pipelines is one SH_OP_RUN
+ * each, and if, while, until and for become jumps around them, so a loop
+ * body is parsed once however many times it runs. Every loop has a frame
+ * of its own while it runs, numbered by how deeply it is nested.
+ */
+struct sh_redirect {
+    int fd;
+    enum sh_redirect_kind kind;
+    char *target; // file name, or for <& and >& an fd number or "-"
+};
+
+struct sh_command {
+    char **argv;
+    int argc;
+    struct sh_redirect *redirects; // applied in order
+    int nredirects;
+    char **assigns; // "name=value" words in front of the command
+    int nassigns;
+    int expand; // some word holds parameter expansions
+};
+
+struct sh_pipeline {
+    struct sh_command *commands;
+    int count;
+    int background;
+};
+
+enum sh_opcode {
+    SH_OP_RUN,         // run pipeline arg
+    SH_OP_JUMP,        // go to arg
+    SH_OP_JUMP_FAILED, // go to arg if $? is not 0
+    SH_OP_TRUE,        // set $? to 0
+    SH_OP_LOOP,        // start a while or until loop
+    SH_OP_WHILE,       // leave the loop, for arg, if $? is not 0
+    SH_OP_UNTIL,       // leave the loop, for arg, if $? is 0
+    SH_OP_FOR,         // start a for loop over pipeline arg; see below
+    SH_OP_ITEM,        // assign the next item, or leave the loop for arg
+    SH_OP_NEXT,        // end of an iteration: go back to arg
+    SH_NUM_OPS
+};
+
+// A for loop's words are kept as a one-command pipeline: the words to loop
+// over are its arguments, and its one assignment word is the name.
+struct sh_op {
+    uint16_t code;
+    uint16_t loop; // how many loops it is in; loop ops count their own
+    uint32_t arg;
+};
+
+struct sh_list {
+    struct sh_pipeline *pipelines;
+    int count;
+    struct sh_op *code;
+    int ncode;
+    int depth; // deepest loop nesting
+};
+
+/**
+ * @brief Name a token in a syntax error message.
+ * @param lexer Lexer state.
+ * @param index Index of the token; past the end means the end of the line.
+ * @return The name.
+ */
+const char *sh_token_name(struct sh_lexer *lexer, size_t index) {
+    if (index >= lexer->count) {
+        return "newline";
+    }
+    switch (lexer->tokens[index].kind) {
+    case SH_TOKEN_PIPE:
+        return "|";
+    case SH_TOKEN_AMP:
+        return "&";
+    case SH_TOKEN_SEMI:
+        return ";";
+    case SH_TOKEN_NEWLINE:
+        return "newline";
+    case SH_TOKEN_REDIRECT:
+        return sh_redirect_ops[lexer->tokens[index].redirect];
+    default:
+        return sh_token_string(lexer, &lexer->tokens[index]);
+    }
+}
+
+/**
+ * @brief Report a syntax error at a token.
+ * @param lexer Lexer state.
+ * @param index Index of the offending token.
+ */
+void sh_syntax_error_at(struct sh_lexer *lexer, size_t index) {
+    char message[64];
+
+    snprintf(message, sizeof(message), " near unexpected token `%s'", sh_token_name(lexer, index));
+    sh_syntax_error(message);
+}
+
+/**
+ * @brief Parse a run of tokens as a pipeline of commands.
+ * @param lexer Lexer state.
+ * @param first Index of the first token.
+ * @param last Index just past the last token.
+ * @param pipeline Receives the pipeline.
+ * @return 0 on success, -1 on a syntax error (already reported).
+ */
+int sh_parse_pipeline(struct sh_lexer *lexer, size_t first, size_t last, struct sh_pipeline *pipeline) {
+    size_t start = first;
+
+    pipeline->count = 0;
+    pipeline->background = 0;
+    for (size_t i = first; i < last; i++) {
+        if (lexer->tokens[i].kind == SH_TOKEN_PIPE) {
+            pipeline->count++;
+        }
+    }
+    pipeline->commands = sh_arena_alloc(&sh_parse_arena, (pipeline->count + 1) * sizeof(struct sh_command));
+    pipeline->count = 0;
+
+    for (size_t i = first; i <= last; i++) {
+        struct sh_command *command;
+        int redirects = 0, assigns = 0, words = 0;
+
+        if (i < last && lexer->tokens[i].kind == SH_TOKEN_REDIRECT) {
+            // A redirection takes the word after it as its target.
+            if (i + 1 >= last || lexer->tokens[i + 1].kind != SH_TOKEN_WORD) {
+                sh_syntax_error_at(lexer, i + 1);
+                return -1;
+            }
+            i++;
+            continue;
+        }
+        if (i < last && lexer->tokens[i].kind == SH_TOKEN_WORD) {
+            continue;
+        }
+        if (i == start) {
+            sh_syntax_error_at(lexer, i);
+            return -1;
+        }
+
+        // The counts are known, so every array is allocated at its exact
+        // size. Assignments are the words before the first other word.
+        for (size_t j = start; j < i; j++) {
+            if (lexer->tokens[j].kind == SH_TOKEN_REDIRECT) {
+                redirects++;
+                j++;
+            } else if (words++ == assigns && (lexer->tokens[j].flags & SH_TOKEN_ASSIGNMENT)) {
+                assigns++;
+            }
+        }
+        command = &pipeline->commands[pipeline->count++];
+        command->argc = 0;
+        command->argv = sh_arena_alloc(&sh_parse_arena, (words - assigns + 1) * sizeof(char *));
+        command->nredirects = 0;
+        command->redirects = redirects ? sh_arena_alloc(&sh_parse_arena, redirects * sizeof(struct sh_redirect)) : NULL;
+        command->nassigns = 0;
+        command->assigns = assigns ? sh_arena_alloc(&sh_parse_arena, assigns * sizeof(char *)) : NULL;
+        command->expand = 0;
+        for (size_t j = start; j < i; j++) {
+            struct sh_token *token = &lexer->tokens[j];
+
+            if (token->kind == SH_TOKEN_REDIRECT) {
+                struct sh_redirect *redirect = &command->redirects[command->nredirects++];
+
+                token = &lexer->tokens[++j];
+                redirect->fd = lexer->tokens[j - 1].fd;
+                redirect->kind = lexer->tokens[j - 1].redirect;
+                redirect->target = sh_token_string(lexer, token);
+            } else if (command->nassigns < assigns) {
+                command->assigns[command->nassigns++] = sh_token_string(lexer, token);
+            } else {
+                command->argv[command->argc++] = sh_token_string(lexer, token);
+            }
+            command->expand |= (token->flags & (SH_TOKEN_EXPAND | SH_TOKEN_GLOB)) != 0;
+        }
+        command->argv[command->argc] = NULL;
+        start = i + 1;
+    }
+    return 0;
+}
+
+/*
+ * Compiling lists. Reserved words are only recognized unquoted, where a
+ * command could start. A compound command runs to its closing word, so
+ * its lines are joined, with newlines between them, and parsed as one.
+ */
+#define SH_NESTING_MAX 256
+#define SH_NO_FIXUP UINT32_MAX
+
+enum sh_word {
+    SH_WORD_IF,
+    SH_WORD_THEN,
+    SH_WORD_ELIF,
+    SH_WORD_ELSE,
+    SH_WORD_FI,
+    SH_WORD_WHILE,
+    SH_WORD_UNTIL,
+    SH_WORD_FOR,
+    SH_WORD_IN,
+    SH_WORD_DO,
+    SH_WORD_DONE,
+    SH_WORD_NONE // not a reserved word
+};
+
+const char *sh_reserved_words[] = {"if", "then", "elif", "else", "fi", "while",
+                                   "until", "for", "in", "do", "done"};
+
+#define SH_WORD_BIT(word) (1 << (word))
+
+// Set while parsing input that can go on on the next line (see
+// sh_read_list). Running out of tokens inside a compound command then sets
+// sh_parse_incomplete, instead of being reported.
+int sh_parse_more;
+int sh_parse_incomplete;
+
+// The jumps out of a loop being compiled, chained through their args
+// until the loop's end is known.
+struct sh_loop_fixups {
+    uint32_t breaks;    // to the end of the loop
+    uint32_t continues; // to its SH_OP_NEXT
+    struct sh_loop_fixups *outer;
+};
+
+struct sh_compiler {
+    struct sh_lexer *lexer;
+    size_t pos; // next token
+    struct sh_list *list;
+    int loops;   // loops the code being compiled is in
+    int nesting; // compound commands likewise
+    struct sh_loop_fixups *loop;
+};
+
+/**
+ * @brief Tell which reserved word a token is.
+ * @param lexer Lexer state.
+ * @param index Index of the token; past the end is no word.
+ * @return The word, or SH_WORD_NONE.
+ */
+enum sh_word sh_token_word(struct sh_lexer *lexer, size_t index) {
+    struct sh_token *token;
+
+    if (index >= lexer->count) {
+        return SH_WORD_NONE;
+    }
+    token = &lexer->tokens[index];
+    if (token->kind != SH_TOKEN_WORD || token->flags != 0 || token->length < 2 || token->length > 5 ||
+        strchr("tefwuid", lexer->line[token->offset]) == NULL) {
+        return SH_WORD_NONE;
+    }
+    for (int i = 0; i < SH_WORD_NONE; i++) {
+        if (strncmp(lexer->line + token->offset, sh_reserved_words[i], token->length) == 0 &&
+            sh_reserved_words[i][token->length] == '\0') {
+            return i;
+        }
+    }
+    return SH_WORD_NONE;
+}
+
+/**
+ * @brief Append an op to the code being compiled.
+ * @param c Compiler state.
+ * @param code The opcode.
+ * @param arg Its argument.
+ * @return Index of the op.
+ */
+uint32_t sh_emit(struct sh_compiler *c, enum sh_opcode code, uint32_t arg) {
+    struct sh_op *op = &c->list->code[c->list->ncode];
+
+    op->code = code;
+    op->loop = c->loops;
+    op->arg = arg;
+    return c->list->ncode++;
+}
+
+/**
+ * @brief Point a chain of jumps at their target.
+ * @param list The code.
+ * @param chain Index of the last jump in the chain, or SH_NO_FIXUP.
+ * @param target Where they go.
+ */
+void sh_patch(struct sh_list *list, uint32_t chain, uint32_t target) {
+    while (chain != SH_NO_FIXUP) {
+        uint32_t next = list->code[chain].arg;
+
+        list->code[chain].arg = target;
+        chain = next;
+    }
+}
+
+/**
+ * @brief Handle the tokens running out inside a compound command.
+ * @return -1.
+ */
+int sh_compile_end() {
+    if (sh_parse_more) {
+        sh_parse_incomplete = 1;
+    } else {
+        sh_syntax_error(": unexpected end of file");
+    }
+    return -1;
+}
+
+/**
+ * @brief Skip the newlines at a compiler's position.
+ * @param c Compiler state.
+ * @return 0 if a token follows them, -1 if the tokens ran out.
+ */
+int sh_compile_newlines(struct sh_compiler *c) {
+    while (c->pos < c->lexer->count && c->lexer->tokens[c->pos].kind == SH_TOKEN_NEWLINE) {
+        c->pos++;
+    }
+    return c->pos < c->lexer->count ? 0 : sh_compile_end();
+}
+
+/**
+ * @brief Compile a pipeline, or a break or continue as a jump.
+ *
+ * Only a literal break or continue, with a literal count if any, is a
+ * jump; one outside any loop does nothing.
+ * @param c Compiler state.
+ * @param last Index just past the pipeline's last token.
+ * @return 0 on success, -1 on a syntax error (already reported).
+ */
+int sh_compile_pipeline(struct sh_compiler *c, size_t last) {
+    struct sh_pipeline *pipeline = &c->list->pipelines[c->list->count];
+    struct sh_command *command;
+    int is_break;
+
+    if (sh_parse_pipeline(c->lexer, c->pos, last, pipeline) != 0) {
+        return -1;
+    }
+    pipeline->background = last < c->lexer->count && c->lexer->tokens[last].kind == SH_TOKEN_AMP;
+    command = &pipeline->commands[0];
+    if (pipeline->count == 1 && !pipeline->background && command->argc > 0 && command->argc <= 2 &&
+        command->nassigns == 0 && command->nredirects == 0 && !command->expand &&
+        ((is_break = strcmp(command->argv[0], "break") == 0) || strcmp(command->argv[0], "continue") == 0)) {
+        struct sh_loop_fixups *loop = c->loop;
+        char *end;
+        long count = command->argc == 2 ? strtol(command->argv[1], &end, 10) : 1;
+
+        if (command->argc == 1 || (*end == '\0' && count > 0)) {
+            sh_emit(c, SH_OP_TRUE, 0);
+            if (loop == NULL) {
+                return 0;
+            }
+            while (--count > 0 && loop->outer != NULL) {
+                loop = loop->outer;
+            }
+            if (is_break) {
+                loop->breaks = sh_emit(c, SH_OP_JUMP, loop->breaks);
+            } else {
+                loop->continues = sh_emit(c, SH_OP_JUMP, loop->continues);
+            }
+            return 0;
+        }
+    }
+    sh_emit(c, SH_OP_RUN, c->list->count++);
+    return 0;
+}
+
+int sh_compile_compound(struct sh_compiler *c, enum sh_word word);
+
+/**
+ * @brief Compile commands up to a reserved word that ends them.
+ * @param c Compiler state; its position is left on the ending word.
+ * @param ends SH_WORD_BIT of each word that can end the commands, or 0 for
+ * a whole line, which ends with its tokens.
+ * @return The word that ended them, SH_WORD_NONE at the end of a line, or
+ * -1 on a syntax error (already reported) or if the tokens ran out.
+ */
+int sh_compile_list(struct sh_compiler *c, int ends) {
+    struct sh_lexer *lexer = c->lexer;
+    int commands = 0;
+
+    while (1) {
+        enum sh_word word;
+        size_t last;
+
+        while (c->pos < lexer->count && lexer->tokens[c->pos].kind == SH_TOKEN_NEWLINE) {
+            c->pos++;
+        }
+        if (c->pos == lexer->count) {
+            return ends == 0 ? SH_WORD_NONE : sh_compile_end();
+        }
+
+        word = sh_token_word(lexer, c->pos);
+        if (word != SH_WORD_NONE && (ends & SH_WORD_BIT(word)) && commands > 0) {
+            return word;
+        }
+        commands++;
+        if (word == SH_WORD_IF || word == SH_WORD_WHILE || word == SH_WORD_UNTIL || word == SH_WORD_FOR) {
+            if (sh_compile_compound(c, word) != 0) {
+                return -1;
+            }
+            // Only a separator or an ending word may follow.
+            if (c->pos < lexer->count) {
+                enum sh_token_kind kind = lexer->tokens[c->pos].kind;
+
+                if (kind == SH_TOKEN_SEMI || kind == SH_TOKEN_NEWLINE) {
+                    c->pos++;
+                } else if ((word = sh_token_word(lexer, c->pos)) == SH_WORD_NONE || !(ends & SH_WORD_BIT(word))) {
+                    sh_syntax_error_at(lexer, c->pos);
+                    return -1;
+                }
+            }
+            continue;
+        }
+        if (word != SH_WORD_NONE && word != SH_WORD_IN) {
+            sh_syntax_error_at(lexer, c->pos);
+            return -1;
+        }
+
+        for (last = c->pos; last < lexer->count && lexer->tokens[last].kind != SH_TOKEN_SEMI &&
+                            lexer->tokens[last].kind != SH_TOKEN_AMP &&
+                            lexer->tokens[last].kind != SH_TOKEN_NEWLINE; last++) {
+        }
+        if (sh_compile_pipeline(c, last) != 0) {
+            return -1;
+        }
+        c->pos = last < lexer->count ? last + 1 : last;
+    }
+}
+
+/**
+ * @brief Compile an if command: each condition jumps past its branch if it
+ * fails, and each branch jumps to the end.
+ * @param c Compiler state, at the "if".
+ * @return 0 on success, -1 as sh_compile_list.
+ */
+int sh_compile_if(struct sh_compiler *c) {
+    uint32_t ends = SH_NO_FIXUP, next;
+    int word;
+
+    do {
+        c->pos++; // the if or elif
+        if (sh_compile_list(c, SH_WORD_BIT(SH_WORD_THEN)) < 0) {
+            return -1;
+        }
+        c->pos++;
+        next = sh_emit(c, SH_OP_JUMP_FAILED, 0);
+        word = sh_compile_list(c, SH_WORD_BIT(SH_WORD_ELIF) | SH_WORD_BIT(SH_WORD_ELSE) | SH_WORD_BIT(SH_WORD_FI));
+        if (word < 0) {
+            return -1;
+        }
+        ends = sh_emit(c, SH_OP_JUMP, ends);
+        c->list->code[next].arg = c->list->ncode;
+    } while (word == SH_WORD_ELIF);
+
+    if (word == SH_WORD_ELSE) {
+        c->pos++;
+        if (sh_compile_list(c, SH_WORD_BIT(SH_WORD_FI)) < 0) {
+            return -1;
+        }
+    } else {
+        // With no branch taken, $? is 0.
+        sh_emit(c, SH_OP_TRUE, 0);
+    }
+    c->pos++;
+    sh_patch(c->list, ends, c->list->ncode);
+    return 0;
+}
+
+/**
+ * @brief Compile the "do ... done" of a loop, and the jump back to its
+ * start.
+ * @param c Compiler state, right after the "do".
+ * @param loop Its breaks and continues, to be patched.
+ * @param top Where each iteration starts.
+ * @return 0 on success, -1 as sh_compile_list.
+ */
+int sh_compile_body(struct sh_compiler *c, struct sh_loop_fixups *loop, uint32_t top) {
+    c->loop = loop;
+    if (sh_compile_list(c, SH_WORD_BIT(SH_WORD_DONE)) < 0) {
+        return -1;
+    }
+    c->pos++;
+    sh_patch(c->list, loop->continues, c->list->ncode);
+    sh_emit(c, SH_OP_NEXT, top);
+    c->loop = loop->outer;
+    return 0;
+}
+
+/**
+ * @brief Compile a while or until loop.
+ * @param c Compiler state, at the "while" or "until".
+ * @param until Whether it is an until loop.
+ * @return 0 on success, -1 as sh_compile_list.
+ */
+int sh_compile_while(struct sh_compiler *c, int until) {
+    struct sh_loop_fixups loop = {SH_NO_FIXUP, SH_NO_FIXUP, c->loop};
+    uint32_t top, test;
+
+    c->loops++;
+    sh_emit(c, SH_OP_LOOP, 0);
+    top = c->list->ncode;
+    c->pos++;
+    if (sh_compile_list(c, SH_WORD_BIT(SH_WORD_DO)) < 0) {
+        return -1;
+    }
+    c->pos++;
+    test = sh_emit(c, until ? SH_OP_UNTIL : SH_OP_WHILE, 0);
+    if (sh_compile_body(c, &loop, top) != 0) {
+        return -1;
+    }
+    c->list->code[test].arg = c->list->ncode;
+    sh_patch(c->list, loop.breaks, c->list->ncode);
+    c->loops--;
+    return 0;
+}
+
+/**
+ * @brief Compile a for loop: "for name in words...; do ... done".
+ * @param c Compiler state, at the "for".
+ * @return 0 on success, -1 as sh_compile_list.
+ */
+int sh_compile_for(struct sh_compiler *c) {
+    struct sh_lexer *lexer = c->lexer;
+    struct sh_loop_fixups loop = {SH_NO_FIXUP, SH_NO_FIXUP, c->loop};
+    struct sh_pipeline *pipeline;
+    struct sh_command *command;
+    struct sh_token *name;
+    size_t first, last;
+    uint32_t top;
+
+    c->pos++;
+    if (c->pos == lexer->count) {
+        return sh_compile_end();
+    }
+    name = &lexer->tokens[c->pos++];
+    if (name->kind != SH_TOKEN_WORD || name->flags != 0 ||
+        !sh_is_name(lexer->line + name->offset, name->length)) {
+        sh_syntax_error_at(lexer, c->pos - 1);
+        return -1;
+    }
+    if (sh_compile_newlines(c) != 0) {
+        return -1;
+    }
+    if (sh_token_word(lexer, c->pos) != SH_WORD_IN) {
+        sh_syntax_error_at(lexer, c->pos);
+        return -1;
+    }
+    first = ++c->pos;
+    for (last = first; last < lexer->count && lexer->tokens[last].kind == SH_TOKEN_WORD; last++) {
+    }
+    if (last == lexer->count) {
+        return sh_compile_end();
+    }
+    if (lexer->tokens[last].kind != SH_TOKEN_SEMI && lexer->tokens[last].kind != SH_TOKEN_NEWLINE) {
+        sh_syntax_error_at(lexer, last);
+        return -1;
+    }
+    c->pos = last + 1;
+    if (sh_compile_newlines(c) != 0) {
+        return -1;
+    }
+    if (sh_token_word(lexer, c->pos) != SH_WORD_DO) {
+        sh_syntax_error_at(lexer, c->pos);
+        return -1;
+    }
+    c->pos++;
+
+    pipeline = &c->list->pipelines[c->list->count];
+    command = sh_arena_alloc(&sh_parse_arena, sizeof(*command));
+    *pipeline = (struct sh_pipeline) {command, 1, 0};
+    command->argc = 0;
+    command->argv = sh_arena_alloc(&sh_parse_arena, (last - first + 1) * sizeof(char *));
+    command->nredirects = 0;
+    command->redirects = NULL;
+    command->nassigns = 1;
+    command->assigns = sh_arena_alloc(&sh_parse_arena, sizeof(char *));
+    command->assigns[0] = sh_token_string(lexer, name);
+    command->expand = 0;
+    for (size_t i = first; i < last; i++) {
+        command->argv[command->argc++] = sh_token_string(lexer, &lexer->tokens[i]);
+        command->expand |= (lexer->tokens[i].flags & (SH_TOKEN_EXPAND | SH_TOKEN_GLOB)) != 0;
+    }
+    command->argv[command->argc] = NULL;
+
+    c->loops++;
+    sh_emit(c, SH_OP_FOR, c->list->count++);
+    top = sh_emit(c, SH_OP_ITEM, 0);
+    if (sh_compile_body(c, &loop, top) != 0) {
+        return -1;
+    }
+    c->list->code[top].arg = c->list->ncode;
+    sh_patch(c->list, loop.breaks, c->list->ncode);
+    c->loops--;
+    return 0;
+}
+
+/**
+ * @brief Compile a compound command.
+ * @param c Compiler state, at the word that starts it; left after its end.
+ * @param word That word.
+ * @return 0 on success, -1 as sh_compile_list.
+ */
+int sh_compile_compound(struct sh_compiler *c, enum sh_word word) {
+    int status;
+
+    if (c->nesting == SH_NESTING_MAX) {
+        sh_syntax_error(": commands nested too deeply");
+        return -1;
+    }
+    c->nesting++;
+    if (c->loops == c->list->depth && (word == SH_WORD_WHILE || word == SH_WORD_UNTIL || word == SH_WORD_FOR)) {
+        c->list->depth++;
+    }
+    if (word == SH_WORD_IF) {
+        status = sh_compile_if(c);
+    } else if (word == SH_WORD_FOR) {
+        status = sh_compile_for(c);
+    } else {
+        status = sh_compile_while(c, word == SH_WORD_UNTIL);
+    }
+    c->nesting--;
+    return status;
+}
+
+/**
+ * @brief Parse and compile a line.
+ * @param line The line; with sh_read_list, several joined by newlines.
+ * Modified in place.
+ * @return The compiled list (no code for an empty line), or NULL on a
+ * syntax error (already reported) or, with sh_parse_more, if the line
+ * leaves a compound command open.
+ */
+struct sh_list *sh_parse_line(char *line) {
+    struct sh_lexer lexer;
+    struct sh_compiler compiler = {&lexer};
+    struct sh_list *list;
+    int separators = 0, starts = 0;
+
+    sh_parse_incomplete = 0;
+    if (sh_lex(&lexer, line) != 0) {
+        return NULL;
+    }
+
+    // Every pipeline ends at a separator or the end of the line, and takes
+    // one op, or two for a break. Each if, elif and loop adds at most three.
+    for (size_t i = 0; i < lexer.count; i++) {
+        enum sh_token_kind kind = lexer.tokens[i].kind;
+        enum sh_word word;
+
+        if (kind == SH_TOKEN_AMP || kind == SH_TOKEN_SEMI || kind == SH_TOKEN_NEWLINE) {
+            separators++;
+        } else if ((word = sh_token_word(&lexer, i)) == SH_WORD_IF || word == SH_WORD_ELIF ||
+                   word == SH_WORD_WHILE || word == SH_WORD_UNTIL || word == SH_WORD_FOR) {
+            starts++;
+        }
+    }
+    list = sh_arena_alloc(&sh_parse_arena, sizeof(*list));
+    list->pipelines = sh_arena_alloc(&sh_parse_arena, (separators + 1) * sizeof(struct sh_pipeline));
+    list->count = 0;
+    list->code = sh_arena_alloc(&sh_parse_arena,
+                                (2 * (separators + 1) + 3 * starts) * sizeof(struct sh_op));
+    list->ncode = 0;
+    list->depth = 0;
+
+    compiler.list = list;
+    return sh_compile_list(&compiler, 0) < 0 ? NULL : list;
+}
+
+/*
+ * Parameter expansion, done just before a command runs: parsed commands
+ * (and cached script images) keep the lexer's markers, so the same words
+ * can be expanded again with different values. Unquoted expansions are
+ * split into fields at $IFS characters; every run of them separates two
+ * fields, and fields are never empty.
+ */
+#define SH_DEFAULT_IFS " \t\n"
+
+#define SH_FIELDS_LOCAL 16
+
+// Fields of expanded words, NULL terminated. They are collected in local,
+// then in a malloc'd array that doubles as it fills, and handed out by
+// sh_fields_finish() as one allocation of exactly their number from
+// sh_parse_arena, however many a pattern matched.
+struct sh_fields {
+    char **fields;
+    int count;
+    int size;
+    char *local[SH_FIELDS_LOCAL];
+};
+
+/**
+ * @brief Append a field.
+ * @param fields The fields.
+ * @param field The field.
+ */
+void sh_fields_add(struct sh_fields *fields, char *field) {
+    if (fields->size == 0) {
+        fields->fields = fields->local;
+        fields->size = SH_FIELDS_LOCAL;
+    } else if (fields->count + 1 >= fields->size) {
+        int size = 2 * fields->size;
+
+        if (fields->fields == fields->local) {
+            fields->fields = sh_xmalloc(size * sizeof(char *));
+            memcpy(fields->fields, fields->local, sizeof(fields->local));
+        } else {
+            fields->fields = sh_xrealloc(fields->fields, size * sizeof(char *));
+        }
+        fields->size = size;
+    }
+    fields->fields[fields->count++] = field;
+    fields->fields[fields->count] = NULL;
+}
+
+/**
+ * @brief Free the fields, keeping what they point to.
+ * @param fields The fields.
+ */
+void sh_fields_free(struct sh_fields *fields) {
+    if (fields->fields != fields->local) {
+        free(fields->fields);
+    }
+}
+
+/**
+ * @brief Move the fields to sh_parse_arena, and free them.
+ * @param fields The fields.
+ * @return Null terminated array of them, of exactly count + 1 entries.
+ */
+char **sh_fields_finish(struct sh_fields *fields) {
+    char **array = sh_arena_alloc(&sh_parse_arena, (fields->count + 1) * sizeof(char *));
+
+    if (fields->count > 0) {
+        memcpy(array, fields->fields, fields->count * sizeof(char *));
+    }
+    array[fields->count] = NULL;
+    sh_fields_free(fields);
+    return array;
+}
+
+// Command substitution, below.
+const char *sh_substitute(const char *text, size_t len);
+
+// Substitutions run so far; lets an assignment tell whether its value ran
+// a command, whose status then becomes $?.
+unsigned long sh_substitutions;
+
+/**
+ * @brief Get the value of a marked parameter, or the output of a marked
+ * command substitution.
+ * @param name Its name, or '(' and the command, right after the marker.
+ * @param len Receives the length of the name or of the command and its '('.
+ * @return The value; "" if it is unset. Numbers and output are allocated
+ * from sh_parse_arena.
+ */
+const char *sh_expand_param(const char *name, size_t *len) {
+    const char *value;
+
+    if (*name == '(') {
+        *len = strchr(name, SH_EXPAND_END) - name;
+        return sh_substitute(name + 1, *len - 1);
+    }
+    if (strchr(SH_SPECIAL_PARAMS, *name) != NULL) {
+        char *buf = sh_arena_alloc(&sh_parse_arena, 24);
+
+        *len = 1;
+        switch (*name) {
+        case '?':
+            sprintf(buf, "%d", sh_last_status);
+            return buf;
+        case '$':
+            sprintf(buf, "%ld", (long) sh_shell_pid);
+            return buf;
+        case '!':
+            if (sh_last_background == 0) {
+                return "";
+            }
+            sprintf(buf, "%ld", (long) sh_last_background);
+            return buf;
+        case '#':
+            return "0";
+        case '0':
+            return sh_name;
+        default:
+            return ""; // there are no positional parameters
+        }
+    }
+
+    for (*len = 0; sh_is_name_char((unsigned char) name[*len]); (*len)++) {
+    }
+    value = sh_var_getn(name, *len);
+    return value != NULL ? value : "";
+}
+
+// An expansion in a word: its value, and the length of what follows its
+// marker.
+struct sh_expansion {
+    const char *value;
+    size_t len;
+};
+
+/**
+ * @brief Expand the parameters in a word.
+ * @param fields Receives the fields.
+ * @param word The word, as marked by the lexer.
+ * @param split Whether unquoted expansions are split into fields; if not,
+ * the word always gives exactly one field.
+ * @param pattern Whether the fields are patterns for sh_glob: quoted
+ * characters that mean something in a pattern, and every backslash, are
+ * then quoted with a backslash.
+ */
+void sh_expand_word(struct sh_fields *fields, const char *word, int split, int pattern) {
+    struct sh_expansion *values;
+    const char *ifs, *p, *value;
+    char *field, *write;
+    size_t total = 0, count = 0;
+    int have_field = 0;
+
+    // Every value is found once, before the fields are written: a command
+    // substitution must not run twice.
+    for (p = word; (p = strpbrk(p, "\001\003")) != NULL; p++) {
+        count++;
+    }
+    values = sh_arena_alloc(&sh_parse_arena, count * sizeof(*values));
+    count = 0;
+    // Every field and its NUL fit in twice the expanded length, or three
+    // times for patterns, where any byte may gain a backslash.
+    for (p = word; *p != '\0'; p++) {
+        if (*p == SH_EXPAND || *p == SH_EXPAND_QUOTED) {
+            values[count].value = sh_expand_param(p + 1, &values[count].len);
+            total += strlen(values[count].value);
+            p += values[count++].len;
+        } else {
+            total++;
+        }
+    }
+    field = write = sh_arena_alloc(&sh_parse_arena, (pattern ? 3 : 2) * total + 2);
+    // Looked up after the substitutions, which may have assigned it.
+    ifs = split ? sh_var_get("IFS") : "";
+    if (ifs == NULL) {
+        ifs = SH_DEFAULT_IFS;
+    }
+    count = 0;
+
+    for (p = word; *p != '\0';) {
+        int splitting;
+
+        if (*p != SH_EXPAND && *p != SH_EXPAND_QUOTED) {
+            char c = sh_glob_unquote(*p);
+
+            if (c != 0 || (pattern && *p == '\\')) {
+                // Quoted in the word, so kept from being a pattern character.
+                if (pattern) {
+                    *write++ = '\\';
+                }
+                *write++ = c != 0 ? c : *p;
+                have_field = 1;
+            } else if (*p == SH_EMPTY_QUOTES) {
+                have_field = 1;
+            } else if (*p != SH_EXPAND_END) {
+                *write++ = *p;
+                have_field = 1;
+            }
+            p++;
+            continue;
+        }
+
+        splitting = *p == SH_EXPAND;
+        value = values[count].value;
+        p += 1 + values[count++].len;
+        if (!splitting) {
+            for (; *value != '\0'; value++) {
+                if (pattern && (*value == '\\' || strchr(SH_GLOB_CHARS, *value) != NULL)) {
+                    *write++ = '\\';
+                }
+                *write++ = *value;
+            }
+            have_field = 1;
+            continue;
+        }
+        // Unquoted, a value's own pattern characters take effect.
+        for (; *value != '\0'; value++) {
+            if (strchr(ifs, *value) == NULL) {
+                if (pattern && *value == '\\') {
+                    *write++ = '\\';
+                }
+                *write++ = *value;
+                have_field = 1;
+            } else if (have_field) {
+                *write++ = '\0';
+                sh_fields_add(fields, field);
+                field = write;
+                have_field = 0;
+            }
+        }
+    }
+
+    if (have_field || !split) {
+        *write = '\0';
+        sh_fields_add(fields, field);
+    }
+}
+
+/**
+ * @brief Expand one word that is not split, such as a redirection target.
+ * @param word The word, as marked by the lexer.
+ * @return The expansion, allocated from sh_parse_arena.
+ */
+char *sh_expand_string(const char *word) {
+    struct sh_fields fields = {NULL, 0, 0};
+    char *field;
+
+    sh_expand_word(&fields, word, 0, 0);
+    field = fields.fields[0];
+    sh_fields_free(&fields);
+    return field;
+}
+
+// Pathname expansion, below.
+void sh_glob(const char *pattern, struct sh_fields *fields);
+void sh_glob_forget();
+
+/**
+ * @brief Expand a command's words.
+ * @param command The command, as parsed; left as it is.
+ * @param expanded Receives the expanded command, allocated from
+ * sh_parse_arena.
+ */
+void sh_expand_command(const struct sh_command *command, struct sh_command *expanded) {
+    struct sh_fields fields = {NULL, 0, 0};
+
+    *expanded = *command;
+    if (!command->expand) {
+        return;
+    }
+    expanded->expand = 0;
+
+    for (int i = 0; i < command->argc; i++) {
+        const char *word = command->argv[i];
+
+        if (strpbrk(word, SH_GLOB_CHARS) != NULL || strchr(word, SH_EXPAND) != NULL) {
+            // Unquoted pattern characters, or an expansion that may have
+            // some in its value: each field is matched against file names.
+            struct sh_fields patterns = {NULL, 0, 0};
+
+            sh_expand_word(&patterns, word, 1, 1);
+            for (int j = 0; j < patterns.count; j++) {
+                sh_glob(patterns.fields[j], &fields);
+            }
+            sh_fields_free(&patterns);
+        } else if (strpbrk(word, SH_EXPAND_BYTES) != NULL) {
+            sh_expand_word(&fields, word, 1, 0);
+        } else {
+            sh_fields_add(&fields, command->argv[i]);
+        }
+    }
+    sh_glob_forget();
+    expanded->argc = fields.count;
+    expanded->argv = sh_fields_finish(&fields);
+
+    if (command->nassigns > 0) {
+        expanded->assigns = sh_arena_alloc(&sh_parse_arena, command->nassigns * sizeof(char *));
+        for (int i = 0; i < command->nassigns; i++) {
+            expanded->assigns[i] = sh_expand_string(command->assigns[i]);
+        }
+    }
+    if (command->nredirects > 0) {
+        expanded->redirects = sh_arena_alloc(&sh_parse_arena, command->nredirects * sizeof(struct sh_redirect));
+        for (int i = 0; i < command->nredirects; i++) {
+            expanded->redirects[i] = command->redirects[i];
+            expanded->redirects[i].target = sh_expand_string(command->redirects[i].target);
+        }
+    }
+}
+
+/**
+ * @brief Expand the words of every command in a pipeline.
+ * @param pipeline The pipeline, as parsed; left as it is.
+ * @param expanded Receives the expanded pipeline, if it needs expanding.
+ * @return The pipeline to run: pipeline itself when nothing in it needs
+ * expanding, otherwise expanded.
+ */
+struct sh_pipeline *sh_expand_pipeline(struct sh_pipeline *pipeline, struct sh_pipeline *expanded) {
+    int i;
+
+    for (i = 0; i < pipeline->count && !pipeline->commands[i].expand; i++) {
+    }
+    if (i == pipeline->count) {
+        return pipeline;
+    }
+
+    *expanded = *pipeline;
+    expanded->commands = sh_arena_alloc(&sh_parse_arena, pipeline->count * sizeof(struct sh_command));
+    for (i = 0; i < pipeline->count; i++) {
+        sh_expand_command(&pipeline->commands[i], &expanded->commands[i]);
+    }
+    return expanded;
+}
+
+/*
+ * Pathname expansion. A pattern is split at its slashes, and each part with
+ * pattern characters in it is compiled once, to a list of tokens. The
+ * directories parts are matched in are read with a single getdents64 pass
+ * each and sorted once; the listings are kept until the command has been
+ * expanded, so the arguments that share a directory read it only once, and
+ * matches come out in order without sorting them. A part that starts with
+ * literal text is only matched against the range of names a binary search
+ * finds for that text. d_type tells which names are directories, so only
+ * symbolic links, and names from file systems that leave d_type out, are
+ * ever stat()ed.
+ */
+#define SH_GLOB_DIR_BUCKETS 64
+#define SH_GLOB_READ_SIZE (256 * 1024)
+
+enum sh_glob_kind {
+    SH_GLOB_LITERAL, // len bytes of text
+    SH_GLOB_ONE,     // '?': any one character
+    SH_GLOB_ANY,     // '*': any run of characters
+    SH_GLOB_SET      // "[...]": one character from set
+};
+
+struct sh_glob_token {
+    enum sh_glob_kind kind;
+    const char *text;
+    size_t len;
+    unsigned char set[32]; // bitmap over the first byte of the character
+};
+
+// One part of a pattern, between slashes.
+struct sh_glob_part {
+    const char *text; // unescaped, for a part without pattern characters
+    size_t len;
+    struct sh_glob_token *tokens; // NULL for a literal part
+    int ntokens;
+};
+
+struct sh_glob_name {
+    const char *name;
+    unsigned char type; // d_type
+};
+
+// A directory as read, sorted by name.
+struct sh_glob_dir {
+    char *path;
+    struct sh_glob_name *names;
+    size_t count;
+    char *strings;
+    struct sh_glob_dir *next;
+};
+
+// Layout of the records getdents64 returns.
+struct sh_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// The directories read while expanding the current command.
+struct sh_glob_dir *sh_glob_dirs[SH_GLOB_DIR_BUCKETS];
+int sh_glob_ndirs;
+char *sh_glob_buffer;
+
+// The path being built while walking a pattern.
+struct sh_glob_path {
+    char *text;
+    size_t len;
+    size_t size;
+};
+
+/**
+ * @brief Remove the backslashes quoting a pattern's characters.
+ * @param pattern The pattern.
+ * @param len Its length.
+ * @return The text it stands for, allocated from sh_parse_arena.
+ */
+char *sh_glob_unescape(const char *pattern, size_t len) {
+    char *text = sh_arena_alloc(&sh_parse_arena, len + 1), *w = text;
+
+    for (size_t i = 0; i < len; i++) {
+        if (pattern[i] == '\\' && i + 1 < len) {
+            i++;
+        }
+        *w++ = pattern[i];
+    }
+    *w = '\0';
+    return text;
+}
+
+/**
+ * @brief Compile a bracket expression into a set.
+ * @param p Right after the '['.
+ * @param end End of the part.
+ * @param token Receives the set.
+ * @return Right after the closing ']', or NULL if there is none, in which
+ * case the '[' stands for itself.
+ */
+const char *sh_glob_compile_set(const char *p, const char *end, struct sh_glob_token *token) {
+    static const struct {
+        const char *name;
+        int (*test)(int);
+    } classes[] = {
+            {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+            {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+            {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit}
+    };
+    int negate = p < end && (*p == '!' || *p == '^');
+    const char *first;
+
+    memset(token->set, 0, sizeof(token->set));
+    token->kind = SH_GLOB_SET;
+    p += negate;
+    for (first = p; p < end && (*p != ']' || p == first); p++) {
+        unsigned char low, high;
+
+        if (*p == '[' && p + 1 < end && p[1] == ':') {
+            const char *close = p + 2;
+
+            while (close + 1 < end && (close[0] != ':' || close[1] != ']')) {
+                close++;
+            }
+            if (close + 1 < end) {
+                // "[:name:]"; an unknown name matches nothing.
+                for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+                    if (strlen(classes[i].name) == (size_t) (close - p - 2) &&
+                        strncmp(classes[i].name, p + 2, close - p - 2) == 0) {
+                        for (int c = 1; c < 128; c++) {
+                            if (classes[i].test(c)) {
+                                token->set[c >> 3] |= 1 << (c & 7);
+                            }
+                        }
+                    }
+                }
+                p = close + 1;
+                continue;
+            }
+        }
+        if (*p == '\\' && p + 1 < end) {
+            p++;
+        }
+        low = high = *p;
+        if (p + 2 < end && p[1] == '-' && p[2] != ']') {
+            p += 2;
+            if (*p == '\\' && p + 1 < end) {
+                p++;
+            }
+            high = *p;
+        }
+        for (unsigned int c = low; c <= high; c++) {
+            token->set[c >> 3] |= 1 << (c & 7);
+        }
+    }
+    if (p >= end) {
+        return NULL;
+    }
+    if (negate) {
+        for (int i = 0; i < 32; i++) {
+            token->set[i] = ~token->set[i];
+        }
+    }
+    token->set[0] &= ~1; // never the NUL that ends a name
+    return p + 1;
+}
+
+/**
+ * @brief Check whether a pattern has pattern characters in it.
+ * @param pattern The pattern, in which a backslash quotes the next byte.
+ * @param len Its length.
+ * @return 1 if it has an unquoted '*' or '?', or a '[' closed by a ']'
+ * in the same part, as in "[ab]" but not "[" or "[a/b]".
+ */
+int sh_glob_active(const char *pattern, size_t len) {
+    const char *end = pattern + len;
+
+    for (const char *p = pattern; p < end; p++) {
+        if (*p == '\\' && p + 1 < end) {
+            p++;
+        } else if (*p == '*' || *p == '?') {
+            return 1;
+        } else if (*p == '[') {
+            const char *slash = memchr(p, '/', end - p);
+            struct sh_glob_token set;
+
+            if (sh_glob_compile_set(p + 1, slash != NULL ? slash : end, &set) != NULL) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Compile one part of a pattern.
+ * @param text The part, in which a backslash quotes the next byte.
+ * @param len Its length.
+ * @param part Receives the compiled part.
+ */
+void sh_glob_compile(const char *text, size_t len, struct sh_glob_part *part) {
+    const char *p = text, *end = text + len;
+    struct sh_glob_token *token;
+
+    part->text = NULL;
+    part->tokens = NULL;
+    part->ntokens = 0;
+    if (!sh_glob_active(text, len)) {
+        part->text = sh_glob_unescape(text, len);
+        part->len = strlen(part->text);
+        return;
+    }
+
+    // Never more tokens than bytes.
+    part->tokens = sh_arena_alloc(&sh_parse_arena, len * sizeof(*part->tokens));
+    while (p < end) {
+        token = &part->tokens[part->ntokens];
+        if (*p == '*') {
+            // Runs of '*' are one '*'.
+            if (part->ntokens == 0 || token[-1].kind != SH_GLOB_ANY) {
+                token->kind = SH_GLOB_ANY;
+                part->ntokens++;
+            }
+            p++;
+            continue;
+        }
+        if (*p == '?') {
+            token->kind = SH_GLOB_ONE;
+            part->ntokens++;
+            p++;
+            continue;
+        }
+        if (*p == '[') {
+            const char *next = sh_glob_compile_set(p + 1, end, token);
+
+            if (next != NULL) {
+                part->ntokens++;
+                p = next;
+                continue;
+            }
+        }
+
+        // Literal text, up to the next pattern character.
+        {
+            const char *start = p;
+            size_t n = 0;
+            char *literal;
+
+            p += *p == '[';
+            while (p < end && strchr(SH_GLOB_CHARS, *p) == NULL) {
+                p += *p == '\\' && p + 1 < end ? 2 : 1;
+            }
+            literal = sh_glob_unescape(start, p - start);
+            n = strlen(literal);
+            token->kind = SH_GLOB_LITERAL;
+            token->text = literal;
+            token->len = n;
+            part->ntokens++;
+        }
+    }
+}
+
+/**
+ * @brief Step over one UTF-8 character.
+ */
+const char *sh_glob_next_char(const char *p) {
+    do {
+        p++;
+    } while (((unsigned char) *p & 0xc0) == 0x80);
+    return p;
+}
+
+/**
+ * @brief Match a name against a compiled part.
+ * @param part The part.
+ * @param name The name.
+ * @return 1 if it matches.
+ */
+int sh_glob_match(const struct sh_glob_part *part, const char *name) {
+    const char *n = name, *star_name = NULL;
+    int t = 0, star = -1;
+
+    // A leading '.' is only matched by one written out.
+    if (*name == '.' && (part->tokens[0].kind != SH_GLOB_LITERAL || part->tokens[0].text[0] != '.')) {
+        return 0;
+    }
+
+    while (1) {
+        if (t < part->ntokens) {
+            const struct sh_glob_token *token = &part->tokens[t];
+            unsigned char c = *n;
+
+            if (token->kind == SH_GLOB_ANY) {
+                star = ++t;
+                star_name = n;
+                continue;
+            }
+            if (token->kind == SH_GLOB_LITERAL && strncmp(n, token->text, token->len) == 0) {
+                n += token->len;
+                t++;
+                continue;
+            }
+            if ((token->kind == SH_GLOB_ONE && c != '\0') ||
+                (token->kind == SH_GLOB_SET && (token->set[c >> 3] & (1 << (c & 7))))) {
+                n = sh_glob_next_char(n);
+                t++;
+                continue;
+            }
+        } else if (*n == '\0') {
+            return 1;
+        }
+
+        // Let the last '*' take one more character and try again from there.
+        if (star == -1 || *star_name == '\0') {
+            return 0;
+        }
+        n = star_name = sh_glob_next_char(star_name);
+        t = star;
+    }
+}
+
+/**
+ * @brief Sort names with a three-way radix quicksort: partitioning on one
+ * byte at a time, the bytes names share are compared only once, where
+ * strcmp in a plain sort compares them again every time. Directories of
+ * numbered files, all alike up to the number, are the usual case.
+ * @param names The names.
+ * @param count How many there are.
+ * @param depth Bytes all of them are known to have in common.
+ */
+void sh_glob_sort(struct sh_glob_name *names, size_t count, size_t depth) {
+    struct sh_glob_name swap;
+
+    while (count > 1) {
+        size_t lt = 0, i = 0, gt = count;
+        unsigned char pivot;
+
+        if (count < 12) {
+            for (size_t j = 1; j < count; j++) {
+                for (size_t k = j; k > 0 && strcmp(names[k - 1].name + depth, names[k].name + depth) > 0; k--) {
+                    swap = names[k], names[k] = names[k - 1], names[k - 1] = swap;
+                }
+            }
+            return;
+        }
+
+        // Median of three for the pivot byte.
+        {
+            unsigned char a = names[0].name[depth], b = names[count / 2].name[depth];
+            unsigned char c = names[count - 1].name[depth];
+
+            pivot = a < b ? (b < c ? b : a < c ? c : a) : (a < c ? a : b < c ? c : b);
+        }
+        while (i < gt) {
+            unsigned char c = names[i].name[depth];
+
+            if (c < pivot) {
+                swap = names[lt], names[lt++] = names[i], names[i++] = swap;
+            } else if (c > pivot) {
+                swap = names[--gt], names[gt] = names[i], names[i] = swap;
+            } else {
+                i++;
+            }
+        }
+        sh_glob_sort(names, lt, depth);
+        if (pivot != '\0') {
+            sh_glob_sort(names + lt, gt - lt, depth + 1);
+        }
+        names += gt;
+        count -= gt;
+    }
+}
+
+/**
+ * @brief Read a directory, or find it among those already read.
+ * @param path The directory; "" for the current one.
+ * @return Its names, sorted. A directory that cannot be read has none.
+ */
+struct sh_glob_dir *sh_glob_list(const char *path) {
+    unsigned int bucket = sh_hash_string(path) % SH_GLOB_DIR_BUCKETS;
+    struct sh_glob_dir *dir;
+    size_t strings_len = 0, strings_size = 0, names_size = 0;
+    long n;
+    int fd;
+
+    for (dir = sh_glob_dirs[bucket]; dir != NULL; dir = dir->next) {
+        if (strcmp(dir->path, path) == 0) {
+            return dir;
+        }
+    }
+
+    dir = sh_xcalloc(1, sizeof(*dir));
+    dir->path = sh_xstrdup(path);
+    dir->next = sh_glob_dirs[bucket];
+    sh_glob_dirs[bucket] = dir;
+    sh_glob_ndirs++;
+
+    fd = open(path[0] != '\0' ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return dir;
+    }
+    if (sh_glob_buffer == NULL) {
+        sh_glob_buffer = sh_xmalloc(SH_GLOB_READ_SIZE);
+    }
+    while ((n = syscall(SYS_getdents64, fd, sh_glob_buffer, SH_GLOB_READ_SIZE)) > 0) {
+        for (long offset = 0; offset < n;) {
+            struct sh_dirent64 *entry = (struct sh_dirent64 *) (sh_glob_buffer + offset);
+            const char *name = entry->d_name;
+            size_t len = strlen(name) + 1;
+
+            offset += entry->d_reclen;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            // Names are stored by offset until the strings stop moving.
+            dir->names = sh_grow(dir->names, &names_size, dir->count, sizeof(*dir->names));
+            dir->names[dir->count].name = (const char *) strings_len;
+            dir->names[dir->count++].type = entry->d_type;
+            while (strings_len + len > strings_size) {
+                strings_size = strings_size ? 2 * strings_size : 4096;
+                dir->strings = sh_xrealloc(dir->strings, strings_size);
+            }
+            memcpy(dir->strings + strings_len, name, len);
+            strings_len += len;
+        }
+    }
+    close(fd);
+
+    for (size_t i = 0; i < dir->count; i++) {
+        dir->names[i].name = dir->strings + (size_t) dir->names[i].name;
+    }
+    sh_glob_sort(dir->names, dir->count, 0);
+    return dir;
+}
+
+/**
+ * @brief Drop the directories read while expanding a command.
+ */
+void sh_glob_forget() {
+    if (sh_glob_ndirs == 0) {
+        return;
+    }
+    for (int i = 0; i < SH_GLOB_DIR_BUCKETS; i++) {
+        struct sh_glob_dir *dir, *next;
+
+        for (dir = sh_glob_dirs[i]; dir != NULL; dir = next) {
+            next = dir->next;
+            free(dir->path);
+            free(dir->names);
+            free(dir->strings);
+            free(dir);
+        }
+        sh_glob_dirs[i] = NULL;
+    }
+    sh_glob_ndirs = 0;
+}
+
+/**
+ * @brief Append to the path being built.
+ */
+void sh_glob_append(struct sh_glob_path *path, const char *text, size_t len) {
+    if (path->len + len + 1 > path->size) {
+        while (path->len + len + 1 > path->size) {
+            path->size = path->size ? 2 * path->size : 256;
+        }
+        path->text = sh_xrealloc(path->text, path->size);
+    }
+    memcpy(path->text + path->len, text, len);
+    path->len += len;
+    path->text[path->len] = '\0';
+}
+
+/**
+ * @brief Check whether a directory entry is a directory.
+ * @param path Path of the entry.
+ * @param type Its d_type.
+ */
+int sh_glob_is_dir(const char *path, unsigned char type) {
+    struct stat st;
+
+    if (type == DT_DIR) {
+        return 1;
+    }
+    if (type != DT_LNK && type != DT_UNKNOWN) {
+        return 0;
+    }
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * @brief Match the parts of a pattern from one on, below a path.
+ * @param parts The parts.
+ * @param count How many there are.
+ * @param dirs_only Whether the pattern ended in '/', so that it only matches
+ * directories.
+ * @param path The path so far, ending in '/' unless empty; restored.
+ * @param fields Receives the matches.
+ * @return How many matches were found.
+ */
+size_t sh_glob_walk(const struct sh_glob_part *parts, int count, int dirs_only,
+                    struct sh_glob_path *path, struct sh_fields *fields) {
+    const struct sh_glob_part *part = parts;
+    size_t saved = path->len, found = 0, first = 0, last;
+    struct sh_glob_dir *dir;
+
+    if (part->tokens == NULL) {
+        struct stat st;
+
+        sh_glob_append(path, part->text, part->len);
+        if (count > 1) {
+            sh_glob_append(path, "/", 1);
+            found = sh_glob_walk(parts + 1, count - 1, dirs_only, path, fields);
+        } else if (dirs_only ? stat(path->text, &st) == 0 && S_ISDIR(st.st_mode)
+                             : fstatat(AT_FDCWD, path->text, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            if (dirs_only) {
+                sh_glob_append(path, "/", 1);
+            }
+            sh_fields_add(fields, sh_arena_strndup(&sh_parse_arena, path->text, path->len));
+            found = 1;
+        }
+        path->len = saved;
+        path->text[saved] = '\0';
+        return found;
+    }
+
+    dir = sh_glob_list(path->len > 0 ? path->text : "");
+    last = dir->count;
+    if (part->tokens[0].kind == SH_GLOB_LITERAL) {
+        // Only the names starting with the literal text can match.
+        const struct sh_glob_token *prefix = &part->tokens[0];
+        size_t high = dir->count;
+
+        while (first < high) {
+            size_t mid = first + (high - first) / 2;
+
+            if (strncmp(dir->names[mid].name, prefix->text, prefix->len) < 0) {
+                first = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        for (last = first; last < dir->count &&
+                           strncmp(dir->names[last].name, prefix->text, prefix->len) == 0; last++) {
+        }
+    }
+
+    for (size_t i = first; i < last; i++) {
+        const struct sh_glob_name *name = &dir->names[i];
+
+        if (!sh_glob_match(part, name->name)) {
+            continue;
+        }
+        sh_glob_append(path, name->name, strlen(name->name));
+        if (count == 1 && !dirs_only) {
+            sh_fields_add(fields, sh_arena_strndup(&sh_parse_arena, path->text, path->len));
+            found++;
+        } else if (sh_glob_is_dir(path->text, name->type)) {
+            sh_glob_append(path, "/", 1);
+            if (count == 1) {
+                sh_fields_add(fields, sh_arena_strndup(&sh_parse_arena, path->text, path->len));
+                found++;
+            } else {
+                found += sh_glob_walk(parts + 1, count - 1, dirs_only, path, fields);
+            }
+        }
+        path->len = saved;
+        path->text[saved] = '\0';
+    }
+    return found;
+}
+
+/**
+ * @brief Expand a pattern to the paths it matches.
+ * @param pattern The pattern, in which a backslash quotes the next byte.
+ * @param fields Receives the paths in order, or the pattern's text if none
+ * match.
+ */
+void sh_glob(const char *pattern, struct sh_fields *fields) {
+    struct sh_glob_path path = {NULL, 0, 0};
+    struct sh_glob_part *parts;
+    size_t len = strlen(pattern);
+    int count = 0, dirs_only = 0;
+    const char *p, *end;
+
+    if (!sh_glob_active(pattern, len)) {
+        sh_fields_add(fields, sh_glob_unescape(pattern, len));
+        return;
+    }
+
+    end = pattern + len;
+    while (end > pattern + 1 && end[-1] == '/') {
+        end--;
+        dirs_only = 1;
+    }
+    parts = sh_arena_alloc(&sh_parse_arena, (len + 1) * sizeof(*parts));
+    for (p = pattern;; p++) {
+        const char *slash = memchr(p, '/', end - p);
+
+        if (slash == NULL) {
+            slash = end;
+        }
+        sh_glob_compile(p, slash - p, &parts[count++]);
+        if (slash == end) {
+            break;
+        }
+        p = slash;
+    }
+
+    sh_glob_append(&path, "", 0);
+    if (sh_glob_walk(parts, count, dirs_only, &path, fields) == 0) {
+        sh_fields_add(fields, sh_glob_unescape(pattern, len));
+    }
+    free(path.text);
+}
+
+/*
+ * Redirections become fd moves, applied after the pipeline's own. Files are
+ * opened by the shell, close-on-exec and at SH_REDIRECT_FD_MIN or above, so
+ * they never collide with an fd a later move targets. A child gets the
+ * moves as part of its setup; a builtin has them applied to the shell
+ * itself, with every fd it replaces saved and put back afterwards.
+ */
+#define SH_REDIRECT_FD_MIN 10
+
+struct sh_fd_save {
+    int target;
+    int saved; // copy of what target was, or -1 if it was closed
+    int flags; // fd flags of target
+};
+
+/**
+ * @brief Close the files sh_redirect_open() opened.
+ * @param command The command.
+ * @param moves Its moves.
+ * @param count How many of them to close.
+ */
+void sh_redirect_close(struct sh_command *command, const struct sh_fd_move *moves, int count) {
+    for (int i = 0; i < count; i++) {
+        if (command->redirects[i].kind != SH_REDIRECT_DUP_INPUT &&
+            command->redirects[i].kind != SH_REDIRECT_DUP_OUTPUT) {
+            close(moves[i].fd);
+        }
+    }
+}
+
+/**
+ * @brief Check whether a command redirects an fd.
+ * @param command The command.
+ * @param fd The fd.
+ * @return Nonzero if one of its redirections targets fd.
+ */
+int sh_redirect_targets(struct sh_command *command, int fd) {
+    for (int i = 0; i < command->nredirects; i++) {
+        if (command->redirects[i].fd == fd) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Turn a command's redirections into fd moves, opening its files.
+ * @param command The command.
+ * @param moves Receives command->nredirects moves.
+ * @return 0 on success, -1 on failure (reported; nothing is left open).
+ */
+int sh_redirect_open(struct sh_command *command, struct sh_fd_move *moves) {
+    static const int flags[] = {
+            O_RDONLY,
+            O_WRONLY | O_CREAT | O_TRUNC,
+            O_WRONLY | O_CREAT | O_APPEND,
+            O_RDWR | O_CREAT
+    };
+
+    for (int i = 0; i < command->nredirects; i++) {
+        struct sh_redirect *redirect = &command->redirects[i];
+        struct sh_fd_move *move = &moves[i];
+
+        move->target = redirect->fd;
+        if (redirect->kind == SH_REDIRECT_DUP_INPUT || redirect->kind == SH_REDIRECT_DUP_OUTPUT) {
+            char *end;
+
+            // Duplicate an fd, or close the target for "-".
+            move->fd = strcmp(redirect->target, "-") == 0 ? -1 : (int) strtol(redirect->target, &end, 10);
+            if (move->fd != -1 && (*end != '\0' || end == redirect->target || move->fd < 0)) {
+                fprintf(stderr, "sh: %s: ambiguous redirect\n", redirect->target);
+                sh_redirect_close(command, moves, i);
+                return -1;
+            }
+            continue;
+        }
+
+        move->fd = open(redirect->target, flags[redirect->kind] | O_CLOEXEC, 0666);
+        while (move->fd >= 0 && (move->fd < SH_REDIRECT_FD_MIN || sh_redirect_targets(command, move->fd))) {
+            int high = fcntl(move->fd, F_DUPFD_CLOEXEC,
+                             move->fd < SH_REDIRECT_FD_MIN ? SH_REDIRECT_FD_MIN : move->fd + 1);
+
+            close(move->fd);
+            move->fd = high;
+        }
+        if (move->fd == -1) {
+            fprintf(stderr, "sh: %s: %s\n", redirect->target, strerror(errno));
+            sh_redirect_close(command, moves, i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Apply fd moves to the shell itself.
+ * @param moves The moves.
+ * @param count Number of moves.
+ * @param saves Receives what is needed to undo each move.
+ * @return Number of moves applied; fewer than count on failure (reported).
+ */
+int sh_redirect_apply(const struct sh_fd_move *moves, int count, struct sh_fd_save *saves) {
+    // Whatever is buffered belongs to the old stdout.
+    fflush(stdout);
+
+    for (int i = 0; i < count; i++) {
+        const struct sh_fd_move *move = &moves[i];
+        struct sh_fd_save *save = &saves[i];
+
+        save->target = move->target;
+        save->flags = fcntl(move->target, F_GETFD);
+        save->saved = save->flags == -1 ? -1 : fcntl(move->target, F_DUPFD_CLOEXEC, SH_REDIRECT_FD_MIN);
+        if (save->flags != -1 && save->saved == -1) {
+            perror("sh");
+            return i;
+        }
+
+        if (move->fd == -1) {
+            close(move->target);
+        } else if (move->fd == move->target) {
+            fcntl(move->target, F_SETFD, 0);
+        } else if (dup3(move->fd, move->target, 0) == -1) {
+            fprintf(stderr, "sh: %d: %s\n", move->fd, strerror(errno));
+            if (save->saved != -1) {
+                close(save->saved);
+            }
+            return i;
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Undo sh_redirect_apply(), in reverse order.
+ * @param saves What it saved.
+ * @param count Number of moves it applied.
+ */
+void sh_redirect_restore(struct sh_fd_save *saves, int count) {
+    fflush(stdout);
+
+    for (int i = count - 1; i >= 0; i--) {
+        struct sh_fd_save *save = &saves[i];
+
+        if (save->saved == -1) {
+            close(save->target);
+        } else {
+            dup3(save->saved, save->target, save->flags & FD_CLOEXEC ? O_CLOEXEC : 0);
+            close(save->saved);
+        }
+    }
+}
+
+/*
+ * Pipelines. Every stage is started before any is waited for, and the
+ * stages are connected directly with close-on-exec pipes.
+ *
+ * A stage that is one of the builtins in sh_stage_builtins, with no
+ * redirections or assignments, runs on a thread of the shell rather than
+ * in a forked child. Those builtins read nothing but their arguments,
+ * files and the stage's stdin, and write nothing but the stage's stdout,
+ * both of which the thread has of its own; their status is per thread
+ * too. The thread is a process of the job like any other, done when it
+ * signals its eventfd in the child epoll set.
+ */
+// Pipe buffer size requested with F_SETPIPE_SZ, from $SH_PIPE_SIZE; 0 keeps
+// the kernel default.
+int sh_pipe_size;
+
+// Whether builtin stages may run on threads; $SH_PIPE_THREADS=0 forks them.
+int sh_pipe_threads = 1;
+
+// Held by a pipeline thread while it closes its stdin and stdout, and
+// across every fork, so that a forked child knows which are still open.
+pthread_mutex_t sh_stage_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Defined below.
+void sh_stage_fork_prepare();
+void sh_stage_fork_parent();
+void sh_stage_fork_child();
+
+/**
+ * @brief Read the requested pipe buffer size from SH_PIPE_SIZE, and
+ * whether to use pipeline threads from SH_PIPE_THREADS.
+ */
+void sh_pipe_init() {
+    char *size = getenv("SH_PIPE_SIZE");
+    char *threads = getenv("SH_PIPE_THREADS");
+
+    if (size != NULL) {
+        sh_pipe_size = atoi(size);
+    }
+    if (threads != NULL) {
+        sh_pipe_threads = atoi(threads) != 0;
+    }
+    if (sh_pipe_threads &&
+        pthread_atfork(&sh_stage_fork_prepare, &sh_stage_fork_parent, &sh_stage_fork_child) != 0) {
+        sh_pipe_threads = 0;
+    }
+}
+
+// Defined with the coprocesses, further down.
+void sh_coproc_drop();
+
+// Defined with command substitution, further down.
+void sh_subshell();
+
+/**
+ * @brief Run a builtin as a job of its own, in a child process.
+ * @param builtin The builtin.
+ * @param args Null terminated list of arguments.
+ * @param opts Child-side setup.
+ * @return Pid of the child, or -1 if it could not be started (reported).
+ */
+pid_t sh_start_builtin(struct sh_builtin *builtin, char **args,
+                       const struct sh_spawn_opts *opts) {
+    pid_t pid;
+
+    // The child would otherwise write out our pending output a second time.
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        if (sh_child_setup(opts) == -1) {
+            perror("sh");
+            _exit(EXIT_FAILURE);
+        }
+        sh_subshell();
+        sh_prev_status = sh_last_status;
+        sh_last_status = 0;
+        (*builtin->func)(args);
+        fflush(stdout);
+        _exit(sh_last_status);
+    } else if (pid < 0) {
+        perror("sh");
+    } else if (opts->pgid >= 0) {
+        setpgid(pid, opts->pgid ? opts->pgid : pid);
+    }
+    return pid;
+}
+
+// Builtins a pipeline stage may run on a thread.
+int (*const sh_stage_builtins[])(char **) = {
+        &sh_echo, &sh_printf, &sh_pwd, &sh_test, &sh_true, &sh_false, &sh_cat
+};
+
+#define SH_NUM_STAGE_BUILTINS ((int) (sizeof(sh_stage_builtins) / sizeof(sh_stage_builtins[0])))
+
+// A builtin stage running on a thread.
+struct sh_stage {
+    pthread_t thread;
+    int (*func)(char **);
+    char **args;     // copied, in the same allocation as this
+    int in_fd;       // its stdin, closed when it returns; -1 for the shell's
+    FILE *out;       // its stdout, closed when it returns
+    int out_fd;      // out's fd; -1 once closed
+    int done_fd;     // eventfd, signalled when it returns
+    int prev_status; // $? when it started
+    int status;      // wait status, once done
+};
+
+/**
+ * @brief Check whether a pipeline stage can run on a thread.
+ * @param builtin The stage's builtin.
+ * @param command The stage.
+ * @param first Whether it is the first stage, whose stdin is the shell's.
+ * @return Nonzero if it can.
+ */
+int sh_stage_threadable(const struct sh_builtin *builtin, const struct sh_command *command,
+                        int first) {
+    int i;
+
+    if (!sh_pipe_threads || command->nredirects > 0 || command->nassigns > 0) {
+        return 0;
+    }
+    for (i = 0; i < SH_NUM_STAGE_BUILTINS && builtin->func != sh_stage_builtins[i]; i++) {
+    }
+    if (i == SH_NUM_STAGE_BUILTINS) {
+        return 0;
+    }
+    if (builtin->func == &sh_cat) {
+        // cat with options runs the real one; and reading the terminal,
+        // only a process would stop at ^C.
+        if (first) {
+            return 0;
+        }
+        for (i = 1; i < command->argc; i++) {
+            if (command->argv[i][0] == '-' && command->argv[i][1] != '\0') {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Body of a pipeline thread: run its builtin, close its stdin and
+ * stdout and signal that it is done.
+ * @param arg The stage.
+ * @return NULL.
+ */
+void *sh_stage_main(void *arg) {
+    struct sh_stage *stage = arg;
+    uint64_t one = 1;
+    int broken;
+
+    sh_stage_stdin = stage->in_fd;
+    sh_stage_stdout = stage->out;
+    sh_prev_status = stage->prev_status;
+    sh_last_status = 0;
+    (*stage->func)(stage->args);
+
+    // A process would have died of SIGPIPE, which is blocked here. Only
+    // closing is left for under the lock: a flush may wait for a reader
+    // the shell has yet to fork.
+    broken = fflush(stage->out) == EOF || ferror(stage->out);
+    pthread_mutex_lock(&sh_stage_lock);
+    fclose(stage->out);
+    if (stage->in_fd != -1) {
+        close(stage->in_fd);
+    }
+    stage->in_fd = stage->out_fd = -1;
+    pthread_mutex_unlock(&sh_stage_lock);
+    stage->status = broken || sh_last_status == 128 + SIGPIPE ? SIGPIPE : (sh_last_status & 0xff) << 8;
+    while (write(stage->done_fd, &one, sizeof(one)) == -1 && errno == EINTR) {
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start a builtin stage on a thread.
+ * @param builtin The builtin.
+ * @param args Null terminated list of arguments; copied.
+ * @param in_fd Fd for its stdin, or -1 to leave it the shell's. Taken over
+ * on success.
+ * @param out_fd Fd for its stdout. Taken over on success.
+ * @return The stage, or NULL if no thread could be started.
+ */
+struct sh_stage *sh_stage_start(struct sh_builtin *builtin, char **args, int in_fd, int out_fd) {
+    size_t size = sizeof(struct sh_stage);
+    sigset_t all, saved;
+    struct sh_stage *stage;
+    char *text;
+    int argc;
+
+    for (argc = 0; args[argc] != NULL; argc++) {
+        size += sizeof(char *) + strlen(args[argc]) + 1;
+    }
+    size += sizeof(char *);
+    stage = sh_xmalloc(size);
+    stage->func = builtin->func;
+    stage->args = (char **) (stage + 1);
+    text = (char *) (stage->args + argc + 1);
+    for (int i = 0; i < argc; i++) {
+        stage->args[i] = text;
+        text = stpcpy(text, args[i]) + 1;
+    }
+    stage->args[argc] = NULL;
+    stage->in_fd = in_fd;
+    stage->out_fd = out_fd;
+    stage->prev_status = sh_last_status;
+
+    if ((stage->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+        free(stage);
+        return NULL;
+    }
+    if ((stage->out = fdopen(out_fd, "w")) == NULL) {
+        close(stage->done_fd);
+        free(stage);
+        return NULL;
+    }
+    setvbuf(stage->out, NULL, _IOFBF, SH_OUTPUT_BUFFER_SIZE);
+
+    // Every signal stays with the shell's own thread; a write to a closed
+    // pipe fails with EPIPE instead of raising SIGPIPE.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    if (pthread_create(&stage->thread, NULL, &sh_stage_main, stage) != 0) {
+        int keep = dup(out_fd);
+
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        // The stream closes out_fd, which the caller still has.
+        fclose(stage->out);
+        if (keep != -1) {
+            dup3(keep, out_fd, O_CLOEXEC);
+            close(keep);
+        }
+        close(stage->done_fd);
+        free(stage);
+        return NULL;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return stage;
+}
+
+/**
+ * @brief Before a fork: keep pipeline threads from closing their fds.
+ */
+void sh_stage_fork_prepare() {
+    pthread_mutex_lock(&sh_stage_lock);
+}
+
+/**
+ * @brief After a fork, in the shell.
+ */
+void sh_stage_fork_parent() {
+    pthread_mutex_unlock(&sh_stage_lock);
+}
+
+/**
+ * @brief After a fork, in the child: close the fds of the pipeline threads,
+ * which did not come along. Kept open, they would keep the threads'
+ * neighbours from ever seeing EOF.
+ */
+void sh_stage_fork_child() {
+    for (struct sh_job *job = sh_job_table; job != NULL; job = job->next) {
+        for (int i = 0; i < job->nprocs; i++) {
+            struct sh_stage *stage = job->procs[i].stage;
+
+            if (stage == NULL) {
+                continue;
+            }
+            if (stage->in_fd != -1) {
+                close(stage->in_fd);
+            }
+            if (stage->out_fd != -1) {
+                close(stage->out_fd);
+            }
+        }
+    }
+    pthread_mutex_unlock(&sh_stage_lock);
+}
+
+/**
+ * @brief Collect a pipeline thread that has returned.
+ * @param proc Its process in the job.
+ */
+void sh_stage_reap(struct sh_process *proc) {
+    struct sh_stage *stage = proc->stage;
+    struct rusage usage = {0};
+    int status;
+
+    pthread_join(stage->thread, NULL);
+    status = stage->status;
+    proc->stage = NULL;
+    free(stage);
+    // Its usage is the shell's own.
+    sh_process_update(proc, status, &usage);
+}
+
+/**
+ * @brief Record a builtin stage running on a thread as a process of a job.
+ * @param job The job.
+ * @param stage The stage, just started.
+ */
+void sh_job_add_stage(struct sh_job *job, struct sh_stage *stage) {
+    struct sh_process *proc = &job->procs[job->nprocs++];
+    struct epoll_event event = {EPOLLIN, {.ptr = proc}};
+
+    proc->watch = SH_WATCH_THREAD;
+    proc->pid = 0;
+    proc->job = job;
+    proc->stage = stage;
+    proc->state = SH_JOB_RUNNING;
+    proc->pidfd = stage->done_fd;
+    if (epoll_ctl(sh_child_epoll, EPOLL_CTL_ADD, stage->done_fd, &event) == -1) {
+        // Nothing would tell of it returning, so wait for it now.
+        sh_stage_reap(proc);
+        return;
+    }
+    sh_job_update_state(job);
+}
+
+/**
+ * @brief Render a pipeline as text, for the job table.
+ * @param pipeline The pipeline.
+ * @return The text, allocated from sh_parse_arena.
+ */
+char *sh_pipeline_text(struct sh_pipeline *pipeline) {
+    size_t len = 3;
+    char *text, *p;
+
+    for (int i = 0; i < pipeline->count; i++) {
+        for (int j = 0; j < pipeline->commands[i].nassigns; j++) {
+            len += strlen(pipeline->commands[i].assigns[j]) + 1;
+        }
+        for (int j = 0; j < pipeline->commands[i].argc; j++) {
+            len += strlen(pipeline->commands[i].argv[j]) + 3;
+        }
+        for (int j = 0; j < pipeline->commands[i].nredirects; j++) {
+            len += strlen(pipeline->commands[i].redirects[j].target) + 16;
+        }
+    }
+
+    p = text = sh_arena_alloc(&sh_parse_arena, len);
+    for (int i = 0; i < pipeline->count; i++) {
+        if (i > 0) {
+            p = stpcpy(p, " | ");
+        }
+        for (int j = 0; j < pipeline->commands[i].nassigns; j++) {
+            p = stpcpy(stpcpy(p, pipeline->commands[i].assigns[j]), " ");
+        }
+        for (int j = 0; j < pipeline->commands[i].argc; j++) {
+            if (j > 0) {
+                *p++ = ' ';
+            }
+            p = stpcpy(p, pipeline->commands[i].argv[j]);
+        }
+        for (int j = 0; j < pipeline->commands[i].nredirects; j++) {
+            struct sh_redirect *redirect = &pipeline->commands[i].redirects[j];
+
+            if (p > text) {
+                *p++ = ' ';
+            }
+            if (redirect->fd != sh_redirect_default_fd[redirect->kind]) {
+                p += sprintf(p, "%d", redirect->fd);
+            }
+            p = stpcpy(stpcpy(p, sh_redirect_ops[redirect->kind]), redirect->target);
+        }
+    }
+    strcpy(p, pipeline->background ? " &" : "");
+    return text;
+}
+
+/**
+ * @brief Launch every stage of a pipeline as one job.
+ *
+ * A foreground job is waited for; a background one is left to the reaper.
+ * @param pipeline The pipeline.
+ * @return Always return 1, to continue execution.
+ */
+int sh_launch_pipeline(struct sh_pipeline *pipeline) {
+    struct sh_job *job = sh_job_new(pipeline->count, sh_pipeline_text(pipeline),
+                                    pipeline->background);
+    const struct sh_limits *limits = sh_launch_limits.nrlimits > 0 || sh_launch_limits.cgroup_procs != -1
+                                     ? &sh_launch_limits : NULL;
+    int prev_read = -1;
+
+    // Without job control a background job must not compete with the
+    // shell for its input.
+    if (pipeline->background && !sh_job_control) {
+        prev_read = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    sh_reader_sync(&sh_stdin);
+    fflush(stdout);
+
+    for (int i = 0; i < pipeline->count; i++) {
+        struct sh_command *command = &pipeline->commands[i];
+        char **args = command->argv;
+        // A command of only redirections opens its files and runs nothing.
+        struct sh_builtin *builtin = sh_builtin_find(args[0] != NULL ? args[0] : "true");
+        struct sh_fd_move *moves = sh_arena_alloc(&sh_parse_arena,
+                                                  (2 + command->nredirects) * sizeof(*moves));
+        struct sh_spawn_opts opts = {moves, 0, sh_job_control ? job->pgid : -1, limits};
+        struct sh_stage *stage = NULL;
+        int fds[2] = {-1, -1};
+
+        if (i < pipeline->count - 1) {
+            if (pipe2(fds, O_CLOEXEC) == -1) {
+                perror("sh: pipe");
+                sh_job_add(job, -1);
+                break;
+            }
+#ifdef F_SETPIPE_SZ
+            // Best effort: the kernel caps this at /proc/sys/fs/pipe-max-size.
+            if (sh_pipe_size > 0) {
+                fcntl(fds[1], F_SETPIPE_SZ, sh_pipe_size);
+            }
+#endif
+        }
+
+        if (prev_read != -1) {
+            moves[opts.nmoves++] = (struct sh_fd_move) {prev_read, STDIN_FILENO};
+        }
+        if (fds[1] != -1) {
+            moves[opts.nmoves++] = (struct sh_fd_move) {fds[1], STDOUT_FILENO};
+        }
+
+        // A background job ends in a process, for $!, kill and wait; a
+        // thread takes no signals.
+        if (args[0] != NULL && builtin != NULL && limits == NULL &&
+            !(pipeline->background && i == pipeline->count - 1) &&
+            sh_stage_threadable(builtin, command, i == 0)) {
+            int out = fds[1] != -1 ? fds[1] : fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+
+            if (out != -1 && (stage = sh_stage_start(builtin, args, prev_read, out)) == NULL &&
+                out != fds[1]) {
+                close(out);
+            }
+        }
+
+        if (stage != NULL) {
+            sh_job_add_stage(job, stage);
+            // The thread has them now.
+            prev_read = fds[1] = -1;
+        } else if (sh_redirect_open(command, moves + opts.nmoves) == -1) {
+            sh_job_add(job, -1);
+            job->procs[job->nprocs - 1].status = 1 << 8;
+        } else {
+            struct sh_var_save *vars = sh_var_push(command->assigns, command->nassigns);
+
+            opts.nmoves += command->nredirects;
+            if (builtin != NULL) {
+                sh_job_add(job, sh_start_builtin(builtin, args, &opts));
+            } else {
+                sh_job_add(job, sh_start(args, &opts));
+            }
+            sh_var_pop(vars, command->nassigns);
+            sh_redirect_close(command, moves + opts.nmoves - command->nredirects, command->nredirects);
+        }
+
+        // The children hold their own copies; neighbours of a stage that
+        // failed to start see EOF or EPIPE.
+        if (prev_read != -1) {
+            close(prev_read);
+        }
+        if (fds[1] != -1) {
+            close(fds[1]);
+        }
+        prev_read = fds[0];
+    }
+
+    if (prev_read != -1) {
+        close(prev_read);
+    }
+    if (sh_launch_limits.timeout > 0) {
+        sh_job_timer_start(job, sh_launch_limits.timeout, sh_launch_limits.timeout_signal,
+                         sh_launch_limits.kill_after);
+    }
+
+    if (pipeline->background) {
+        job->notified = 1;
+        sh_last_background = job->procs[job->nprocs - 1].pid;
+        if (sh_interactive) {
+            printf("[%d] %ld\n", job->id, (long) job->procs[job->nprocs - 1].pid);
+        }
+        sh_last_status = 0;
+    } else {
+        sh_job_foreground(job);
+    }
+    return 1;
+}
+
+/**
+ * @brief Launch a program and wait for it to terminate.
+ * @param args Null terminated list of arguments (including program).
+ * @return Always return 1, to continue execution.
+ */
+int sh_launch(char **args) {
+    struct sh_command command = {args, 0, NULL, 0};
+    struct sh_pipeline pipeline = {&command, 1, 0};
+
+    while (args[command.argc] != NULL) {
+        command.argc++;
+    }
+    return sh_launch_pipeline(&pipeline);
+}
+
+/**
+ * @brief Execute shell built-in or launch program.
+ * @param args Null terminated list of arguments.
+ * @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int sh_execute(char **args) {
+    struct sh_builtin *builtin;
+
+    if (args[0] == NULL) {
+        // An empty command was entered.
+        return 1;
+    }
+
+    SH_PROFILE_START(LOOKUP);
+    builtin = sh_builtin_find(args[0]);
+    SH_PROFILE_STOP(LOOKUP);
+    if (builtin != NULL) {
+        // Builtins report failure by setting sh_last_status.
+        sh_prev_status = sh_last_status;
+        sh_last_status = 0;
+        return (*builtin->func)(args);
+    }
+
+    return sh_launch(args);
+}
+
+/**
+ * @brief Run a builtin, or nothing, with the command's redirections applied
+ * in-process and its assignments in effect.
+ * @param command The command; argc may be 0.
+ * @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int sh_execute_redirected(struct sh_command *command) {
+    struct sh_fd_move *moves = sh_arena_alloc(&sh_parse_arena, command->nredirects * sizeof(*moves));
+    struct sh_fd_save *saves = sh_arena_alloc(&sh_parse_arena, command->nredirects * sizeof(*saves));
+    struct sh_reader saved_stdin = sh_stdin;
+    int applied, status = 1, stdin_moved = 0;
+
+    if (sh_redirect_open(command, moves) == -1) {
+        sh_last_status = 1;
+        return 1;
+    }
+    applied = sh_redirect_apply(moves, command->nredirects, saves);
+    sh_redirect_close(command, moves, command->nredirects);
+
+    for (int i = 0; i < applied; i++) {
+        stdin_moved |= moves[i].target == STDIN_FILENO;
+    }
+    if (stdin_moved) {
+        // What the old stdin's reader has buffered is not in the new one.
+        sh_stdin = (struct sh_reader) {STDIN_FILENO};
+    }
+
+    if (applied < command->nredirects) {
+        sh_last_status = 1;
+    } else {
+        struct sh_var_save *vars = sh_var_push(command->assigns, command->nassigns);
+
+        status = sh_execute(command->argv);
+        sh_var_pop(vars, command->nassigns);
+    }
+
+    sh_redirect_restore(saves, applied);
+    if (stdin_moved) {
+        free(sh_stdin.buffer);
+        sh_stdin = saved_stdin;
+    }
+    return status;
+}
+
+/**
+ * @brief Execute a pipeline.
+ * @param pipeline The pipeline.
+ * @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int sh_execute_pipeline(struct sh_pipeline *pipeline) {
+    unsigned long substitutions = sh_substitutions;
+    struct sh_pipeline expanded;
+    struct sh_command *command;
+
+    pipeline = sh_expand_pipeline(pipeline, &expanded);
+    command = &pipeline->commands[0];
+    if (pipeline->count == 1 && !pipeline->background) {
+        if (command->argc == 0) {
+            // Assignments without a command set shell variables for good;
+            // $? is 0 unless they ran a substitution, which leaves its own.
+            for (int i = 0; i < command->nassigns; i++) {
+                sh_var_assign(command->assigns[i], 0);
+            }
+            if (sh_substitutions == substitutions) {
+                sh_last_status = 0;
+            }
+            return command->nredirects > 0 ? sh_execute_redirected(command) : 1;
+        }
+        if (command->nredirects == 0 && command->nassigns == 0) {
+            return sh_execute(command->argv);
+        }
+        if (sh_builtin_find(command->argv[0]) != NULL) {
+            return sh_execute_redirected(command);
+        }
+    }
+    return sh_launch_pipeline(pipeline);
+}
+
+// A loop that is running.
+struct sh_loop_frame {
+    struct sh_arena_mark mark; // what each iteration releases back to
+    char **items;              // a for loop's words, expanded
+    int count, index;
+    const char *name;
+    size_t name_len;
+    int status; // of the last iteration, or 0
+};
+
+/**
+ * @brief Run compiled code.
+ *
+ * Whatever a pipeline or an iteration allocated from sh_parse_arena is
+ * released once it is done, so a loop runs in constant space.
+ * @param code The code.
+ * @param ncode How many ops it has.
+ * @param depth Its deepest loop nesting.
+ * @param pipeline Gets the pipeline an op refers to, by index.
+ * @param source Passed on to pipeline.
+ * @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int sh_execute_code(const struct sh_op *code, uint32_t ncode, int depth,
+                    struct sh_pipeline *(*pipeline)(void *source, uint32_t index), void *source) {
+    struct sh_loop_frame *frames = sh_arena_alloc(&sh_parse_arena, depth * sizeof(*frames));
+    struct sh_arena_mark start = sh_arena_save(&sh_parse_arena);
+    uint32_t pc = 0;
+
+    for (int i = 0; i < depth; i++) {
+        frames[i] = (struct sh_loop_frame) {.mark = start};
+    }
+    while (pc < ncode) {
+        const struct sh_op *op = &code[pc++];
+        struct sh_loop_frame *frame = op->loop > 0 ? &frames[op->loop - 1] : NULL;
+
+        switch (op->code) {
+        case SH_OP_RUN:
+            if (!sh_execute_pipeline(pipeline(source, op->arg))) {
+                return 0;
+            }
+            sh_arena_release(&sh_parse_arena, frame != NULL ? frame->mark : start);
+            if (frame != NULL && sh_job_control && sh_last_status == 128 + SIGINT) {
+                // ^C stops the loop too, not just the command it was in.
+                return 1;
+            }
+            break;
+        case SH_OP_JUMP:
+            pc = op->arg;
+            break;
+        case SH_OP_JUMP_FAILED:
+            if (sh_last_status != 0) {
+                pc = op->arg;
+            }
+            break;
+        case SH_OP_TRUE:
+            sh_last_status = 0;
+            break;
+        case SH_OP_LOOP:
+            frame->status = 0;
+            frame->mark = sh_arena_save(&sh_parse_arena);
+            break;
+        case SH_OP_WHILE:
+        case SH_OP_UNTIL:
+            if ((sh_last_status == 0) == (op->code == SH_OP_UNTIL)) {
+                sh_last_status = frame->status;
+                pc = op->arg;
+            }
+            break;
+        case SH_OP_FOR: {
+            struct sh_pipeline expanded, *words = sh_expand_pipeline(pipeline(source, op->arg), &expanded);
+
+            // Expanded once, before the first iteration.
+            frame->items = words->commands[0].argv;
+            frame->count = words->commands[0].argc;
+            frame->index = 0;
+            frame->name = words->commands[0].assigns[0];
+            frame->name_len = strlen(frame->name);
+            frame->status = 0;
+            frame->mark = sh_arena_save(&sh_parse_arena);
+            break;
+        }
+        case SH_OP_ITEM:
+            if (frame->index == frame->count) {
+                sh_last_status = frame->status;
+                pc = op->arg;
+            } else {
+                sh_var_store(frame->name, frame->name_len, frame->items[frame->index++],
+                             sh_var_flags(frame->name));
+            }
+            break;
+        case SH_OP_NEXT:
+            frame->status = sh_last_status;
+            sh_arena_release(&sh_parse_arena, frame->mark);
+            pc = op->arg;
+            break;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Get one of a parsed list's pipelines, for sh_execute_code.
+ * @param source The list.
+ * @param index Index of the pipeline.
+ * @return The pipeline.
+ */
+struct sh_pipeline *sh_list_pipeline(void *source, uint32_t index) {
+    return &((struct sh_list *) source)->pipelines[index];
+}
+
+/**
+ * @brief Execute a parsed line.
+ * @param list The line, compiled.
+ * @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int sh_execute_list(struct sh_list *list) {
+    return sh_execute_code(list->code, list->ncode, list->depth, &sh_list_pipeline, list);
+}
+
+/*
+ * Command substitution. Output is read from a pipe into one growing buffer
+ * in sh_parse_arena, and never goes through a file. A substitution that
+ * is a single builtin which only writes its output, such as $(pwd) or
+ * $(echo ...), runs in the shell with stdout pointed at the buffer and no
+ * fork at all; anything else runs in a forked subshell, so that cd, exit
+ * or assignments in it leave the shell as it was.
+ */
+#define SH_SUBST_READ_SIZE 4096
+
+// Output captured so far, allocated from sh_parse_arena.
+struct sh_capture {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+// Builtins that do nothing but write to stdout and set $?.
+int (*const sh_subst_builtins[])(char **) = {
+        &sh_echo, &sh_printf, &sh_pwd, &sh_test, &sh_true, &sh_false, &sh_help, &sh_complete,
+        &sh_shstats
+};
+
+#define SH_NUM_SUBST_BUILTINS ((int) (sizeof(sh_subst_builtins) / sizeof(sh_subst_builtins[0])))
+
+// The stream builtins' output is captured through, kept open between
+// substitutions, and where it is being captured to.
+FILE *sh_subst_stream;
+struct sh_capture *sh_subst_capture;
+
+/**
+ * @brief Make room for more output.
+ * @param capture The output.
+ * @param more Number of bytes it must have room for.
+ */
+void sh_capture_reserve(struct sh_capture *capture, size_t more) {
+    size_t size = capture->size ? capture->size : SH_SUBST_READ_SIZE;
+
+    if (capture->len + more <= capture->size) {
+        return;
+    }
+    while (size < capture->len + more) {
+        size *= 2;
+    }
+    capture->data = sh_arena_realloc(&sh_parse_arena, capture->data, capture->size, size);
+    capture->size = size;
+}
+
+/**
+ * @brief Write function of sh_subst_stream.
+ * @param cookie Not examined.
+ * @param buf What was written.
+ * @param size Its length.
+ * @return size: the write always succeeds.
+ */
+ssize_t sh_subst_write(void *cookie, const char *buf, size_t size) {
+    (void) cookie;
+    sh_capture_reserve(sh_subst_capture, size);
+    memcpy(sh_subst_capture->data + sh_subst_capture->len, buf, size);
+    sh_subst_capture->len += size;
+    return size;
+}
+
+/**
+ * @brief Run a substitution in the shell, if it is a builtin that only
+ * writes output.
+ * @param list The substitution, as parsed.
+ * @param capture Receives its output.
+ * @return 0 if it was run, -1 if it has to run in a subshell.
+ */
+int sh_subst_builtin(struct sh_list *list, struct sh_capture *capture) {
+    struct sh_pipeline *pipeline = &list->pipelines[0], expanded;
+    struct sh_command *command;
+    struct sh_builtin *builtin;
+    struct sh_var_save *vars;
+    FILE *saved = stdout;
+    int i;
+
+    // Decided before expanding, so that no nested substitution would run
+    // again in the subshell.
+    if (list->ncode != 1 || list->code[0].code != SH_OP_RUN) {
+        return -1;
+    }
+    command = &pipeline->commands[0];
+    if (pipeline->count != 1 || pipeline->background || command->argc == 0 ||
+        command->nredirects > 0 || strpbrk(command->argv[0], SH_EXPAND_BYTES SH_GLOB_CHARS) != NULL ||
+        (builtin = sh_builtin_find(command->argv[0])) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < SH_NUM_SUBST_BUILTINS && builtin->func != sh_subst_builtins[i]; i++) {
+    }
+    if (i == SH_NUM_SUBST_BUILTINS) {
+        return -1;
+    }
+    if (sh_subst_stream == NULL) {
+        cookie_io_functions_t io = {.write = &sh_subst_write};
+
+        if ((sh_subst_stream = fopencookie(NULL, "w", io)) == NULL) {
+            return -1;
+        }
+    }
+
+    command = &sh_expand_pipeline(pipeline, &expanded)->commands[0];
+    fflush(stdout);
+    sh_subst_capture = capture;
+    stdout = sh_subst_stream;
+    vars = sh_var_push(command->assigns, command->nassigns);
+    sh_execute(command->argv);
+    sh_var_pop(vars, command->nassigns);
+    fflush(sh_subst_stream);
+    stdout = saved;
+    sh_subst_capture = NULL;
+    return 0;
+}
+
+/**
+ * @brief Leave a forked child that runs shell code, such as a subshell,
+ * with no jobs of its own, and with the signals the shell ignores, but a
+ * child should not, at their defaults.
+ */
+void sh_subshell() {
+    sh_coproc_drop();
+    // Closed, not taken out of the epoll set, which the shell shares.
+    for (struct sh_job *job = sh_job_table; job != NULL; job = job->next) {
+        for (int i = 0; i < job->nprocs; i++) {
+            if (job->procs[i].pidfd != -1) {
+                close(job->procs[i].pidfd);
+            }
+        }
+        if (job->timer != NULL) {
+            close(job->timer->fd);
+        }
+    }
+    if (sh_child_epoll != -1) {
+        close(sh_child_epoll);
+        sh_child_epoll = -1;
+    }
+    sh_job_table = NULL;
+    sh_job_control = 0;
+    sh_interactive = 0;
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    if (sh_sigchld_pipe[0] != -1) {
+        // Made again by the subshell's first job; the shell's own is not
+        // for it to wake.
+        signal(SIGCHLD, SIG_DFL);
+        close(sh_sigchld_pipe[0]);
+        close(sh_sigchld_pipe[1]);
+        sh_sigchld_pipe[0] = sh_sigchld_pipe[1] = -1;
+    }
+}
+
+/**
+ * @brief Run parsed commands in a forked subshell, without waiting for it.
+ * @param list The commands.
+ * @param stdin_fd Fd the subshell reads as stdin, or -1 for the shell's.
+ * @param stdout_fd Fd the subshell writes as stdout.
+ * @return Pid of the subshell, or -1 if it could not be forked (reported).
+ */
+pid_t sh_subshell_start(struct sh_list *list, int stdin_fd, int stdout_fd) {
+    pid_t pid;
+
+    fflush(stdout);
+    fflush(stderr);
+    sh_reader_sync(&sh_stdin);
+    if ((pid = fork()) == -1) {
+        perror("sh: fork");
+    } else if (pid == 0) {
+        if ((stdin_fd != -1 && stdin_fd != STDIN_FILENO && dup2(stdin_fd, STDIN_FILENO) == -1) ||
+            (stdout_fd != STDOUT_FILENO && dup2(stdout_fd, STDOUT_FILENO) == -1)) {
+            perror("sh");
+            _exit(EXIT_FAILURE);
+        }
+        sh_subshell();
+        sh_execute_list(list);
+        fflush(stdout);
+        _exit(sh_last_status);
+    }
+    return pid;
+}
+
+/**
+ * @brief Run a substitution in a forked subshell.
+ * @param list The substitution, as parsed.
+ * @param capture Receives its output.
+ */
+void sh_subst_fork(struct sh_list *list, struct sh_capture *capture) {
+    int fds[2], status;
+    ssize_t n;
+    pid_t pid;
+
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("sh: pipe");
+        sh_last_status = 1;
+        return;
+    }
+    pid = sh_subshell_start(list, -1, fds[1]);
+    close(fds[1]);
+    if (pid == -1) {
+        close(fds[0]);
+        sh_last_status = 1;
+        return;
+    }
+
+    do {
+        sh_capture_reserve(capture, SH_SUBST_READ_SIZE);
+        n = read(fds[0], capture->data + capture->len, capture->size - capture->len);
+        if (n > 0) {
+            capture->len += n;
+        }
+    } while (n > 0 || (n == -1 && errno == EINTR));
+    close(fds[0]);
+
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            sh_last_status = 1;
+            return;
+        }
+    }
+    sh_last_status = sh_exit_status(status);
+}
+
+/**
+ * @brief Run a command substitution; its exit status becomes $?.
+ * @param text The command, as written between the parentheses.
+ * @param len Its length.
+ * @return Its output without trailing newlines or NUL bytes, allocated from
+ * sh_parse_arena.
+ */
+const char *sh_substitute(const char *text, size_t len) {
+    struct sh_capture capture = {NULL, 0, 0};
+    struct sh_list *list = sh_parse_line(sh_arena_strndup(&sh_parse_arena, text, len));
+    char *read, *write, *end;
+
+    sh_substitutions++;
+    if (list == NULL) {
+        sh_last_status = 2;
+        return "";
+    }
+    sh_last_status = 0;
+    if (list->ncode > 0 && sh_subst_builtin(list, &capture) != 0) {
+        sh_subst_fork(list, &capture);
+    }
+    if (capture.len == 0) {
+        return "";
+    }
+
+    sh_capture_reserve(&capture, 1);
+    end = capture.data + capture.len;
+    // A NUL would end the value early; like other shells, drop them.
+    if ((write = memchr(capture.data, '\0', capture.len)) != NULL) {
+        for (read = write; read < end; read++) {
+            if (*read != '\0') {
+                *write++ = *read;
+            }
+        }
+    } else {
+        write = end;
+    }
+    while (write > capture.data && write[-1] == '\n') {
+        write--;
+    }
+    *write = '\0';
+    return capture.data;
+}
+
+/**
+ * @brief Print one line of the time builtin's report.
+ * @param name What is measured.
+ * @param us Time in microseconds.
+ */
+void sh_time_print(const char *name, long long us) {
+    fprintf(stderr, "%s\t%lldm%lld.%03llds\n", name, us / 60000000, us / 1000000 % 60,
+            us / 1000 % 1000);
+}
+
+/**
+ * @brief Builtin command: run a command and report the time and resources
+ * it used, on stderr.
+ *
+ * Usage covers the children that finished in the foreground meanwhile and
+ * the shell itself, for builtins that run in it.
+ * @param args List of args. args[0] is "time". The rest is the command.
+ * @return What running the command returns.
+ */
+int sh_time(char **args) {
+    struct rusage self_before, self_after, total;
+    long long started = sh_clock_ns(), real;
+    int status;
+
+    memset(&sh_fg_usage, 0, sizeof(sh_fg_usage));
+    getrusage(RUSAGE_SELF, &self_before);
+
+    // The command sees the $? from before us.
+    sh_last_status = sh_prev_status;
+    status = sh_execute(args + 1);
+
+    real = (sh_clock_ns() - started) / 1000;
+    getrusage(RUSAGE_SELF, &self_after);
+    total = sh_fg_usage;
+    timersub(&self_after.ru_utime, &self_before.ru_utime, &self_after.ru_utime);
+    timersub(&self_after.ru_stime, &self_before.ru_stime, &self_after.ru_stime);
+    timeradd(&total.ru_utime, &self_after.ru_utime, &total.ru_utime);
+    timeradd(&total.ru_stime, &self_after.ru_stime, &total.ru_stime);
+    total.ru_nvcsw += self_after.ru_nvcsw - self_before.ru_nvcsw;
+    total.ru_nivcsw += self_after.ru_nivcsw - self_before.ru_nivcsw;
+
+    fflush(stdout);
+    fprintf(stderr, "\n");
+    sh_time_print("real", real);
+    sh_time_print("user", total.ru_utime.tv_sec * 1000000LL + total.ru_utime.tv_usec);
+    sh_time_print("sys", total.ru_stime.tv_sec * 1000000LL + total.ru_stime.tv_usec);
+    fprintf(stderr, "maxrss\t%ldk\n", total.ru_maxrss);
+    fprintf(stderr, "csw\t%ld voluntary, %ld involuntary\n", total.ru_nvcsw, total.ru_nivcsw);
+    return status;
+}
+
+/*
+ * Limits for a single command: the limit builtin sets resource limits and
+ * a cgroup, the timeout builtin a time limit. Neither starts a wrapper
+ * process. Resource limits and the cgroup are applied in the child between
+ * fork and exec, and the time limit is a timerfd among the shell's child
+ * events. Each builtin adds to sh_launch_limits for as long as its command
+ * runs, so "timeout 10 limit -v 1G cmd" puts both on the one child.
+ */
+
+// The limit builtin's options, and the resource each one sets.
+const struct sh_limit_option {
+    char option;
+    int resource;
+    int bytes; // takes a size, with an optional suffix
+} sh_limit_options[] = {
+        {'c', RLIMIT_CORE, 1},
+        {'d', RLIMIT_DATA, 1},
+        {'f', RLIMIT_FSIZE, 1},
+        {'n', RLIMIT_NOFILE, 0},
+        {'s', RLIMIT_STACK, 1},
+        {'t', RLIMIT_CPU, 0},
+        {'u', RLIMIT_NPROC, 0},
+        {'v', RLIMIT_AS, 1}
+};
+
+#define SH_NUM_LIMIT_OPTIONS ((int) (sizeof(sh_limit_options) / sizeof(sh_limit_options[0])))
+
+/**
+ * @brief Parse a limit: a number, for sizes optionally followed by K, M, G
+ * or T, or "unlimited".
+ * @param text The text.
+ * @param bytes Whether it is a size.
+ * @param value Receives the limit.
+ * @return 0 on success, -1 if the text is not a limit.
+ */
+int sh_parse_limit(const char *text, int bytes, rlim_t *value) {
+    unsigned long long number;
+    char *end;
+
+    if (strcmp(text, "unlimited") == 0) {
+        *value = RLIM_INFINITY;
+        return 0;
+    }
+    errno = 0;
+    number = strtoull(text, &end, 10);
+    if (end == text || errno != 0 || text[0] == '-') {
+        return -1;
+    }
+    if (bytes && *end != '\0' && end[1] == '\0') {
+        const char *suffix = strchr("KMGT", toupper((unsigned char) *end));
+
+        if (suffix == NULL) {
+            return -1;
+        }
+        number <<= 10 * (suffix - "KMGT" + 1);
+        end++;
+    }
+    *value = number;
+    return *end == '\0' ? 0 : -1;
+}
+
+/**
+ * @brief Parse a duration: seconds, possibly fractional, optionally
+ * followed by s, m, h or d.
+ * @param text The text.
+ * @return The duration in ns, or -1 if the text is not a duration.
+ */
+long long sh_parse_duration(const char *text) {
+    char *end;
+    double seconds = strtod(text, &end);
+
+    if (end == text || seconds < 0 || seconds > 1e9) {
+        return -1;
+    }
+    switch (*end) {
+    case 'd':
+        seconds *= 24;
+        // fall through
+    case 'h':
+        seconds *= 60;
+        // fall through
+    case 'm':
+        seconds *= 60;
+        // fall through
+    case 's':
+        end++;
+        break;
+    }
+    return *end == '\0' ? (long long) (seconds * 1e9) : -1;
+}
+
+/**
+ * @brief Parse a signal: a number, or a name with or without "SIG".
+ * @param text The text.
+ * @return The signal, or -1 if there is no such signal.
+ */
+int sh_parse_signal(const char *text) {
+    char *end;
+    long sig = strtol(text, &end, 10);
+
+    if (end != text) {
+        return *end == '\0' && sig > 0 && sig < NSIG ? sig : -1;
+    }
+    if (strncasecmp(text, "SIG", 3) == 0) {
+        text += 3;
+    }
+    for (sig = 1; sig < NSIG; sig++) {
+        const char *name = sigabbrev_np(sig);
+
+        if (name != NULL && strcasecmp(name, text) == 0) {
+            return sig;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Run the command of a limit or timeout builtin, with the limits it
+ * added to sh_launch_limits, then take them off again.
+ * @param args The command and its arguments.
+ * @param saved sh_launch_limits from before the builtin.
+ * @return What running the command returns.
+ */
+int sh_launch_limited(char **args, const struct sh_limits *saved) {
+    struct sh_builtin *builtin = sh_builtin_find(args[0]);
+    int status;
+
+    // The command sees the $? from before us.
+    sh_last_status = sh_prev_status;
+    if (builtin != NULL && (builtin->func == &sh_limit || builtin->func == &sh_timeout ||
+                            builtin->func == &sh_batched)) {
+        status = sh_execute(args);
+    } else {
+        // Anything else, builtins too, runs in a child the limits can
+        // apply to.
+        status = sh_launch(args);
+    }
+    if (sh_launch_limits.cgroup_procs != saved->cgroup_procs) {
+        close(sh_launch_limits.cgroup_procs);
+    }
+    sh_launch_limits = *saved;
+    return status;
+}
+
+/**
+ * @brief Builtin command: run a command with resource limits, set in the
+ * child between fork and exec.
+ * @param args List of args. args[0] is "limit". "-c", "-d", "-f", "-s"
+ * and "-v" limit the core file size, data segment, file size, stack and
+ * address space, in bytes with an optional K, M, G or T suffix; "-n", "-u"
+ * and "-t" limit open files, processes and CPU seconds; each value may be
+ * "unlimited". "-g cgroup" runs the command in a cgroup v2 directory,
+ * taken relative to /sys/fs/cgroup unless it is absolute. The remaining
+ * args are the command.
+ * @return What running the command returns.
+ */
+int sh_limit(char **args) {
+    struct sh_limits saved = sh_launch_limits;
+    int i;
+
+    for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i + 1] != NULL; i += 2) {
+        const struct sh_limit_option *option = NULL;
+        rlim_t value;
+        int j;
+
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(args[i], "-g") == 0) {
+            const char *dir = args[i + 1];
+            char *path = sh_arena_alloc(&sh_parse_arena, strlen(dir) + 32);
+            int fd;
+
+            sprintf(path, "%s%s/cgroup.procs", dir[0] == '/' ? "" : "/sys/fs/cgroup/", dir);
+            if ((fd = open(path, O_WRONLY | O_CLOEXEC)) == -1) {
+                fprintf(stderr, "sh: limit: %s: %s\n", path, strerror(errno));
+                sh_launch_limits = saved;
+                sh_last_status = 125;
+                return 1;
+            }
+            if (sh_launch_limits.cgroup_procs != saved.cgroup_procs) {
+                close(sh_launch_limits.cgroup_procs);
+            }
+            sh_launch_limits.cgroup_procs = fd;
+            continue;
+        }
+        for (j = 0; j < SH_NUM_LIMIT_OPTIONS && args[i][2] == '\0'; j++) {
+            if (sh_limit_options[j].option == args[i][1]) {
+                option = &sh_limit_options[j];
+                break;
+            }
+        }
+        if (option == NULL || sh_parse_limit(args[i + 1], option->bytes, &value) == -1) {
+            break;
+        }
+        // A later limit on the same resource replaces an earlier one.
+        for (j = 0; j < sh_launch_limits.nrlimits &&
+                    sh_launch_limits.rlimits[j].resource != option->resource; j++) {
+        }
+        sh_launch_limits.rlimits[j].resource = option->resource;
+        sh_launch_limits.rlimits[j].value = value;
+        if (j == sh_launch_limits.nrlimits) {
+            sh_launch_limits.nrlimits++;
+        }
+    }
+    if (args[i] == NULL || args[i][0] == '-') {
+        fprintf(stderr, "sh: limit: usage: limit [-c|-d|-f|-n|-s|-t|-u|-v limit]... [-g cgroup] "
+                        "command [args...]\n");
+        if (sh_launch_limits.cgroup_procs != saved.cgroup_procs) {
+            close(sh_launch_limits.cgroup_procs);
+        }
+        sh_launch_limits = saved;
+        sh_last_status = 125;
+        return 1;
+    }
+    return sh_launch_limited(args + i, &saved);
+}
+
+/**
+ * @brief Builtin command: run a command with a time limit, kept by the
+ * shell itself.
+ * @param args List of args. args[0] is "timeout". "-s signal" is sent when
+ * the time is up (default TERM); with "-k duration" KILL follows that much
+ * later. Then the duration, in seconds with an optional s, m, h or d
+ * suffix (0 for no limit), and the command. As GNU timeout, $? is 124 if
+ * the time ran out, and 137 if KILL had to be sent.
+ * @return What running the command returns.
+ */
+int sh_timeout(char **args) {
+    struct sh_limits saved = sh_launch_limits;
+    long long duration = -1, kill_after = 0;
+    int sig = SIGTERM, i;
+
+    for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i + 1] != NULL; i += 2) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(args[i], "-s") == 0 && (sig = sh_parse_signal(args[i + 1])) != -1) {
+            continue;
+        } else if (strcmp(args[i], "-k") != 0 || (kill_after = sh_parse_duration(args[i + 1])) == -1) {
+            break;
+        }
+    }
+    if (args[i] != NULL && args[i][0] != '-') {
+        duration = sh_parse_duration(args[i++]);
+    }
+    if (duration == -1 || sig == -1 || kill_after == -1 || args[i] == NULL) {
+        fprintf(stderr, "sh: timeout: usage: timeout [-s signal] [-k duration] duration "
+                        "command [args...]\n");
+        sh_last_status = 125;
+        return 1;
+    }
+
+    // Nested, the earliest time limit is the one kept.
+    if (duration > 0 && (sh_launch_limits.timeout == 0 || duration < sh_launch_limits.timeout)) {
+        sh_launch_limits.timeout = duration;
+        sh_launch_limits.timeout_signal = sig;
+        sh_launch_limits.kill_after = kill_after;
+    }
+    return sh_launch_limited(args + i, &saved);
+}
+
+/*
+ * Argument batches. exec fails with E2BIG once a command's arguments and
+ * the environment take more than ARG_MAX; the batched builtin runs the
+ * command as many times as it takes, as xargs does, each time with as many
+ * of the arguments as fit. The command's leading options, or as many
+ * arguments as -f says, start every batch. Batches run one after another,
+ * unless -j marks the command as safe to run several at once.
+ */
+#define SH_ARGS_HEADROOM 4096 // of ARG_MAX, left free as xargs does
+
+/**
+ * @brief Work out what a list of strings takes of ARG_MAX.
+ * @param strings The strings, NULL terminated if count is -1.
+ * @param count How many there are, or -1 for all.
+ * @return Their bytes, with terminators and pointers.
+ */
+size_t sh_args_size(char *const *strings, int count) {
+    size_t size = 0;
+
+    for (int i = 0; count == -1 ? strings[i] != NULL : i < count; i++) {
+        size += strlen(strings[i]) + 1 + sizeof(char *);
+    }
+    return size;
+}
+
+/**
+ * @brief Build the argv of one batch, in one allocation of exactly its size.
+ * @param args The command and its arguments.
+ * @param fixed How many of them start every batch.
+ * @param start First argument of the batch.
+ * @param end One past its last.
+ * @return Null terminated argv, allocated from sh_parse_arena.
+ */
+char **sh_batched_args(char **args, int fixed, int start, int end) {
+    char **argv = sh_arena_alloc(&sh_parse_arena, (fixed + end - start + 1) * sizeof(char *));
+
+    memcpy(argv, args, fixed * sizeof(char *));
+    memcpy(argv + fixed, args + start, (end - start) * sizeof(char *));
+    argv[fixed + end - start] = NULL;
+    return argv;
+}
+
+/**
+ * @brief Find where the batch starting at an argument ends.
+ * @param args The command and its arguments.
+ * @param start First argument of the batch.
+ * @param argc Number of args.
+ * @param room What the batch's arguments may take of ARG_MAX.
+ * @return One past its last argument. It has at least one, if any are
+ * left, even one that exec will refuse.
+ */
+int sh_batched_end(char **args, int start, int argc, size_t room) {
+    size_t size = 0;
+    int end;
+
+    for (end = start; end < argc; end++) {
+        size += strlen(args[end]) + 1 + sizeof(char *);
+        if (size > room && end > start) {
+            break;
+        }
+    }
+    return end;
+}
+
+/**
+ * @brief Builtin command: run a command in as many batches of its
+ * arguments as exec takes.
+ * @param args List of args. args[0] is "batched". "-f n" starts every
+ * batch with the first n arguments (default: the leading options, through
+ * "--"); "-j jobs" runs up to that many batches at once. The remaining
+ * args are the command and its arguments. $? is that of the first batch
+ * that failed, or 0.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_batched(char **args) {
+    const struct sh_limits *limits = sh_launch_limits.nrlimits > 0 || sh_launch_limits.cgroup_procs != -1
+                                     ? &sh_launch_limits : NULL;
+    long max_jobs = 1, arg_max = sysconf(_SC_ARG_MAX);
+    int fixed = -1, argc, start, i, batch = 0, running = 0, failed_batch = -1, failed = 0;
+    struct sh_job **jobs;
+    int *batches;
+    size_t room;
+
+    for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i + 1] != NULL; i += 2) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(args[i], "-j") == 0) {
+            max_jobs = atol(args[i + 1]);
+        } else if (strcmp(args[i], "-f") == 0 && isdigit((unsigned char) args[i + 1][0])) {
+            fixed = atoi(args[i + 1]);
+        } else {
+            break;
+        }
+    }
+    if (args[i] == NULL || args[i][0] == '-' || max_jobs < 1) {
+        fprintf(stderr, "sh: batched: usage: batched [-j jobs] [-f count] command [args...]\n");
+        sh_last_status = 2;
+        return 1;
+    }
+    args += i;
+    sh_last_status = sh_prev_status;
+    if (sh_builtin_find(args[0]) != NULL) {
+        // Nothing to exec, so nothing to split.
+        return sh_execute(args);
+    }
+
+    for (argc = 0; args[argc] != NULL; argc++) {
+    }
+    if (fixed == -1) {
+        for (fixed = 0; fixed + 1 < argc && args[fixed + 1][0] == '-' && args[fixed + 1][1] != '\0';) {
+            if (strcmp(args[++fixed], "--") == 0) {
+                break;
+            }
+        }
+    } else if (fixed > argc - 1) {
+        fixed = argc - 1;
+    }
+    fixed++; // and the command
+
+    // What is left of ARG_MAX for each batch's own arguments.
+    room = sh_args_size(sh_environ(), -1) + sh_args_size(args, fixed) + SH_ARGS_HEADROOM;
+    room = arg_max > 0 && (size_t) arg_max > room ? arg_max - room : 0;
+
+    sh_reader_sync(&sh_stdin);
+    fflush(stdout);
+    start = fixed;
+    if (max_jobs == 1) {
+        // One at a time, each run like any command, in the foreground.
+        do {
+            int end = sh_batched_end(args, start, argc, room);
+
+            sh_launch(sh_batched_args(args, fixed, start, end));
+            if (sh_last_status != 0 && failed_batch == -1) {
+                failed_batch = batch;
+                failed = sh_last_status;
+            }
+            batch++;
+            start = end;
+        } while (start < argc && sh_last_status != 128 + SIGINT);
+        sh_last_status = failed;
+        return 1;
+    }
+
+    jobs = sh_xcalloc(max_jobs, sizeof(*jobs));
+    batches = sh_xcalloc(max_jobs, sizeof(*batches));
+    while (1) {
+        // Left in the shell's process group, so ^C reaches them all.
+        for (int slot = 0; slot < max_jobs && (start < argc || batch == 0); slot++) {
+            struct sh_spawn_opts opts = {NULL, 0, -1, limits};
+            int end;
+
+            if (jobs[slot] != NULL) {
+                continue;
+            }
+            end = sh_batched_end(args, start, argc, room);
+            jobs[slot] = sh_job_new(1, args[0], 1);
+            jobs[slot]->notified = 1;
+            sh_job_add(jobs[slot], sh_start(sh_batched_args(args, fixed, start, end), &opts));
+            if (sh_launch_limits.timeout > 0) {
+                sh_job_timer_start(jobs[slot], sh_launch_limits.timeout, sh_launch_limits.timeout_signal,
+                                   sh_launch_limits.kill_after);
+            }
+            batches[slot] = batch++;
+            running++;
+            start = end;
+        }
+        if (running == 0) {
+            break;
+        }
+
+        sh_reap_wait();
+        for (int slot = 0; slot < max_jobs; slot++) {
+            struct sh_job *job = jobs[slot];
+            int status;
+
+            if (job == NULL || job->state != SH_JOB_DONE) {
+                continue;
+            }
+            status = sh_job_status(job);
+            if (status != 0 && (failed_batch == -1 || batches[slot] < failed_batch)) {
+                failed_batch = batches[slot];
+                failed = status;
+            }
+            if (status == 128 + SIGINT) {
+                start = argc; // start no more
+            }
+            sh_rusage_add(&sh_fg_usage, &job->usage);
+            sh_job_free(job);
+            jobs[slot] = NULL;
+            running--;
+        }
+    }
+
+    free(jobs);
+    free(batches);
+    sh_last_status = failed;
+    return 1;
+}
+
+/**
+ * @brief Write a whole buffer to an fd.
+ * @param fd The fd.
+ * @param buf The buffer.
+ * @param len Its length.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int sh_write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t count = write(fd, buf, len);
+
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += count;
+        len -= count;
+    }
+    return 0;
+}
+
+#define SH_COPY_CHUNK (1 << 30)
+
+/**
+ * @brief Copy everything from one fd to another.
+ *
+ * Between files, copy_file_range lets the kernel (or the filesystem, by
+ * sharing extents) do the copy; from a file to anything else, sendfile
+ * still avoids copying through user space. The method is picked up front
+ * from what fstat says the fds are. Input from pipes and terminals is
+ * read and written as it arrives, since both calls would wait to fill
+ * their whole count first; so is output opened with O_APPEND, as by
+ * ">>", which both calls refuse.
+ * @param in Where to copy from.
+ * @param out Where to copy to.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int sh_copy_fd(int in, int out) {
+    enum {SH_COPY_RANGE, SH_COPY_SENDFILE, SH_COPY_READ} method = SH_COPY_READ;
+    char buffer[SH_READ_BLOCK_SIZE];
+    struct stat in_st, out_st;
+
+    if (fstat(in, &in_st) == 0 && S_ISREG(in_st.st_mode) && !(fcntl(out, F_GETFL) & O_APPEND)) {
+        method = fstat(out, &out_st) == 0 && S_ISREG(out_st.st_mode) ? SH_COPY_RANGE : SH_COPY_SENDFILE;
+    }
+
+    while (1) {
+        ssize_t count;
+
+        if (method == SH_COPY_RANGE) {
+            count = copy_file_range(in, NULL, out, NULL, SH_COPY_CHUNK, 0);
+        } else if (method == SH_COPY_SENDFILE) {
+            count = sendfile(out, in, NULL, SH_COPY_CHUNK);
+        } else {
+            count = read(in, buffer, sizeof(buffer));
+            if (count > 0 && sh_write_all(out, buffer, count) == -1) {
+                return -1;
+            }
+        }
+
+        if (count == 0) {
+            return 0;
+        } else if (count == -1 && errno != EINTR) {
+            // These mean this method cannot handle these fds: try the next.
+            if (method != SH_COPY_READ &&
+                (errno == EINVAL || errno == EXDEV || errno == EBADF || errno == ENOSYS ||
+                 errno == EOPNOTSUPP || errno == ESPIPE)) {
+                method++;
+                continue;
+            }
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief Builtin command: concatenate files to stdout.
+ *
+ * Run in-process, "cat < in > out" leaves the whole copy to the kernel.
+ * Options are left to the real cat.
+ * @param args List of args. args[0] is "cat". The rest are files, where
+ * "-" (or none at all) is stdin.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_cat(char **args) {
+    char *stdin_only[] = {"-", NULL};
+    char **files = args[1] != NULL ? args + 1 : stdin_only;
+    int in = sh_stage_stdin != -1 ? sh_stage_stdin : STDIN_FILENO;
+    int out = sh_stage_stdout != NULL ? fileno(sh_stage_stdout) : STDOUT_FILENO;
+
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] == '-' && args[i][1] != '\0') {
+            // Not sh_launch(), which would find this builtin again.
+            struct sh_spawn_opts opts = {NULL, 0, sh_job_control ? 0 : -1};
+            struct sh_job *job = sh_job_new(1, args[0], 0);
+
+            sh_reader_sync(&sh_stdin);
+            fflush(stdout);
+            sh_job_add(job, sh_start(args, &opts));
+            sh_job_foreground(job);
+            return 1;
+        }
+    }
+
+    fflush(sh_output());
+    for (int i = 0; files[i] != NULL && sh_last_status != 128 + SIGPIPE; i++) {
+        int fd = in;
+
+        if (strcmp(files[i], "-") == 0) {
+            // Input we read ahead belongs to whoever reads stdin next.
+            if (sh_stage_stdin == -1) {
+                sh_reader_sync(&sh_stdin);
+            }
+        } else if ((fd = open(files[i], O_RDONLY | O_CLOEXEC)) == -1) {
+            fprintf(stderr, "sh: cat: %s: %s\n", files[i], strerror(errno));
+            sh_last_status = 1;
+            continue;
+        }
+        if (sh_copy_fd(fd, out) == -1) {
+            if (errno == EPIPE && sh_stage_stdout != NULL) {
+                // Where a process would have died of SIGPIPE.
+                sh_last_status = 128 + SIGPIPE;
+            } else {
+                fprintf(stderr, "sh: cat: %s: %s\n", files[i], strerror(errno));
+                sh_last_status = 1;
+            }
+        }
+        if (fd != in) {
+            close(fd);
+        }
+    }
+    return 1;
+}
+
+/*
+ * History. Lines read from the terminal are kept in a fixed-size ring of
+ * entries, with their text in a fixed-size circular buffer, so memory stays
+ * flat however long the session runs: the oldest entries are dropped as
+ * either fills up. Every line is also appended to $HISTFILE (by default
+ * ~/.sh_history) as soon as it is entered.
+ *
+ * $HISTFILE.idx is an append-only array of the file offset of every line
+ * in the history file. Loading maps both, copies the text of the newest
+ * entries in one piece and only scans the lines appended since the index
+ * was last brought up to date (which it then is), so startup never parses
+ * the whole file.
+ *
+ * Searches go through a trigram index, built on the first search and kept
+ * up to date from then on: each entry is listed under every trigram of its
+ * text, and only the entries listed under the query's rarest trigram are
+ * compared with it.
+ */
+#define SH_HISTORY_MAX 32768           // entries kept in memory
+#define SH_HISTORY_TEXT_SIZE (1 << 20) // bytes of entry text kept in memory
+#define SH_HISTORY_BUCKET_BITS 12      // 4096 trigram lists
+#define SH_HISTORY_BUCKETS (1 << SH_HISTORY_BUCKET_BITS)
+#define SH_HISTORY_INDEX_MAGIC "SHHIDX1"
+
+struct sh_history_entry {
+    uint32_t offset; // of its text in sh_hist.text
+    uint32_t len;
+};
+
+struct sh_history_list {
+    uint32_t *seqs; // entries with a trigram hashing here, oldest first
+    size_t count;
+    size_t size;
+};
+
+// Entries are numbered in the order they were added; entry seq lives in
+// entries[seq % SH_HISTORY_MAX].
+struct sh_history {
+    int loaded;
+    struct sh_history_entry *entries;
+    uint32_t first; // seq of the oldest entry
+    uint32_t next;  // seq of the next entry
+    char *text;
+    size_t head;    // where the text of the next entry goes
+    struct sh_history_list *lists; // NULL until the first search
+    size_t postings; // entries listed, over all lists
+    int fd;          // the history file, or -1
+} sh_hist = {0, NULL, 0, 0, NULL, 0, NULL, 0, -1};
+
+/**
+ * @brief Get the text of an entry.
+ * @param seq The entry, from first to next - 1.
+ * @return Its text, NUL-terminated.
+ */
+const char *sh_history_text(uint32_t seq) {
+    return sh_hist.text + sh_hist.entries[seq % SH_HISTORY_MAX].offset;
+}
+
+/**
+ * @brief Hash a trigram to its list.
+ * @param p The trigram's first byte.
+ * @return The list index.
+ */
+unsigned int sh_history_trigram(const char *p) {
+    uint32_t trigram = (unsigned char) p[0] << 16 | (unsigned char) p[1] << 8 | (unsigned char) p[2];
+
+    return (trigram * 2654435761u) >> (32 - SH_HISTORY_BUCKET_BITS);
+}
+
+/**
+ * @brief List an entry under each of its trigrams.
+ * @param seq The entry.
+ */
+void sh_history_index(uint32_t seq) {
+    const char *text = sh_history_text(seq);
+    uint32_t len = sh_hist.entries[seq % SH_HISTORY_MAX].len;
+
+    for (uint32_t i = 0; i + 3 <= len; i++) {
+        struct sh_history_list *list = &sh_hist.lists[sh_history_trigram(text + i)];
+
+        if (list->count > 0 && list->seqs[list->count - 1] == seq) {
+            continue;
+        }
+        list->seqs = sh_grow(list->seqs, &list->size, list->count, sizeof(*list->seqs));
+        list->seqs[list->count++] = seq;
+        sh_hist.postings++;
+    }
+}
+
+/**
+ * @brief Drop dropped entries from the trigram lists.
+ *
+ * Done whenever the lists hold twice what the kept text could need, so
+ * they stay bounded like the rest of the history.
+ */
+void sh_history_compact() {
+    sh_hist.postings = 0;
+    for (int i = 0; i < SH_HISTORY_BUCKETS; i++) {
+        struct sh_history_list *list = &sh_hist.lists[i];
+        size_t stale = 0;
+
+        while (stale < list->count && list->seqs[stale] - sh_hist.first >= sh_hist.next - sh_hist.first) {
+            stale++;
+        }
+        if (stale > 0) {
+            memmove(list->seqs, list->seqs + stale, (list->count - stale) * sizeof(*list->seqs));
+            list->count -= stale;
+        }
+        sh_hist.postings += list->count;
+    }
+}
+
+/**
+ * @brief Add an entry to the ring, dropping the oldest ones to make room.
+ * @param line Its text.
+ * @param len Length of the text, less than SH_HISTORY_TEXT_SIZE.
+ */
+void sh_history_store(const char *line, size_t len) {
+    size_t start = sh_hist.head;
+    int wrapped = start + len + 1 > SH_HISTORY_TEXT_SIZE;
+    struct sh_history_entry *entry;
+
+    if (wrapped) {
+        start = 0;
+    }
+    while (sh_hist.first != sh_hist.next) {
+        struct sh_history_entry *oldest = &sh_hist.entries[sh_hist.first % SH_HISTORY_MAX];
+
+        // Entries past the old head are the oldest; once the text wraps
+        // they go, then any the new text overwrites.
+        if (sh_hist.next - sh_hist.first < SH_HISTORY_MAX &&
+            !(wrapped && oldest->offset >= sh_hist.head) &&
+            (oldest->offset + oldest->len < start || oldest->offset > start + len)) {
+            break;
+        }
+        sh_hist.first++;
+    }
+
+    entry = &sh_hist.entries[sh_hist.next % SH_HISTORY_MAX];
+    entry->offset = start;
+    entry->len = len;
+    memcpy(sh_hist.text + start, line, len);
+    sh_hist.text[start + len] = '\0';
+    sh_hist.head = start + len + 1;
+    if (sh_hist.lists != NULL) {
+        sh_history_index(sh_hist.next);
+    }
+    sh_hist.next++;
+
+    if (sh_hist.lists != NULL && sh_hist.postings > 2 * SH_HISTORY_TEXT_SIZE) {
+        sh_history_compact();
+    }
+}
+
+/**
+ * @brief Bring the index of a history file up to date and read the offsets
+ * of its newest lines.
+ * @param index_fd The index file.
+ * @param map The history file, mapped.
+ * @param size Its size.
+ * @param count Receives the number of offsets read.
+ * @return Offsets of the last SH_HISTORY_MAX indexed lines and of any
+ * lines the index did not cover yet, malloc'ed; *count of them.
+ */
+uint64_t *sh_history_read_index(int index_fd, const char *map, size_t size, size_t *count) {
+    const size_t header = sizeof(SH_HISTORY_INDEX_MAGIC);
+    char magic[sizeof(SH_HISTORY_INDEX_MAGIC)];
+    struct stat st;
+    uint64_t *offsets = NULL, covered = 0;
+    size_t n = 0, offsets_size = 0, indexed = 0;
+
+    if (fstat(index_fd, &st) == 0 && (size_t) st.st_size > header &&
+        (st.st_size - header) % sizeof(uint64_t) == 0 &&
+        pread(index_fd, magic, header, 0) == (ssize_t) header && memcmp(magic, SH_HISTORY_INDEX_MAGIC, header) == 0) {
+        size_t total = (st.st_size - header) / sizeof(uint64_t);
+        size_t bytes;
+
+        n = total < SH_HISTORY_MAX ? total : SH_HISTORY_MAX;
+        bytes = n * sizeof(*offsets);
+        offsets_size = n + 16;
+        offsets = sh_xmalloc(offsets_size * sizeof(*offsets));
+        if (pread(index_fd, offsets, bytes, header + (total - n) * sizeof(*offsets)) != (ssize_t) bytes) {
+            n = 0;
+        }
+
+        // Offsets strictly increase within the file and each line follows
+        // a newline; any that do not mean the index is rebuilt.
+        for (size_t i = 0; i < n; i++) {
+            if (offsets[i] >= size || (i > 0 && offsets[i] <= offsets[i - 1]) ||
+                (offsets[i] > 0 && map[offsets[i] - 1] != '\n')) {
+                n = 0;
+            }
+        }
+        if (n > 0) {
+            const char *end = memchr(map + offsets[n - 1], '\n', size - offsets[n - 1]);
+
+            covered = end != NULL ? (uint64_t) (end - map + 1) : size;
+        }
+    }
+    if (n == 0) {
+        // Missing or not to be trusted: index the whole file afresh.
+        if (ftruncate(index_fd, 0) == -1 || write(index_fd, SH_HISTORY_INDEX_MAGIC, header) != (ssize_t) header) {
+            perror("sh: history");
+        }
+        covered = 0;
+    }
+
+    indexed = n;
+    for (uint64_t pos = covered; pos < size;) {
+        const char *end = memchr(map + pos, '\n', size - pos);
+
+        offsets = sh_grow(offsets, &offsets_size, n, sizeof(*offsets));
+        offsets[n++] = pos;
+        pos = end != NULL ? (uint64_t) (end - map + 1) : size;
+    }
+    if (n > indexed) {
+        size_t bytes = (n - indexed) * sizeof(*offsets);
+
+        if (write(index_fd, offsets + indexed, bytes) != (ssize_t) bytes) {
+            perror("sh: history");
+        }
+    }
+    *count = n;
+    return offsets;
+}
+
+/**
+ * @brief Open the history file and load its newest entries.
+ */
+void sh_history_load() {
+    const char *file = sh_var_get("HISTFILE"), *home = sh_var_get("HOME");
+    char *path, *index_path;
+    struct stat st;
+    int index_fd;
+
+    sh_hist.loaded = 1;
+    sh_hist.entries = sh_xmalloc(SH_HISTORY_MAX * sizeof(*sh_hist.entries));
+    sh_hist.text = sh_xmalloc(SH_HISTORY_TEXT_SIZE);
+
+    if (file == NULL && home != NULL) {
+        path = sh_xmalloc(strlen(home) + 16);
+        sprintf(path, "%s/.sh_history", home);
+    } else if (file != NULL && *file != '\0') {
+        path = sh_xstrdup(file);
+    } else {
+        return; // history is not saved
+    }
+    index_path = sh_xmalloc(strlen(path) + 5);
+    sprintf(index_path, "%s.idx", path);
+
+    sh_hist.fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    index_fd = open(index_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (sh_hist.fd == -1 || index_fd == -1) {
+        fprintf(stderr, "sh: %s: %s\n", sh_hist.fd == -1 ? path : index_path, strerror(errno));
+    } else if (fstat(sh_hist.fd, &st) == 0 && st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, sh_hist.fd, 0);
+        size_t count, first;
+        uint64_t *offsets;
+
+        if (map != MAP_FAILED) {
+            offsets = sh_history_read_index(index_fd, map, st.st_size, &count);
+
+            // The newest entries whose text fits, copied in one piece.
+            first = count;
+            while (first > 0 && count - first < SH_HISTORY_MAX &&
+                   st.st_size - offsets[first - 1] < SH_HISTORY_TEXT_SIZE) {
+                first--;
+            }
+            if (first < count) {
+                size_t base = offsets[first];
+
+                memcpy(sh_hist.text, map + base, st.st_size - base);
+                sh_hist.head = st.st_size - base + 1;
+                for (size_t i = first; i < count; i++) {
+                    size_t end = i + 1 < count ? offsets[i + 1] - 1 : (size_t) st.st_size;
+                    struct sh_history_entry *entry = &sh_hist.entries[sh_hist.next % SH_HISTORY_MAX];
+
+                    if (i + 1 == count && map[end - 1] == '\n') {
+                        end--;
+                    }
+                    entry->offset = offsets[i] - base;
+                    entry->len = end - offsets[i];
+                    sh_hist.text[entry->offset + entry->len] = '\0';
+                    sh_hist.next++;
+                }
+            }
+            free(offsets);
+            munmap(map, st.st_size);
+        }
+    }
+    if (index_fd != -1) {
+        close(index_fd);
+    }
+    free(path);
+    free(index_path);
+}
+
+/**
+ * @brief Remember a line read from the terminal.
+ *
+ * Blank lines and repeats of the previous line are not remembered.
+ * @param line The line.
+ */
+void sh_history_add(const char *line) {
+    size_t len = strlen(line);
+    struct iovec iov[2] = {{(void *) line, len}, {"\n", 1}};
+
+    if (!sh_hist.loaded) {
+        sh_history_load();
+    }
+    if (line[strspn(line, " \t")] == '\0' || len >= SH_HISTORY_TEXT_SIZE / 4 ||
+        (sh_hist.next != sh_hist.first && strcmp(sh_history_text(sh_hist.next - 1), line) == 0)) {
+        return;
+    }
+    sh_history_store(line, len);
+
+    // One write, so lines from shells sharing the file never interleave.
+    if (sh_hist.fd != -1 && writev(sh_hist.fd, iov, 2) == -1) {
+        perror("sh: history");
+        close(sh_hist.fd);
+        sh_hist.fd = -1;
+    }
+}
+
+/**
+ * @brief Find the newest entry containing some text.
+ * @param query The text.
+ * @param before Only entries older than this one are searched.
+ * @return The entry, or -1 if there is none.
+ */
+long sh_history_search(const char *query, uint32_t before) {
+    size_t len = strlen(query);
+    struct sh_history_list *best = NULL;
+
+    if (!sh_hist.loaded) {
+        sh_history_load();
+    }
+    if (before - sh_hist.first > sh_hist.next - sh_hist.first) {
+        before = sh_hist.next;
+    }
+
+    if (len < 3) {
+        // Too short to have a trigram: look at every entry.
+        for (uint32_t seq = before; seq != sh_hist.first; seq--) {
+            if (strstr(sh_history_text(seq - 1), query) != NULL) {
+                return seq - 1;
+            }
+        }
+        return -1;
+    }
+
+    if (sh_hist.lists == NULL) {
+        sh_hist.lists = sh_xcalloc(SH_HISTORY_BUCKETS, sizeof(*sh_hist.lists));
+        for (uint32_t seq = sh_hist.first; seq != sh_hist.next; seq++) {
+            sh_history_index(seq);
+        }
+    }
+    for (size_t i = 0; i + 3 <= len; i++) {
+        struct sh_history_list *list = &sh_hist.lists[sh_history_trigram(query + i)];
+
+        if (best == NULL || list->count < best->count) {
+            best = list;
+        }
+    }
+
+    for (size_t i = best->count; i > 0; i--) {
+        uint32_t seq = best->seqs[i - 1];
+
+        if (seq - sh_hist.first >= before - sh_hist.first) {
+            // Newer than before, or dropped from the ring already.
+            if (seq - sh_hist.first >= sh_hist.next - sh_hist.first) {
+                break;
+            }
+            continue;
+        }
+        if (strstr(sh_history_text(seq), query) != NULL) {
+            return seq;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Builtin command: list or search the history.
+ *
+ * "history" lists every entry, "history N" the last N, "history -g text"
+ * the entries containing text, newest first; "history -c" forgets them.
+ * @param args List of args.  args[0] is "history".
+ * @return Always returns 1, to continue executing.
+ */
+int sh_history(char **args) {
+    uint32_t count, seq;
+
+    if (!sh_hist.loaded) {
+        sh_history_load();
+    }
+    count = sh_hist.next - sh_hist.first;
+
+    if (args[1] != NULL && strcmp(args[1], "-c") == 0) {
+        sh_hist.first = sh_hist.next;
+        sh_hist.head = 0;
+        if (sh_hist.lists != NULL) {
+            sh_history_compact();
+        }
+        return 1;
+    }
+    if (args[1] != NULL && strcmp(args[1], "-g") == 0) {
+        long found;
+
+        if (args[2] == NULL) {
+            fprintf(stderr, "sh: history: -g: option requires an argument\n");
+            sh_last_status = 2;
+            return 1;
+        }
+        sh_last_status = 1;
+        for (seq = sh_hist.next; (found = sh_history_search(args[2], seq)) != -1; seq = found) {
+            printf("%5lu  %s\n", (unsigned long) found + 1, sh_history_text(found));
+            sh_last_status = 0;
+        }
+        return 1;
+    }
+    if (args[1] != NULL) {
+        char *end;
+        unsigned long n = strtoul(args[1], &end, 10);
+
+        if (*end != '\0' || end == args[1]) {
+            fprintf(stderr, "sh: history: %s: numeric argument required\n", args[1]);
+            sh_last_status = 2;
+            return 1;
+        }
+        if (n < count) {
+            count = n;
+        }
+    }
+    for (seq = sh_hist.next - count; seq != sh_hist.next; seq++) {
+        printf("%5lu  %s\n", (unsigned long) seq + 1, sh_history_text(seq));
+    }
+    return 1;
+}
+
+/*
+ * Line editor. When the shell is interactive on a terminal, sh_read_line
+ * puts the terminal in raw mode and edits the line itself rather than
+ * leaving it to the terminal driver. The keys that arrive in one read are
+ * all applied before anything is drawn, and drawing compares the new row
+ * with what is already on the screen: the cursor moves to the first cell
+ * that differs, and from there it either rewrites the rest of the row or
+ * inserts or deletes characters in place, whichever takes fewer bytes.
+ * The whole update is a single write. A line wider than the terminal
+ * scrolls sideways, so it never wraps onto a second row.
+ */
+#define SH_PROMPT "> "
+#define SH_PROMPT_MORE "> " // for the next line of a compound command
+#define SH_EDIT_KEYS_MAX 64 // the longest escape sequence taken as one key
+#define SH_EDIT_ESC_WAIT_MS 30 // how long ESC waits for the rest of a sequence
+#define SH_EDIT_QUERY_MAX 256
+
+// Keys that arrive as escape sequences, numbered above the byte values.
+enum sh_key {
+    SH_KEY_UP = 256,
+    SH_KEY_DOWN,
+    SH_KEY_RIGHT,
+    SH_KEY_LEFT,
+    SH_KEY_HOME,
+    SH_KEY_END,
+    SH_KEY_DELETE,
+    SH_KEY_WORD_LEFT,
+    SH_KEY_WORD_RIGHT,
+    SH_KEY_KILL_WORD,
+    SH_KEY_ESCAPE,
+    SH_KEY_UNKNOWN
+};
+
+enum sh_edit_result {
+    SH_EDIT_MORE,   // keep editing
+    SH_EDIT_DONE,   // the line was entered
+    SH_EDIT_CANCEL, // ^C: drop the line
+    SH_EDIT_EOF     // ^D on an empty line
+};
+
+// A growable byte string.
+struct sh_edit_text {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+struct sh_editor {
+    int checked;             // whether enabled has been decided yet
+    int enabled;
+    struct termios cooked;   // the terminal modes to go back to
+    char keys[SH_EDIT_KEYS_MAX]; // the key being read from the terminal
+    size_t keys_start;
+    size_t keys_end;
+    struct sh_edit_text line; // the line being edited, NUL terminated
+    size_t cursor;            // byte offset into line
+    size_t offset;            // first byte of line on the screen
+    struct sh_edit_text kill; // the text ^K, ^U or ^W last removed
+    struct sh_edit_text draft; // the new line, while history is shown
+    uint32_t hist_seq;        // the history entry shown; sh_hist.next for none
+    int searching;            // in ^R search
+    char query[SH_EDIT_QUERY_MAX];
+    size_t query_len;
+    long match;               // entry the search last found, or -1
+    int search_failed;        // nothing has the query as it is now
+    struct sh_edit_text saved; // the line as it was before the search
+    int last_key;
+    const char *prompt;
+    struct sh_edit_text row;   // what is on the screen: prompt and line
+    size_t row_cursor;         // the cursor's column in row
+    struct sh_edit_text out;   // output not yet written
+} sh_editor = {.match = -1};
+
+/**
+ * @brief Append bytes to a string.
+ * @param text The string.
+ * @param bytes What to append.
+ * @param len How many bytes.
+ */
+void sh_edit_append(struct sh_edit_text *text, const char *bytes, size_t len) {
+    if (text->len + len + 1 > text->size) {
+        text->size = text->size ? text->size : 128;
+        while (text->len + len + 1 > text->size) {
+            text->size *= 2;
+        }
+        text->data = sh_xrealloc(text->data, text->size);
+    }
+    memcpy(text->data + text->len, bytes, len);
+    text->len += len;
+    text->data[text->len] = '\0';
+}
+
+/**
+ * @brief Replace the contents of a string.
+ */
+void sh_edit_assign(struct sh_edit_text *text, const char *bytes, size_t len) {
+    text->len = 0;
+    sh_edit_append(text, bytes, len);
+}
+
+/**
+ * @brief Count the columns some UTF-8 text takes, one per character.
+ * @param bytes The text.
+ * @param len Its length in bytes.
+ * @return The number of characters.
+ */
+size_t sh_edit_width(const char *bytes, size_t len) {
+    size_t width = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        width += ((unsigned char) bytes[i] & 0xc0) != 0x80;
+    }
+    return width;
+}
+
+/**
+ * @brief Whether a byte continues a UTF-8 character rather than starting one.
+ */
+int sh_edit_continues(char c) {
+    return ((unsigned char) c & 0xc0) == 0x80;
+}
+
+/**
+ * @brief Queue a cursor movement along the row.
+ * @param from The current column.
+ * @param to The column to go to.
+ */
+void sh_edit_move(struct sh_editor *editor, size_t from, size_t to) {
+    char seq[32];
+    int len;
+
+    if (to < from && from - to <= 3) {
+        sh_edit_append(&editor->out, "\b\b\b", from - to);
+        return;
+    }
+    if (to == from) {
+        return;
+    }
+    len = snprintf(seq, sizeof(seq), "\033[%zu%c", to < from ? from - to : to - from,
+                   to < from ? 'D' : 'C');
+    sh_edit_append(&editor->out, seq, len);
+}
+
+/**
+ * @brief Queue what turns the row on the screen into a new one.
+ * @param row The new row.
+ * @param len Its length in bytes.
+ * @param cursor The column the cursor should end up in.
+ */
+void sh_edit_draw(struct sh_editor *editor, const char *row, size_t len, size_t cursor) {
+    const char *old = editor->row.data != NULL ? editor->row.data : "";
+    size_t old_len = editor->row.len, prefix = 0, suffix = 0, column;
+    size_t old_tail, new_tail, rewrite, in_place = (size_t) -1, inserted = 0;
+    char seq[32];
+    int seq_len = 0;
+
+    // The first and last bytes the rows share, on character boundaries.
+    while (prefix < old_len && prefix < len && old[prefix] == row[prefix]) {
+        prefix++;
+    }
+    while (prefix > 0 && ((prefix < len && sh_edit_continues(row[prefix])) ||
+                          (prefix < old_len && sh_edit_continues(old[prefix])))) {
+        prefix--;
+    }
+    while (suffix < old_len - prefix && suffix < len - prefix &&
+           old[old_len - 1 - suffix] == row[len - 1 - suffix]) {
+        suffix++;
+    }
+    while (suffix > 0 && (sh_edit_continues(row[len - suffix]) ||
+                          sh_edit_continues(old[old_len - suffix]))) {
+        suffix--;
+    }
+
+    if (prefix == len && len == old_len) {
+        sh_edit_move(editor, editor->row_cursor, cursor);
+        editor->row_cursor = cursor;
+        return;
+    }
+
+    column = sh_edit_width(row, prefix);
+    old_tail = sh_edit_width(old + prefix, old_len - prefix);
+    new_tail = sh_edit_width(row + prefix, len - prefix);
+
+    // Rewriting from the first difference, and clearing what is left over.
+    rewrite = len - prefix + (old_tail > new_tail ? 3 : 0);
+    if (prefix + suffix == old_len && len > old_len) {
+        // Only an insertion: open a gap and fill it.
+        inserted = len - old_len;
+        seq_len = snprintf(seq, sizeof(seq), "\033[%zu@", new_tail - old_tail);
+        in_place = seq_len + inserted;
+    } else if (prefix + suffix == len && old_len > len) {
+        // Only a deletion: close the gap.
+        seq_len = snprintf(seq, sizeof(seq), "\033[%zuP", old_tail - new_tail);
+        in_place = seq_len;
+    } else if (old_tail == new_tail) {
+        // As many cells as before: write over the ones that changed.
+        inserted = len - prefix - suffix;
+        in_place = inserted;
+    }
+
+    sh_edit_move(editor, editor->row_cursor, column);
+    if (in_place < rewrite) {
+        sh_edit_append(&editor->out, seq, seq_len);
+        sh_edit_append(&editor->out, row + prefix, inserted);
+        column += sh_edit_width(row + prefix, inserted);
+    } else {
+        sh_edit_append(&editor->out, row + prefix, len - prefix);
+        if (old_tail > new_tail) {
+            sh_edit_append(&editor->out, "\033[K", 3);
+        }
+        column += new_tail;
+    }
+    sh_edit_move(editor, column, cursor);
+
+    sh_edit_assign(&editor->row, row, len);
+    editor->row_cursor = cursor;
+}
+
+/**
+ * @brief Write out everything queued, in one write when the terminal takes
+ * it all.
+ */
+void sh_edit_flush(struct sh_editor *editor) {
+    size_t done = 0;
+
+    while (done < editor->out.len) {
+        ssize_t n = write(STDOUT_FILENO, editor->out.data + done, editor->out.len - done);
+
+        if (n == -1 && errno != EINTR) {
+            break;
+        }
+        done += n > 0 ? n : 0;
+    }
+    editor->out.len = 0;
+}
+
+/**
+ * @brief Queue the redraw of the prompt and the line around the cursor.
+ */
+void sh_edit_refresh(struct sh_editor *editor) {
+    char search_prompt[SH_EDIT_QUERY_MAX + 32];
+    const char *prompt = editor->prompt, *line = editor->line.data;
+    size_t prompt_len, prompt_width, width, end, cols = 80;
+    struct winsize ws;
+    char *row;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        cols = ws.ws_col;
+    }
+    if (editor->searching) {
+        snprintf(search_prompt, sizeof(search_prompt), "(%sreverse-i-search)`%.*s': ",
+                 editor->search_failed ? "failed " : "",
+                 (int) editor->query_len, editor->query);
+        prompt = search_prompt;
+    }
+
+    // A long prompt loses its start, so some of the line always shows.
+    prompt_len = strlen(prompt);
+    while (sh_edit_width(prompt, prompt_len) > cols / 2) {
+        do {
+            prompt++, prompt_len--;
+        } while (prompt_len > 0 && sh_edit_continues(*prompt));
+    }
+    prompt_width = sh_edit_width(prompt, prompt_len);
+    // The last column is left free, so the cursor never wraps. Without a
+    // column to spare for the line, it is not scrolled at all.
+    width = cols - 1 > prompt_width ? cols - 1 - prompt_width : 0;
+
+    // Scroll just enough to keep the cursor in view.
+    if (width == 0 || sh_edit_width(line, editor->cursor) < width) {
+        editor->offset = 0;
+    }
+    if (editor->offset > editor->cursor) {
+        editor->offset = editor->cursor;
+    }
+    while (width > 0 && editor->offset < editor->cursor &&
+           sh_edit_width(line + editor->offset, editor->cursor - editor->offset) >= width) {
+        do {
+            editor->offset++;
+        } while (editor->offset < editor->cursor && sh_edit_continues(line[editor->offset]));
+    }
+    width = width > 0 ? width : 1;
+    for (end = editor->offset; end < editor->line.len && width > 0; width--) {
+        do {
+            end++;
+        } while (end < editor->line.len && sh_edit_continues(line[end]));
+    }
+
+    row = sh_xmalloc(prompt_len + end - editor->offset + 1);
+    memcpy(row, prompt, prompt_len);
+    memcpy(row + prompt_len, line + editor->offset, end - editor->offset);
+    sh_edit_draw(editor, row, prompt_len + end - editor->offset,
+                 prompt_width + sh_edit_width(line + editor->offset,
+                                              editor->cursor - editor->offset));
+    free(row);
+}
+
+/**
+ * @brief Take the next key from what has been read from the terminal.
+ * @param key Set to the byte, or to an sh_key for an escape sequence.
+ * @return 1 if a key was taken, 0 if more input is needed first.
+ */
+int sh_edit_next_key(struct sh_editor *editor, int *key) {
+    const unsigned char *keys = (const unsigned char *) editor->keys + editor->keys_start;
+    size_t avail = editor->keys_end - editor->keys_start, used = 2;
+
+    if (avail == 0) {
+        return 0;
+    }
+    if (keys[0] != '\033') {
+        *key = keys[0];
+        editor->keys_start++;
+        return 1;
+    }
+    if (avail == 1) {
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+
+        // A lone ESC, unless the rest of a sequence is on its way.
+        if (poll(&pfd, 1, SH_EDIT_ESC_WAIT_MS) > 0) {
+            return 0;
+        }
+        *key = SH_KEY_ESCAPE;
+        editor->keys_start++;
+        return 1;
+    }
+
+    switch (keys[1]) {
+    case '[':
+    case 'O': {
+        // CSI or SS3: parameter bytes, then one final byte.
+        size_t end = 2;
+        int param = 0, modifier = 0;
+
+        while (end < avail && keys[end] >= 0x30 && keys[end] <= 0x3f) {
+            if (keys[end] == ';') {
+                modifier = param, param = 0;
+            } else if (keys[end] >= '0' && keys[end] <= '9') {
+                param = param * 10 + keys[end] - '0';
+            }
+            end++;
+        }
+        while (end < avail && keys[end] >= 0x20 && keys[end] <= 0x2f) {
+            end++;
+        }
+        if (end == avail) {
+            return 0;
+        }
+        used = end + 1;
+        // "1;5C" is the modifier "5", control, applied to C.
+        if (modifier != 0) {
+            int control = param == 5;
+
+            param = modifier;
+            if (control && (keys[end] == 'C' || keys[end] == 'D')) {
+                *key = keys[end] == 'C' ? SH_KEY_WORD_RIGHT : SH_KEY_WORD_LEFT;
+                break;
+            }
+        }
+        switch (keys[end]) {
+        case 'A':
+            *key = SH_KEY_UP;
+            break;
+        case 'B':
+            *key = SH_KEY_DOWN;
+            break;
+        case 'C':
+            *key = SH_KEY_RIGHT;
+            break;
+        case 'D':
+            *key = SH_KEY_LEFT;
+            break;
+        case 'H':
+            *key = SH_KEY_HOME;
+            break;
+        case 'F':
+            *key = SH_KEY_END;
+            break;
+        case '~':
+            *key = param == 1 || param == 7 ? SH_KEY_HOME
+                   : param == 4 || param == 8 ? SH_KEY_END
+                   : param == 3 ? SH_KEY_DELETE : SH_KEY_UNKNOWN;
+            break;
+        default:
+            *key = SH_KEY_UNKNOWN;
+        }
+        break;
+    }
+    case 'b':
+        *key = SH_KEY_WORD_LEFT;
+        break;
+    case 'f':
+        *key = SH_KEY_WORD_RIGHT;
+        break;
+    case 0x7f:
+    case '\b':
+        *key = SH_KEY_KILL_WORD;
+        break;
+    default:
+        // ESC and some other key: the ESC on its own.
+        *key = SH_KEY_ESCAPE;
+        used = 1;
+    }
+    editor->keys_start += used;
+    return 1;
+}
+
+/**
+ * @brief Insert text at the cursor and move past it.
+ */
+void sh_edit_insert(struct sh_editor *editor, const char *bytes, size_t len) {
+    struct sh_edit_text *line = &editor->line;
+
+    sh_edit_append(line, bytes, len);
+    memmove(line->data + editor->cursor + len, line->data + editor->cursor,
+            line->len - len - editor->cursor);
+    memcpy(line->data + editor->cursor, bytes, len);
+    editor->cursor += len;
+}
+
+/**
+ * @brief Remove part of the line.
+ * @param from Its first byte.
+ * @param to The byte after its last.
+ * @param kill Whether to keep it for ^Y.
+ */
+void sh_edit_remove(struct sh_editor *editor, size_t from, size_t to, int kill) {
+    struct sh_edit_text *line = &editor->line;
+
+    if (from >= to) {
+        return;
+    }
+    if (kill) {
+        sh_edit_assign(&editor->kill, line->data + from, to - from);
+    }
+    memmove(line->data + from, line->data + to, line->len - to + 1);
+    line->len -= to - from;
+    if (editor->cursor >= to) {
+        editor->cursor -= to - from;
+    } else if (editor->cursor > from) {
+        editor->cursor = from;
+    }
+}
+
+/**
+ * @brief Find the start of the character before a position.
+ */
+size_t sh_edit_prev_char(struct sh_editor *editor, size_t pos) {
+    while (pos > 0 && sh_edit_continues(editor->line.data[--pos])) {
+    }
+    return pos;
+}
+
+/**
+ * @brief Find the start of the character after a position.
+ */
+size_t sh_edit_next_char(struct sh_editor *editor, size_t pos) {
+    if (pos < editor->line.len) {
+        while (++pos < editor->line.len && sh_edit_continues(editor->line.data[pos])) {
+        }
+    }
+    return pos;
+}
+
+/**
+ * @brief Find the start of the word before a position.
+ */
+size_t sh_edit_prev_word(struct sh_editor *editor, size_t pos) {
+    const char *line = editor->line.data;
+
+    while (pos > 0 && line[pos - 1] == ' ') {
+        pos--;
+    }
+    while (pos > 0 && line[pos - 1] != ' ') {
+        pos--;
+    }
+    return pos;
+}
+
+/**
+ * @brief Find the end of the word after a position.
+ */
+size_t sh_edit_next_word(struct sh_editor *editor, size_t pos) {
+    const char *line = editor->line.data;
+
+    while (pos < editor->line.len && line[pos] == ' ') {
+        pos++;
+    }
+    while (pos < editor->line.len && line[pos] != ' ') {
+        pos++;
+    }
+    return pos;
+}
+
+/**
+ * @brief Replace the line, with the cursor at its end.
+ */
+void sh_edit_set_line(struct sh_editor *editor, const char *text) {
+    sh_edit_assign(&editor->line, text, strlen(text));
+    editor->cursor = editor->line.len;
+}
+
+/**
+ * @brief Step through the history.
+ * @param older 1 for the entry before the one shown, 0 for the one after.
+ */
+void sh_edit_history(struct sh_editor *editor, int older) {
+    if (!sh_hist.loaded) {
+        sh_history_load();
+        editor->hist_seq = sh_hist.next;
+    }
+    if (older && editor->hist_seq != sh_hist.first) {
+        if (editor->hist_seq == sh_hist.next) {
+            sh_edit_assign(&editor->draft, editor->line.data, editor->line.len);
+        }
+        sh_edit_set_line(editor, sh_history_text(--editor->hist_seq));
+    } else if (!older && editor->hist_seq != sh_hist.next) {
+        if (++editor->hist_seq == sh_hist.next) {
+            sh_edit_set_line(editor, editor->draft.data != NULL ? editor->draft.data : "");
+        } else {
+            sh_edit_set_line(editor, sh_history_text(editor->hist_seq));
+        }
+    }
+}
+
+/**
+ * @brief Search the history for the query, from an entry back, and show
+ * what it finds. When nothing is found the last match stays shown.
+ * @param before Only entries older than this one are searched.
+ */
+void sh_edit_search(struct sh_editor *editor, uint32_t before) {
+    long found;
+
+    editor->query[editor->query_len] = '\0';
+    found = editor->query_len > 0 ? sh_history_search(editor->query, before) : -1;
+    editor->search_failed = found == -1 && editor->query_len > 0;
+    if (found != -1) {
+        const char *text = sh_history_text(found);
+
+        editor->match = found;
+        sh_edit_set_line(editor, text);
+        editor->cursor = strstr(text, editor->query) - text;
+    }
+}
+
+/**
+ * @brief Start a ^R search.
+ */
+void sh_edit_search_start(struct sh_editor *editor) {
+    if (!sh_hist.loaded) {
+        sh_history_load();
+        editor->hist_seq = sh_hist.next;
+    }
+    sh_edit_assign(&editor->saved, editor->line.data, editor->line.len);
+    editor->searching = 1;
+    editor->search_failed = 0;
+    editor->query_len = 0;
+    editor->match = -1;
+}
+
+/**
+ * @brief Handle a key during ^R search.
+ * @param key The key.
+ * @return 1 if the key was used up, 0 if it ends the search, keeping the
+ * match, and should be handled as usual.
+ */
+int sh_edit_search_key(struct sh_editor *editor, int key) {
+    if (key == 18) { // ^R: the next older match
+        sh_edit_search(editor, editor->match != -1 ? (uint32_t) editor->match : sh_hist.next);
+        return 1;
+    }
+    if (key == 0x7f || key == '\b') {
+        if (editor->query_len > 0) {
+            editor->query_len--;
+            editor->match = -1;
+            sh_edit_search(editor, sh_hist.next);
+        }
+        return 1;
+    }
+    if (key == 7 || key == SH_KEY_ESCAPE) { // ^G or ESC: back to the line as it was
+        editor->searching = 0;
+        sh_edit_set_line(editor, editor->saved.data);
+        return 1;
+    }
+    if (key >= ' ' && key < 256 && key != 0x7f) {
+        if (editor->query_len + 1 < SH_EDIT_QUERY_MAX) {
+            editor->query[editor->query_len++] = key;
+            // The current match is still a match if it has the longer query.
+            sh_edit_search(editor, editor->match != -1 ? (uint32_t) editor->match + 1
+                                                       : sh_hist.next);
+        }
+        return 1;
+    }
+
+    editor->searching = 0;
+    if (editor->match != -1) {
+        if (editor->hist_seq == sh_hist.next) {
+            sh_edit_assign(&editor->draft, editor->saved.data, editor->saved.len);
+        }
+        editor->hist_seq = editor->match;
+    }
+    return 0;
+}
+
+/**
+ * @brief Compare two strings through pointers to them, for qsort.
+ */
+int sh_edit_compare(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/**
+ * @brief Complete the word before the cursor: a command name in command
+ * position, otherwise a file name. One match is inserted whole; several
+ * insert what they have in common, and a second Tab lists them.
+ */
+void sh_edit_complete(struct sh_editor *editor) {
+    const char *line = editor->line.data;
+    size_t start = editor->cursor, word_len = 0, base_len, common, count = 0, size = 0;
+    char *word, *base, **names = NULL;
+    int command = 1, files = 0, single;
+
+    // The word runs back to an unescaped blank or operator.
+    while (start > 0) {
+        int class = sh_char_class[(unsigned char) line[start - 1]];
+
+        if ((class == SH_CHAR_BLANK || class == SH_CHAR_OPERATOR) &&
+            (start < 2 || line[start - 2] != '\\')) {
+            break;
+        }
+        start--;
+    }
+    for (size_t i = start; i-- > 0 && command;) {
+        int class = sh_char_class[(unsigned char) line[i]];
+
+        if (class == SH_CHAR_OPERATOR) {
+            break;
+        }
+        command = class == SH_CHAR_BLANK;
+    }
+
+    // Match against the word as the lexer will see it.
+    word = sh_xmalloc(editor->cursor - start + 1);
+    for (size_t i = start; i < editor->cursor; i++) {
+        if (line[i] == '\\' && i + 1 < editor->cursor) {
+            i++;
+        } else if (line[i] == '\'' || line[i] == '"') {
+            continue;
+        }
+        word[word_len++] = line[i];
+    }
+    word[word_len] = '\0';
+
+    if (command && strchr(word, '/') == NULL) {
+        struct sh_complete_entry *matches = sh_complete_find(word, word_len, &count);
+
+        base = word;
+        names = sh_xmalloc((count + 1) * sizeof(*names));
+        for (size_t i = 0; i < count; i++) {
+            names[i] = matches[i].name;
+        }
+    } else {
+        char *slash = strrchr(word, '/');
+        const char *dir = slash == NULL ? "." : slash == word ? "/" : word;
+        DIR *stream;
+        struct dirent *entry;
+
+        base = slash != NULL ? slash + 1 : word;
+        if (slash != NULL && slash != word) {
+            *slash = '\0';
+        }
+        stream = opendir(dir);
+        while (stream != NULL && (entry = readdir(stream)) != NULL) {
+            const char *name = entry->d_name;
+            struct stat st;
+            int is_dir = entry->d_type == DT_DIR;
+
+            if (strncmp(name, base, strlen(base)) != 0 ||
+                (name[0] == '.' && base[0] != '.') ||
+                strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+            if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+                is_dir = fstatat(dirfd(stream), name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+            }
+            // One allocation per name: the directory flag goes after its NUL.
+            names = sh_grow(names, &size, count, sizeof(*names));
+            names[count] = sh_xmalloc(strlen(name) + 2);
+            strcpy(names[count], name);
+            names[count][strlen(name) + 1] = is_dir;
+            count++;
+        }
+        if (stream != NULL) {
+            closedir(stream);
+        }
+        files = 1;
+        if (count > 1) {
+            qsort(names, count, sizeof(*names), sh_edit_compare);
+        }
+    }
+
+    base_len = strlen(base);
+    single = count == 1;
+    common = count > 0 ? strlen(names[0]) : 0;
+    for (size_t i = 1; i < count; i++) {
+        size_t same = 0;
+
+        while (same < common && names[i][same] == names[0][same]) {
+            same++;
+        }
+        common = same;
+    }
+    while (common > base_len && sh_edit_continues(names[0][common])) {
+        common--;
+    }
+
+    if (count == 0) {
+        sh_edit_append(&editor->out, "\a", 1);
+    } else if (common > base_len || single) {
+        for (size_t i = base_len; i < common; i++) {
+            unsigned char c = names[0][i];
+
+            if (sh_char_class[c] != SH_CHAR_WORD || strchr("*?[#~", c) != NULL) {
+                sh_edit_insert(editor, "\\", 1);
+            }
+            sh_edit_insert(editor, (const char *) &c, 1);
+        }
+        if (single) {
+            int is_dir = files && names[0][strlen(names[0]) + 1];
+
+            sh_edit_insert(editor, is_dir ? "/" : " ", 1);
+        }
+    } else if (editor->last_key == '\t') {
+        // Second Tab: list the matches in columns under the line.
+        size_t width = 0, cols = 80, per_row;
+        struct winsize ws;
+
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+            cols = ws.ws_col;
+        }
+        for (size_t i = 0; i < count; i++) {
+            size_t w = sh_edit_width(names[i], strlen(names[i]));
+            width = w > width ? w : width;
+        }
+        width += 2;
+        per_row = cols / width > 0 ? cols / width : 1;
+        sh_edit_move(editor, editor->row_cursor, sh_edit_width(editor->row.data, editor->row.len));
+        sh_edit_append(&editor->out, "\r\n", 2);
+        for (size_t i = 0; i < count; i++) {
+            size_t w = sh_edit_width(names[i], strlen(names[i]));
+
+            sh_edit_append(&editor->out, names[i], strlen(names[i]));
+            if (i % per_row == per_row - 1 || i == count - 1) {
+                sh_edit_append(&editor->out, "\r\n", 2);
+            } else {
+                for (; w < width; w++) {
+                    sh_edit_append(&editor->out, " ", 1);
+                }
+            }
+        }
+        // The prompt is drawn again below the list.
+        editor->row.len = 0;
+        editor->row_cursor = 0;
+    }
+
+    if (files) {
+        for (size_t i = 0; i < count; i++) {
+            free(names[i]);
+        }
+    }
+    free(names);
+    free(word);
+}
+
+/**
+ * @brief Apply one key to the line.
+ * @param key The key.
+ * @return What the key did to the edit.
+ */
+enum sh_edit_result sh_edit_key(struct sh_editor *editor, int key) {
+    size_t cursor = editor->cursor;
+
+    if (editor->searching && sh_edit_search_key(editor, key)) {
+        return SH_EDIT_MORE;
+    }
+
+    switch (key) {
+    case '\r':
+    case '\n':
+        return SH_EDIT_DONE;
+    case 3: // ^C
+        return SH_EDIT_CANCEL;
+    case 4: // ^D
+        if (editor->line.len == 0) {
+            return SH_EDIT_EOF;
+        }
+        sh_edit_remove(editor, cursor, sh_edit_next_char(editor, cursor), 0);
+        break;
+    case SH_KEY_DELETE:
+        sh_edit_remove(editor, cursor, sh_edit_next_char(editor, cursor), 0);
+        break;
+    case 0x7f:
+    case '\b':
+        sh_edit_remove(editor, sh_edit_prev_char(editor, cursor), cursor, 0);
+        break;
+    case 1: // ^A
+    case SH_KEY_HOME:
+        editor->cursor = 0;
+        break;
+    case 5: // ^E
+    case SH_KEY_END:
+        editor->cursor = editor->line.len;
+        break;
+    case 2: // ^B
+    case SH_KEY_LEFT:
+        editor->cursor = sh_edit_prev_char(editor, cursor);
+        break;
+    case 6: // ^F
+    case SH_KEY_RIGHT:
+        editor->cursor = sh_edit_next_char(editor, cursor);
+        break;
+    case SH_KEY_WORD_LEFT:
+        editor->cursor = sh_edit_prev_word(editor, cursor);
+        break;
+    case SH_KEY_WORD_RIGHT:
+        editor->cursor = sh_edit_next_word(editor, cursor);
+        break;
+    case 11: // ^K
+        sh_edit_remove(editor, cursor, editor->line.len, 1);
+        break;
+    case 21: // ^U
+        sh_edit_remove(editor, 0, cursor, 1);
+        break;
+    case 23: // ^W
+    case SH_KEY_KILL_WORD:
+        sh_edit_remove(editor, sh_edit_prev_word(editor, cursor), cursor, 1);
+        break;
+    case 25: // ^Y
+        if (editor->kill.len > 0) {
+            sh_edit_insert(editor, editor->kill.data, editor->kill.len);
+        }
+        break;
+    case 20: // ^T: swap the characters around the cursor
+        if (cursor > 0 && editor->line.len > 1) {
+            size_t end = cursor == editor->line.len ? cursor : sh_edit_next_char(editor, cursor);
+            size_t mid = sh_edit_prev_char(editor, end), from = sh_edit_prev_char(editor, mid);
+            char *swapped = sh_xmalloc(end - from);
+
+            memcpy(swapped, editor->line.data + mid, end - mid);
+            memcpy(swapped + (end - mid), editor->line.data + from, mid - from);
+            memcpy(editor->line.data + from, swapped, end - from);
+            free(swapped);
+            editor->cursor = end;
+        }
+        break;
+    case 12: // ^L
+        sh_edit_append(&editor->out, "\033[H\033[2J", 7);
+        editor->row.len = 0;
+        editor->row_cursor = 0;
+        break;
+    case 16: // ^P
+    case SH_KEY_UP:
+        sh_edit_history(editor, 1);
+        break;
+    case 14: // ^N
+    case SH_KEY_DOWN:
+        sh_edit_history(editor, 0);
+        break;
+    case 18: // ^R
+        sh_edit_search_start(editor);
+        break;
+    case '\t':
+        sh_edit_complete(editor);
+        break;
+    default:
+        // Other control characters would upset the column count.
+        if (key >= ' ' && key < 256) {
+            char c = key;
+            sh_edit_insert(editor, &c, 1);
+        }
+    }
+    return SH_EDIT_MORE;
+}
+
+/**
+ * @brief Decide, once, whether to edit lines on the terminal.
+ * @return Whether the editor is used.
+ */
+int sh_edit_enabled() {
+    struct sh_editor *editor = &sh_editor;
+    const char *term = getenv("TERM");
+
+    if (!editor->checked) {
+        editor->checked = 1;
+        editor->enabled = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) &&
+                          term != NULL && strcmp(term, "dumb") != 0 &&
+                          tcgetattr(STDIN_FILENO, &editor->cooked) == 0;
+    }
+    return editor->enabled;
+}
+
+/**
+ * @brief Read a line from the terminal with the editor.
+ * @param prompt The prompt.
+ * @return The line, valid until the next call; NULL at end of input.
+ */
+char *sh_edit_line(const char *prompt) {
+    struct sh_editor *editor = &sh_editor;
+    enum sh_edit_result result = SH_EDIT_MORE;
+    struct termios raw;
+    int key;
+
+    // Programs run from the shell may have left other modes behind.
+    tcgetattr(STDIN_FILENO, &editor->cooked);
+    raw = editor->cooked;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_oflag &= ~OPOST;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    fflush(stdout);
+    sh_edit_assign(&editor->line, "", 0);
+    editor->cursor = editor->offset = 0;
+    editor->row.len = editor->row_cursor = 0;
+    editor->hist_seq = sh_hist.next;
+    editor->searching = 0;
+    editor->last_key = 0;
+    editor->prompt = prompt;
+
+    editor->keys_start = editor->keys_end = 0;
+
+    sh_edit_refresh(editor);
+    sh_edit_flush(editor);
+    while (result == SH_EDIT_MORE) {
+        int pending = 0;
+
+        if (!sh_edit_next_key(editor, &key)) {
+            ssize_t n;
+
+            if (editor->keys_end == sizeof(editor->keys)) {
+                // An escape sequence that never ends: drop it.
+                editor->keys_start = editor->keys_end = 0;
+            }
+            // A byte at a time, so that whatever is typed after the line
+            // ends stays in the terminal for the command it runs.
+            n = read(STDIN_FILENO, editor->keys + editor->keys_end, 1);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                result = SH_EDIT_EOF;
+                break;
+            }
+            editor->keys_end += n;
+            continue;
+        }
+        if (editor->keys_start == editor->keys_end) {
+            editor->keys_start = editor->keys_end = 0;
+        }
+        result = sh_edit_key(editor, key);
+        editor->last_key = key;
+        // Everything already typed, a paste say, is applied before drawing.
+        if (result == SH_EDIT_MORE &&
+            (ioctl(STDIN_FILENO, FIONREAD, &pending) == -1 || pending == 0)) {
+            sh_edit_refresh(editor);
+            sh_edit_flush(editor);
+        }
+    }
+
+    if (result != SH_EDIT_EOF || editor->line.len > 0) {
+        editor->searching = 0;
+        editor->cursor = editor->line.len;
+        sh_edit_refresh(editor);
+    }
+    sh_edit_append(&editor->out, result == SH_EDIT_CANCEL ? "^C\r\n" : "\r\n",
+                   result == SH_EDIT_CANCEL ? 4 : 2);
+    sh_edit_flush(editor);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &editor->cooked);
+
+    if (result == SH_EDIT_EOF) {
+        return NULL;
+    }
+    if (result == SH_EDIT_CANCEL) {
+        sh_last_status = 130;
+        editor->line.len = 0;
+        editor->line.data[0] = '\0';
+    }
+    return editor->line.data;
+}
+
+/**
+ * @brief Read a line of input.
+ *
+ * With a prompt, a terminal on stdin gets the line editor; anything else
+ * is read as it comes, after the prompt is printed.
+ * @param input Where to read from.
+ * @param prompt What to prompt with, or NULL not to prompt.
+ * @return The line, valid until the next call; NULL at end of input.
+ */
+char *sh_read_line(struct sh_reader *input, const char *prompt) {
+    size_t len;
+
+    if (prompt != NULL) {
+        if (input == &sh_stdin && sh_edit_enabled()) {
+            return sh_edit_line(prompt);
+        }
+        printf("%s", prompt);
+        fflush(stdout);
+    }
+
+#ifdef SH_USE_STD_GETLINE
+    if (input == &sh_stdin) {
+        static char *line = NULL;
+        static size_t buffer_size = 0; // have getline allocate a buffer for us
+        ssize_t line_len = getline(&line, &buffer_size, stdin);
+
+        if (line_len == -1) {
+            if (feof(stdin)) {
+                return NULL; // We received an EOF
+            } else {
+                perror("sh: getline\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (line_len > 0 && line[line_len - 1] == '\n') {
+            line[line_len - 1] = '\0';
+        }
+        return line;
+    }
+#endif
+    return sh_reader_line(input, &len);
+}
+
+// The words a compound command starts and ends with.
+const char *sh_compound_starts[] = {"if", "while", "until", "for", NULL};
+const char *sh_compound_ends[] = {"fi", "done", NULL};
+
+/**
+ * @brief Tell whether a line has one of some words in it. This only looks
+ * for them between blanks and operators: it also finds them quoted or as
+ * arguments, but never misses one that is a reserved word.
+ * @param line The line.
+ * @param words The words, NULL terminated.
+ * @return 1 if it has one, 0 otherwise.
+ */
+int sh_line_has_word(const char *line, const char **words) {
+    for (const char *p = line + strspn(line, " \t;&|<>"); *p != '\0';) {
+        size_t len = strcspn(p, " \t;&|<>");
+
+        for (int i = 0; words[i] != NULL; i++) {
+            if (strlen(words[i]) == len && memcmp(p, words[i], len) == 0) {
+                return 1;
+            }
+        }
+        p += len;
+        p += strspn(p, " \t;&|<>");
+    }
+    return 0;
+}
+
+/**
+ * @brief Read the next command and parse it: a line, and while it leaves a
+ * compound command open, the lines after it.
+ *
+ * Most lines open none and are parsed in place. The others are copied,
+ * since parsing takes its text apart, and parsed again only when a line
+ * that could close them is added.
+ * @param input Where to read from.
+ * @param prompt What to prompt with, or NULL not to prompt; lines read
+ * with a prompt are remembered in the history.
+ * @param list Receives the parsed command, or NULL on a syntax error
+ * (already reported).
+ * @return 0 at end of input, 1 otherwise.
+ */
+int sh_read_list(struct sh_reader *input, const char *prompt, struct sh_list **list) {
+    char *line, *text;
+    size_t len, size;
+
+    SH_PROFILE_START(READ);
+    line = sh_read_line(input, prompt);
+    SH_PROFILE_STOP(READ);
+    if (line == NULL) {
+        return 0;
+    }
+    if (prompt != NULL) {
+        // Before parsing, which takes the line apart in place.
+        sh_history_add(line);
+    }
+    if (!sh_line_has_word(line, sh_compound_starts)) {
+        SH_PROFILE_START(PARSE);
+        *list = sh_parse_line(line);
+        SH_PROFILE_STOP(PARSE);
+        return 1;
+    }
+
+    len = strlen(line);
+    size = len + 1;
+    text = sh_xmalloc(size);
+    memcpy(text, line, size);
+    sh_parse_more = 1;
+    while (1) {
+        struct sh_arena_mark mark = sh_arena_save(&sh_parse_arena);
+
+        {
+            SH_PROFILE_START(PARSE);
+            *list = sh_parse_line(sh_arena_strndup(&sh_parse_arena, text, len));
+            SH_PROFILE_STOP(PARSE);
+        }
+        if (*list != NULL || !sh_parse_incomplete) {
+            break;
+        }
+        sh_arena_release(&sh_parse_arena, mark);
+        do {
+            size_t line_len;
+
+            if ((line = sh_read_line(input, prompt != NULL ? SH_PROMPT_MORE : NULL)) == NULL) {
+                break;
+            }
+            if (prompt != NULL) {
+                sh_history_add(line);
+            }
+            line_len = strlen(line);
+            if (len + line_len + 2 > size) {
+                size = 2 * (len + line_len + 2);
+                text = sh_xrealloc(text, size);
+            }
+            text[len++] = '\n';
+            memcpy(text + len, line, line_len + 1);
+            len += line_len;
+        } while (!sh_line_has_word(line, sh_compound_ends));
+        if (line == NULL) {
+            sh_syntax_error(": unexpected end of file");
+            break;
+        }
+    }
+    sh_parse_more = 0;
+    free(text);
+    return 1;
+}
+
+/**
+ * @brief Loop getting input and executing it.
+ * @param input Where to read commands from.
+ * @return 0 if a command asked the shell to exit, 1 at end of input.
+ */
+int sh_loop(struct sh_reader *input) {
+    // Only the terminal is prompted for, and remembered in the history.
+    int interactive = sh_interactive && input == &sh_stdin;
+    struct sh_list *list;
+    int status;
+
+    do {
+        sh_job_notify();
+
+        // Read the next command, and parse it.
+        if (!sh_read_list(input, interactive ? SH_PROMPT : NULL, &list)) {
+            return 1; // We received an EOF
+        }
+
+        // Run the parsed commands.
+        status = list != NULL ? sh_execute_list(list) : 1;
+
+        // Drop everything parsing this command allocated.
+        sh_arena_reset(&sh_parse_arena);
+    } while (status);
+    return 0;
+}
+
+/*
+ * Parallel executor: the parallel builtin runs a command once per input
+ * line, with a bounded number of children at a time. Each child's output
+ * is collected in a buffer of its own and written out in one piece when the
+ * child is done, so the output of different children is never interleaved.
+ */
+struct sh_parallel_run {
+    struct sh_job *job; // NULL when the slot is free
+    long seq;           // position of its input line
+    int fd;             // read end of its stdout, -1 at EOF
+    char *output;
+    size_t len, size;
+};
+
+struct sh_parallel_output {
+    long seq;
+    char *output;
+    size_t len;
+    struct sh_parallel_output *next;
+};
+
+/**
+ * @brief Build the command line for one input line.
+ *
+ * Every "{}" in the arguments is replaced by the line; without any, the
+ * line becomes an extra last argument.
+ * @param args The command and its arguments.
+ * @param line The input line.
+ * @return Null terminated argv, allocated from sh_parse_arena.
+ */
+char **sh_parallel_args(char **args, const char *line) {
+    size_t line_len = strlen(line);
+    int argc = 0, replaced = 0;
+    char **argv;
+
+    while (args[argc] != NULL) {
+        argc++;
+    }
+    argv = sh_arena_alloc(&sh_parse_arena, (argc + 2) * sizeof(char *));
+
+    for (int i = 0; i < argc; i++) {
+        const char *from = args[i], *brace;
+        size_t count = 0;
+        char *to;
+
+        for (brace = strstr(from, "{}"); brace != NULL; brace = strstr(brace + 2, "{}")) {
+            count++;
+        }
+        if (count == 0) {
+            argv[i] = args[i];
+            continue;
+        }
+
+        replaced = 1;
+        argv[i] = to = sh_arena_alloc(&sh_parse_arena, strlen(from) + count * line_len + 1);
+        while ((brace = strstr(from, "{}")) != NULL) {
+            memcpy(to, from, brace - from);
+            to += brace - from;
+            memcpy(to, line, line_len);
+            to += line_len;
+            from = brace + 2;
+        }
+        strcpy(to, from);
+    }
+
+    if (!replaced) {
+        argv[argc] = sh_arena_alloc(&sh_parse_arena, line_len + 1);
+        memcpy(argv[argc++], line, line_len + 1);
+    }
+    argv[argc] = NULL;
+    return argv;
+}
+
+/**
+ * @brief Start the command for one input line in a free slot.
+ * @param run The slot.
+ * @param args The command and its arguments.
+ * @param line The input line.
+ * @param stdin_fd Fd the child reads as stdin.
+ */
+void sh_parallel_start(struct sh_parallel_run *run, char **args, const char *line, int stdin_fd) {
+    char **argv = sh_parallel_args(args, line);
+    struct sh_builtin *builtin = sh_builtin_find(argv[0]);
+    struct sh_fd_move moves[2];
+    struct sh_spawn_opts opts = {moves, 2, -1};
+    int fds[2];
+
+    run->job = sh_job_new(1, argv[0], 1);
+    run->job->notified = 1;
+    run->len = 0;
+
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("sh: parallel: pipe");
+        run->fd = -1;
+        sh_job_add(run->job, -1);
+        return;
+    }
+    moves[0] = (struct sh_fd_move) {stdin_fd, STDIN_FILENO};
+    moves[1] = (struct sh_fd_move) {fds[1], STDOUT_FILENO};
+
+    // Children stay in the shell's process group, so ^C reaches them.
+    if (builtin != NULL) {
+        sh_job_add(run->job, sh_start_builtin(builtin, argv, &opts));
+    } else {
+        sh_job_add(run->job, sh_start(argv, &opts));
+    }
+    close(fds[1]);
+    run->fd = fds[0];
+}
+
+/**
+ * @brief Read what a child has written so far into its buffer.
+ * @param run The slot.
+ */
+void sh_parallel_read(struct sh_parallel_run *run) {
+    ssize_t count;
+
+    if (run->size - run->len < SH_READ_BLOCK_SIZE) {
+        run->size = run->size ? run->size * 2 : 2 * SH_READ_BLOCK_SIZE;
+        run->output = sh_xrealloc(run->output, run->size);
+    }
+    count = read(run->fd, run->output + run->len, run->size - run->len);
+    if (count > 0) {
+        run->len += count;
+    } else if (count == 0 || errno != EINTR) {
+        close(run->fd);
+        run->fd = -1;
+    }
+}
+
+/**
+ * @brief Builtin command: run a command for every input line, in parallel.
+ * @param args List of args. args[0] is "parallel". Options: "-j N" runs at
+ * most N at once (default: one per CPU), "-a file" reads lines from file
+ * instead of stdin, "-k" writes output in input order rather than in
+ * completion order. The remaining args are the command, where "{}" stands
+ * for the line.
+ * @return Always returns 1, to continue executing.
+ */
+int sh_parallel(char **args) {
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    struct sh_reader file = {-1}, *input = &sh_stdin;
+    struct sh_parallel_run *runs;
+    struct sh_parallel_output *pending = NULL;
+    struct pollfd *pfds;
+    long seq = 0, next_out = 0;
+    int keep_order = 0, running = 0, failed = 0, input_done = 0;
+    int stdin_fd = STDIN_FILENO, i;
+
+    for (i = 1; args[i] != NULL && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(args[i], "-k") == 0) {
+            keep_order = 1;
+        } else if (strncmp(args[i], "-j", 2) == 0 && (args[i][2] != '\0' || args[i + 1] != NULL)) {
+            max_jobs = atol(args[i][2] != '\0' ? args[i] + 2 : args[++i]);
+        } else if (strcmp(args[i], "-a") == 0 && args[i + 1] != NULL && input == &sh_stdin) {
+            if (sh_reader_map(&file, args[++i]) == -1) {
+                fprintf(stderr, "sh: parallel: %s: %s\n", args[i], strerror(errno));
+                sh_last_status = 1;
+                return 1;
+            }
+            input = &file;
+        } else {
+            break;
+        }
+    }
+    if (args[i] == NULL || args[i][0] == '-' || max_jobs < 1) {
+        fprintf(stderr, "sh: parallel: usage: parallel [-k] [-j jobs] [-a file] command [args...]\n");
+        sh_last_status = 2;
+        return 1;
+    }
+    args += i;
+
+    // Children must not eat the lines meant for us.
+    if (input == &sh_stdin) {
+        stdin_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    runs = sh_xcalloc(max_jobs, sizeof(*runs));
+    pfds = sh_xcalloc(max_jobs + 1, sizeof(*pfds));
+    fflush(stdout);
+
+    while (1) {
+        int npfds = 0;
+
+        // Keep every slot busy while there is input.
+        for (i = 0; i < max_jobs && !input_done; i++) {
+            char *line;
+
+            if (runs[i].job != NULL) {
+                continue;
+            }
+            if ((line = sh_read_line(input, NULL)) == NULL) {
+                input_done = 1;
+                break;
+            }
+            runs[i].seq = seq++;
+            sh_parallel_start(&runs[i], args, line, stdin_fd);
+            running++;
+        }
+        if (running == 0) {
+            break;
+        }
+
+        // Readable when any child is ready to be reaped.
+        pfds[npfds++] = (struct pollfd) {sh_child_epoll, POLLIN, 0};
+        for (i = 0; i < max_jobs; i++) {
+            if (runs[i].job != NULL && runs[i].fd != -1) {
+                pfds[npfds++] = (struct pollfd) {runs[i].fd, POLLIN, 0};
+            }
+        }
+        if (poll(pfds, npfds, -1) == -1 && errno != EINTR) {
+            perror("sh: parallel: poll");
+            break;
+        }
+
+        for (i = 0; i < max_jobs; i++) {
+            if (runs[i].job != NULL && runs[i].fd != -1) {
+                for (int j = 1; j < npfds; j++) {
+                    if (pfds[j].fd == runs[i].fd && pfds[j].revents != 0) {
+                        sh_parallel_read(&runs[i]);
+                        break;
+                    }
+                }
+            }
+        }
+        sh_reap();
+
+        for (i = 0; i < max_jobs; i++) {
+            struct sh_parallel_run *run = &runs[i];
+            struct sh_parallel_output *out, **link;
+
+            if (run->job == NULL || run->fd != -1 || run->job->state != SH_JOB_DONE) {
+                continue;
+            }
+            failed += sh_job_status(run->job) != 0;
+            sh_job_free(run->job);
+            run->job = NULL;
+            running--;
+
+            if (!keep_order) {
+                sh_write_all(STDOUT_FILENO, run->output, run->len);
+                continue;
+            }
+
+            // Hold finished output until everything before it is written.
+            out = sh_xmalloc(sizeof(*out));
+            out->seq = run->seq;
+            out->len = run->len;
+            out->output = run->output;
+            run->output = NULL;
+            run->size = 0;
+            for (link = &pending; *link != NULL && (*link)->seq < out->seq; link = &(*link)->next) {
+            }
+            out->next = *link;
+            *link = out;
+            while (pending != NULL && pending->seq == next_out) {
+                out = pending;
+                pending = out->next;
+                sh_write_all(STDOUT_FILENO, out->output, out->len);
+                free(out->output);
+                free(out);
+                next_out++;
+            }
+        }
+    }
+
+    for (i = 0; i < max_jobs; i++) {
+        free(runs[i].output);
+    }
+    free(runs);
+    free(pfds);
+    if (stdin_fd != STDIN_FILENO) {
+        close(stdin_fd);
+    }
+    if (input == &file && file.fd == -1) {
+        munmap(file.buffer, file.size);
+    } else if (input == &file) {
+        close(file.fd);
+        free(file.buffer);
+    }
+
+    // As GNU parallel: the number of failed commands, capped at 101.
+    sh_last_status = failed > 101 ? 101 : failed;
+    return 1;
+}
+
+/*
+ * Batch mode: "sh --batch" reads command lines from a fd, as streamed by a
+ * controller, and runs each in a child of its own, a bounded number at a
+ * time. A line that is one external command is spawned directly; anything
+ * else runs in a forked subshell. Each command's stdout is collected in a
+ * buffer and written out in one piece once it has finished, as a record
+ *     <line number> <exit status> <length>\n<length bytes of output>
+ * Children are watched through pidfds, so the shell never blocks in
+ * waitpid for one while others have output. One io_uring carries every
+ * output read, exit and input read, so each pass of the loop is a single
+ * io_uring_enter; where io_uring is not available, or SH_BATCH_IO=epoll,
+ * epoll does the same job with a read() per ready fd.
+ */
+#define SH_BATCH_INPUT_SIZE 65536
+#define SH_BATCH_EVENTS 64
+
+enum sh_batch_kind {
+    SH_BATCH_OUTPUT, // a read of a child's stdout
+    SH_BATCH_EXIT,   // a child's pidfd becoming readable
+    SH_BATCH_INPUT   // a read of more command lines
+};
+
+// One thing the event loop waits for; what the completion points back to.
+struct sh_batch_req {
+    enum sh_batch_kind kind;
+    int fd;
+    char *buf; // where a read goes
+    size_t len;
+    int slot;
+    int registered; // with epoll: fd has been added
+};
+
+struct sh_batch_slot {
+    long seq; // line number; -1 when the slot is free
+    pid_t pid;
+    int status;
+    int exited;
+    struct sh_batch_req output; // fd is -1 at EOF
+    struct sh_batch_req exit;   // the pidfd, -1 once reaped
+    char *data;
+    size_t len, size;
+};
+
+struct sh_batch {
+    // io_uring, when uring != -1: the mapped rings and how many entries
+    // are queued but not yet submitted.
+    int uring;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned queued;
+    // epoll otherwise, and the events it returned that are yet to be handled.
+    int epoll;
+    struct epoll_event events[SH_BATCH_EVENTS];
+    int nevents, next_event;
+    struct sh_batch_req *ready; // armed on a file epoll cannot watch
+
+    struct sh_batch_slot *slots;
+    int nslots, running, null_fd;
+    long seq, failed;
+    // Input read so far; lines from start up to len are yet to be run.
+    struct sh_batch_req input;
+    char *in;
+    size_t in_start, in_len, in_size;
+    int in_eof, in_reading;
+};
+
+/**
+ * @brief Set up an io_uring for the batch.
+ * @param batch The batch; receives the ring.
+ * @param entries Submission queue size.
+ * @return 0 on success, -1 if io_uring cannot be used.
+ */
+int sh_batch_uring_init(struct sh_batch *batch, unsigned entries) {
+    struct io_uring_params params;
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+    void *sqes;
+
+    memset(&params, 0, sizeof(params));
+    batch->uring = syscall(SYS_io_uring_setup, entries, &params);
+    if (batch->uring == -1) {
+        return -1;
+    }
+    // Reads at the current file position, which pipes need, came with this.
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(batch->uring);
+        batch->uring = -1;
+        return -1;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, batch->uring,
+              IORING_OFF_SQ_RING);
+    cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, batch->uring,
+                  IORING_OFF_CQ_RING);
+    }
+    sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, batch->uring, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        // The process exits when the batch is done, so nothing is unmapped.
+        close(batch->uring);
+        batch->uring = -1;
+        return -1;
+    }
+
+    batch->sq_head = (unsigned *) (sq + params.sq_off.head);
+    batch->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    batch->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    batch->sq_entries = (unsigned *) (sq + params.sq_off.ring_entries);
+    batch->sq_array = (unsigned *) (sq + params.sq_off.array);
+    batch->cq_head = (unsigned *) (cq + params.cq_off.head);
+    batch->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    batch->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    batch->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    batch->sqes = sqes;
+    return 0;
+}
+
+/**
+ * @brief Hand the queued submissions to the kernel, and optionally wait
+ * for a completion.
+ * @param batch The batch.
+ * @param wait Whether to wait for at least one completion.
+ * @return 0 on success, -1 on error (reported).
+ */
+int sh_batch_uring_enter(struct sh_batch *batch, int wait) {
+    while (1) {
+        int submitted = syscall(SYS_io_uring_enter, batch->uring, batch->queued, wait ? 1 : 0,
+                                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+        if (submitted >= 0) {
+            batch->queued -= submitted;
+            return 0;
+        }
+        if (errno != EINTR) {
+            perror("sh: batch: io_uring_enter");
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief Start waiting for a request.
+ * @param batch The batch.
+ * @param req The request: a read of len bytes into buf, or for
+ * SH_BATCH_EXIT the pidfd becoming readable.
+ * @return 0 on success, -1 on error (reported).
+ */
+int sh_batch_arm(struct sh_batch *batch, struct sh_batch_req *req) {
+    if (batch->uring != -1) {
+        unsigned tail = *batch->sq_tail, index;
+        struct io_uring_sqe *sqe;
+
+        if (tail - __atomic_load_n(batch->sq_head, __ATOMIC_ACQUIRE) == *batch->sq_entries &&
+            sh_batch_uring_enter(batch, 0) == -1) {
+            return -1;
+        }
+        index = tail & *batch->sq_mask;
+        sqe = &batch->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = req->fd;
+        sqe->user_data = (uintptr_t) req;
+        if (req->kind == SH_BATCH_EXIT) {
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = POLLIN;
+        } else {
+            sqe->opcode = IORING_OP_READ;
+            sqe->addr = (uintptr_t) req->buf;
+            sqe->len = req->len;
+            sqe->off = (uint64_t) -1;
+        }
+        batch->sq_array[index] = index;
+        __atomic_store_n(batch->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        batch->queued++;
+        return 0;
+    } else {
+        // One shot: a request is re-armed for each read.
+        struct epoll_event event = {EPOLLIN | EPOLLONESHOT, {.ptr = req}};
+
+        if (epoll_ctl(batch->epoll, req->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, req->fd, &event) == -1) {
+            if (errno == EPERM) {
+                // A regular file, which is always ready.
+                batch->ready = req;
+                return 0;
+            }
+            perror("sh: batch: epoll_ctl");
+            return -1;
+        }
+        req->registered = 1;
+        return 0;
+    }
+}
+
+/**
+ * @brief Close the fd of a request that is no longer armed.
+ * @param batch The batch.
+ * @param req The request.
+ */
+void sh_batch_close(struct sh_batch *batch, struct sh_batch_req *req) {
+    // A forked subshell may hold the fd too, which would keep it in epoll.
+    if (batch->uring == -1 && req->registered) {
+        epoll_ctl(batch->epoll, EPOLL_CTL_DEL, req->fd, NULL);
+    }
+    close(req->fd);
+    req->fd = -1;
+    req->registered = 0;
+}
+
+/**
+ * @brief Wait for the next request to complete.
+ * @param batch The batch.
+ * @param res Receives what a read returned, or -errno; 0 for an exit.
+ * @return The request, or NULL on error (reported).
+ */
+struct sh_batch_req *sh_batch_next(struct sh_batch *batch, ssize_t *res) {
+    struct sh_batch_req *req;
+
+    if (batch->uring != -1) {
+        while (1) {
+            unsigned head = *batch->cq_head;
+
+            if (head != __atomic_load_n(batch->cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &batch->cqes[head & *batch->cq_mask];
+
+                req = (struct sh_batch_req *) (uintptr_t) cqe->user_data;
+                *res = cqe->res;
+                __atomic_store_n(batch->cq_head, head + 1, __ATOMIC_RELEASE);
+                return req;
+            }
+            if (sh_batch_uring_enter(batch, 1) == -1) {
+                return NULL;
+            }
+        }
+    }
+
+    if ((req = batch->ready) != NULL) {
+        batch->ready = NULL;
+    }
+    while (req == NULL && batch->next_event == batch->nevents) {
+        batch->nevents = epoll_wait(batch->epoll, batch->events, SH_BATCH_EVENTS, -1);
+        batch->next_event = 0;
+        if (batch->nevents == -1) {
+            batch->nevents = 0;
+            if (errno != EINTR) {
+                perror("sh: batch: epoll_wait");
+                return NULL;
+            }
+        }
+    }
+    if (req == NULL) {
+        req = batch->events[batch->next_event++].data.ptr;
+    }
+    *res = 0;
+    if (req->kind != SH_BATCH_EXIT && (*res = read(req->fd, req->buf, req->len)) == -1) {
+        *res = -errno;
+    }
+    return req;
+}
+
+/**
+ * @brief Start reading more of a slot's output.
+ * @param batch The batch.
+ * @param slot The slot.
+ * @return 0 on success, -1 on error (reported).
+ */
+int sh_batch_read_output(struct sh_batch *batch, struct sh_batch_slot *slot) {
+    if (slot->size - slot->len < SH_READ_BLOCK_SIZE) {
+        slot->size = slot->size ? slot->size * 2 : 2 * SH_READ_BLOCK_SIZE;
+        slot->data = sh_xrealloc(slot->data, slot->size);
+    }
+    slot->output.buf = slot->data + slot->len;
+    slot->output.len = slot->size - slot->len;
+    return sh_batch_arm(batch, &slot->output);
+}
+
+/**
+ * @brief Write out a finished command's record and free its slot.
+ * @param batch The batch.
+ * @param slot The slot.
+ */
+void sh_batch_finish(struct sh_batch *batch, struct sh_batch_slot *slot) {
+    char header[64];
+    int len = snprintf(header, sizeof(header), "%ld %d %zu\n", slot->seq, slot->status, slot->len);
+
+    sh_write_all(STDOUT_FILENO, header, len);
+    sh_write_all(STDOUT_FILENO, slot->data, slot->len);
+    batch->failed += slot->status != 0;
+    batch->running--;
+    slot->seq = -1;
+}
+
+/**
+ * @brief Start the command on one line in a free slot.
+ * @param batch The batch.
+ * @param slot The slot.
+ * @param line The line. Modified in place.
+ */
+void sh_batch_start(struct sh_batch *batch, struct sh_batch_slot *slot, char *line) {
+    struct sh_list *list = sh_parse_line(line);
+    struct sh_pipeline *pipeline, expanded;
+    struct sh_command *command;
+    int fds[2];
+
+    slot->seq = batch->seq++;
+    slot->len = 0;
+    slot->status = 0;
+    slot->exited = 0;
+    slot->pid = -1;
+    batch->running++;
+    if (list == NULL || list->ncode == 0) {
+        // A syntax error (already reported), or nothing to run.
+        slot->status = list == NULL ? 2 : 0;
+        sh_batch_finish(batch, slot);
+        return;
+    }
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("sh: batch: pipe");
+        slot->status = 1;
+        sh_batch_finish(batch, slot);
+        return;
+    }
+
+    pipeline = &list->pipelines[0];
+    command = &pipeline->commands[0];
+    if (list->ncode == 1 && list->code[0].code == SH_OP_RUN && pipeline->count == 1 &&
+        !pipeline->background && command->argc > 0 &&
+        strpbrk(command->argv[0], SH_EXPAND_BYTES SH_GLOB_CHARS) == NULL &&
+        sh_builtin_find(command->argv[0]) == NULL) {
+        // One external command: nothing for a subshell to do but start it.
+        struct sh_fd_move *moves;
+        struct sh_spawn_opts opts;
+
+        command = &sh_expand_pipeline(pipeline, &expanded)->commands[0];
+        moves = sh_arena_alloc(&sh_parse_arena, (2 + command->nredirects) * sizeof(*moves));
+        moves[0] = (struct sh_fd_move) {batch->null_fd, STDIN_FILENO};
+        moves[1] = (struct sh_fd_move) {fds[1], STDOUT_FILENO};
+        opts = (struct sh_spawn_opts) {moves, 2, -1};
+        if (sh_redirect_open(command, moves + 2) == -1) {
+            slot->status = 1;
+        } else {
+            struct sh_var_save *vars = sh_var_push(command->assigns, command->nassigns);
+
+            opts.nmoves += command->nredirects;
+            if ((slot->pid = sh_start(command->argv, &opts)) == -1) {
+                slot->status = 127;
+            }
+            sh_var_pop(vars, command->nassigns);
+            sh_redirect_close(command, moves + 2, command->nredirects);
+        }
+    } else if ((slot->pid = sh_subshell_start(list, batch->null_fd, fds[1])) == -1) {
+        slot->status = 1;
+    }
+    close(fds[1]);
+
+    slot->output.fd = fds[0];
+    slot->exit.fd = slot->pid != -1 ? syscall(SYS_pidfd_open, slot->pid, 0) : -1;
+    if (slot->pid != -1 && slot->exit.fd == -1) {
+        perror("sh: batch: pidfd_open");
+        // Without a pidfd the best left is to wait for it in the open.
+        waitpid(slot->pid, &slot->status, 0);
+        slot->status = sh_exit_status(slot->status);
+        slot->pid = -1;
+    }
+    if (slot->exit.fd == -1) {
+        slot->exited = 1;
+    } else if (sh_batch_arm(batch, &slot->exit) == -1) {
+        sh_batch_close(batch, &slot->exit);
+        slot->exited = 1;
+    }
+    if (sh_batch_read_output(batch, slot) == -1) {
+        sh_batch_close(batch, &slot->output);
+        if (slot->exited) {
+            sh_batch_finish(batch, slot);
+        }
+    }
+}
+
+/**
+ * @brief Take the next whole line of input, or at end of input the last,
+ * unterminated one.
+ * @param batch The batch.
+ * @return The line, NUL-terminated in place, or NULL if there is none yet.
+ */
+char *sh_batch_line(struct sh_batch *batch) {
+    char *line = batch->in + batch->in_start;
+    char *newline = memchr(line, '\n', batch->in_len - batch->in_start);
+
+    if (newline != NULL) {
+        batch->in_start = newline - batch->in + 1;
+    } else if (batch->in_eof && batch->in_start < batch->in_len) {
+        newline = batch->in + batch->in_len;
+        batch->in_start = batch->in_len;
+    } else {
+        return NULL;
+    }
+    *newline = '\0';
+    return line;
+}
+
+/**
+ * @brief Start reading more input, after what is yet to be run.
+ * @param batch The batch.
+ * @return 0 on success, -1 on error (reported).
+ */
+int sh_batch_read_input(struct sh_batch *batch) {
+    // Lines already run are dropped; the partial one left is kept.
+    memmove(batch->in, batch->in + batch->in_start, batch->in_len - batch->in_start);
+    batch->in_len -= batch->in_start;
+    batch->in_start = 0;
+    if (batch->in_size - batch->in_len < SH_BATCH_INPUT_SIZE / 2) {
+        batch->in_size *= 2;
+        batch->in = sh_xrealloc(batch->in, batch->in_size);
+    }
+    // One byte stays free, for the last line's NUL.
+    batch->input.buf = batch->in + batch->in_len;
+    batch->input.len = batch->in_size - batch->in_len - 1;
+    batch->in_reading = 1;
+    return sh_batch_arm(batch, &batch->input);
+}
+
+/**
+ * @brief Run the batch mode entry point: sh --batch [-j jobs] [fd].
+ * @param argc Number of args.
+ * @param argv The args; argv[0] is "--batch".
+ * @return Exit status: as for the parallel builtin, the number of commands
+ * that failed, capped at 101; 2 for a usage error.
+ */
+int sh_batch_main(int argc, char **argv) {
+    struct sh_batch batch = {.uring = -1, .epoll = -1};
+    const char *io = getenv("SH_BATCH_IO");
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int fd = STDIN_FILENO, i = 1;
+
+    if (i + 1 < argc && strcmp(argv[i], "-j") == 0) {
+        jobs = atol(argv[i + 1]);
+        i += 2;
+    }
+    if (i < argc) {
+        fd = atoi(argv[i++]);
+    }
+    if (i < argc || jobs < 1 || fcntl(fd, F_GETFD) == -1) {
+        fprintf(stderr, "sh: usage: sh --batch [-j jobs] [fd]\n");
+        return 2;
+    }
+
+    if ((io == NULL || strcmp(io, "epoll") != 0) && sh_batch_uring_init(&batch, 2 * jobs + 1) == -1 &&
+        io != NULL && strcmp(io, "uring") == 0) {
+        perror("sh: batch: io_uring");
+        return 1;
+    }
+    if (batch.uring == -1 && (batch.epoll = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("sh: batch: epoll_create1");
+        return 1;
+    }
+    batch.null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    batch.nslots = jobs;
+    batch.slots = sh_xcalloc(jobs, sizeof(*batch.slots));
+    for (i = 0; i < jobs; i++) {
+        batch.slots[i].seq = -1;
+        batch.slots[i].output = (struct sh_batch_req) {SH_BATCH_OUTPUT, -1, NULL, 0, i};
+        batch.slots[i].exit = (struct sh_batch_req) {SH_BATCH_EXIT, -1, NULL, 0, i};
+    }
+    batch.input = (struct sh_batch_req) {SH_BATCH_INPUT, fd};
+    batch.in_size = SH_BATCH_INPUT_SIZE;
+    batch.in = sh_xmalloc(batch.in_size);
+
+    while (1) {
+        struct sh_batch_slot *slot;
+        struct sh_batch_req *req;
+        ssize_t res;
+        char *line;
+
+        // Keep every slot busy while there are lines.
+        for (i = 0; i < batch.nslots && batch.running < batch.nslots; i++) {
+            if (batch.slots[i].seq == -1) {
+                if ((line = sh_batch_line(&batch)) == NULL) {
+                    break;
+                }
+                sh_batch_start(&batch, &batch.slots[i], line);
+                // Drop everything parsing the line allocated.
+                sh_arena_reset(&sh_parse_arena);
+            }
+        }
+        // Only read on with a slot free, so a controller that is ahead is
+        // held up by the pipe rather than by our memory.
+        if (batch.running < batch.nslots && !batch.in_eof && !batch.in_reading &&
+            sh_batch_read_input(&batch) == -1) {
+            break;
+        }
+        if (batch.running == 0 && batch.in_eof) {
+            break;
+        }
+
+        if ((req = sh_batch_next(&batch, &res)) == NULL) {
+            break;
+        }
+        if (req->kind == SH_BATCH_INPUT) {
+            if (res == -EINTR || res == -EAGAIN) {
+                sh_batch_arm(&batch, req);
+                continue;
+            }
+            batch.in_reading = 0;
+            if (res > 0) {
+                batch.in_len += res;
+            } else {
+                if (res < 0) {
+                    fprintf(stderr, "sh: batch: read: %s\n", strerror(-res));
+                }
+                batch.in_eof = 1;
+            }
+            continue;
+        }
+
+        slot = &batch.slots[req->slot];
+        if (req->kind == SH_BATCH_OUTPUT) {
+            if (res == -EINTR || res == -EAGAIN) {
+                sh_batch_arm(&batch, req);
+                continue;
+            }
+            if (res > 0) {
+                slot->len += res;
+                if (sh_batch_read_output(&batch, slot) == 0) {
+                    continue;
+                }
+            }
+            sh_batch_close(&batch, &slot->output);
+        } else {
+            int status;
+
+            // The pidfd held the pid, so it cannot have been reused.
+            waitpid(slot->pid, &status, 0);
+            slot->status = sh_exit_status(status);
+            slot->exited = 1;
+            sh_batch_close(&batch, &slot->exit);
+        }
+        if (slot->exited && slot->output.fd == -1) {
+            sh_batch_finish(&batch, slot);
+        }
+    }
+
+    for (i = 0; i < batch.nslots; i++) {
+        free(batch.slots[i].data);
+    }
+    free(batch.slots);
+    free(batch.in);
+    return batch.failed > 101 ? 101 : batch.failed;
+}
+
+/*
+ * Coprocesses: long-lived helpers the shell talks to over a pair of pipes,
+ * so a script can stream requests to one process instead of starting a new
+ * one per request. They are pooled by name: starting a name that is still
+ * running reuses it. Each coprocess is also a background job.
+ */
+struct sh_coproc {
+    char *name;
+    pid_t pid;
+    int input;               // write end of its stdin
+    struct sh_reader output; // its stdout
+    struct sh_coproc *next;
+};
+
+struct sh_coproc *sh_coprocs;
+
+/**
+ * @brief Check whether a coprocess is still running.
+ * @param coproc The coprocess.
+ * @return Nonzero if it is.
+ */
+int sh_coproc_alive(struct sh_coproc *coproc) {
+    sh_reap();
+    for (struct sh_job *job = sh_job_table; job != NULL; job = job->next) {
+        for (int i = 0; i < job->nprocs; i++) {
+            if (job->procs[i].pid == coproc->pid) {
+                return job->procs[i].state != SH_JOB_DONE;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Find a coprocess by name.
+ * @param name The name.
+ * @return The coprocess, or NULL if there is none.
+ */
+struct sh_coproc *sh_coproc_find(const char *name) {
+    for (struct sh_coproc *coproc = sh_coprocs; coproc != NULL; coproc = coproc->next) {
+        if (strcmp(coproc->name, name) == 0) {
+            return coproc;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Close a coprocess's pipes and remove it from the pool.
+ *
+ * Its job stays in the job table; with its input closed, a well-behaved
+ * helper exits.
+ * @param coproc The coprocess.
  */
-int sh_cd(char **args);
+void sh_coproc_free(struct sh_coproc *coproc) {
+    struct sh_coproc **link = &sh_coprocs;
 
-int sh_help(char **args);
+    while (*link != coproc) {
+        link = &(*link)->next;
+    }
+    *link = coproc->next;
+    if (coproc->input != -1) {
+        close(coproc->input);
+    }
+    close(coproc->output.fd);
+    free(coproc->output.buffer);
+    free(coproc->name);
+    free(coproc);
+}
 
-int sh_exit(char **args0);
+/**
+ * @brief Close every coprocess's pipes, in a child that has not exec'ed.
+ *
+ * A coprocess only sees the end of its input once nobody holds the write
+ * end, and close-on-exec does not help a child that never execs.
+ */
+void sh_coproc_drop() {
+    while (sh_coprocs != NULL) {
+        sh_coproc_free(sh_coprocs);
+    }
+}
 
-/*
- * List of builtin commands, followed by their corresponding functions.
+/**
+ * @brief Start a coprocess, or reuse the running one of the same name.
+ * @param name The name.
+ * @param args The command and its arguments.
+ * @return The coprocess, or NULL if it could not be started (reported).
  */
-char *builtin_str[] = {
-        "cd",
-        "help",
-        "exit"
-};
+struct sh_coproc *sh_coproc_start(const char *name, char **args) {
+    struct sh_coproc *coproc = sh_coproc_find(name);
+    struct sh_builtin *builtin = sh_builtin_find(args[0]);
+    struct sh_fd_move moves[2];
+    struct sh_spawn_opts opts = {moves, 2, sh_job_control ? 0 : -1};
+    struct sh_job *job;
+    int to[2], from[2];
+    pid_t pid;
 
-int (*builtin_func[])(char **) = {
-        &sh_cd,
-        &sh_help,
-        &sh_exit
-};
+    if (coproc != NULL && sh_coproc_alive(coproc)) {
+        return coproc;
+    } else if (coproc != NULL) {
+        sh_coproc_free(coproc);
+    }
+
+    // Our ends stay close-on-exec, so no other child holds them open.
+    if (pipe2(to, O_CLOEXEC) == -1) {
+        perror("sh: coproc: pipe");
+        return NULL;
+    }
+    if (pipe2(from, O_CLOEXEC) == -1) {
+        perror("sh: coproc: pipe");
+        close(to[0]);
+        close(to[1]);
+        return NULL;
+    }
+    moves[0] = (struct sh_fd_move) {to[0], STDIN_FILENO};
+    moves[1] = (struct sh_fd_move) {from[1], STDOUT_FILENO};
+
+    // In the pool before the fork, so that a builtin's child, which never
+    // execs, closes our ends in sh_coproc_drop() like everyone else's.
+    coproc = sh_xcalloc(1, sizeof(*coproc));
+    coproc->name = sh_xstrdup(name);
+    coproc->input = to[1];
+    coproc->output.fd = from[0];
+    coproc->next = sh_coprocs;
+    sh_coprocs = coproc;
 
-int sh_num_builtins() {
-    return sizeof(builtin_str) / sizeof(char *);
+    sh_reader_sync(&sh_stdin);
+    fflush(stdout);
+    job = sh_job_new(1, args[0], 1);
+    pid = builtin != NULL ? sh_start_builtin(builtin, args, &opts) : sh_start(args, &opts);
+    sh_job_add(job, pid);
+    job->notified = 1;
+    close(to[0]);
+    close(from[1]);
+    if (pid < 0) {
+        sh_coproc_free(coproc);
+        return NULL;
+    }
+    coproc->pid = pid;
+    return coproc;
 }
 
-/*
- * Builtin function implementations.
+/**
+ * @brief Send a line to a coprocess.
+ *
+ * SIGPIPE is held off while writing, so a helper that went away only makes
+ * the write fail rather than killing the shell.
+ * @param coproc The coprocess.
+ * @param words Words of the line, joined by spaces.
+ * @return 0 on success, -1 on failure (reported).
  */
+int sh_coproc_send(struct sh_coproc *coproc, char **words) {
+    size_t len = 1;
+    char *line, *p;
+    sigset_t pipe_set, old_set;
+    int result;
+
+    if (coproc->input == -1) {
+        fprintf(stderr, "sh: coproc: %s: input is closed\n", coproc->name);
+        return -1;
+    }
+    for (int i = 0; words[i] != NULL; i++) {
+        len += strlen(words[i]) + 1;
+    }
+    p = line = sh_arena_alloc(&sh_parse_arena, len);
+    for (int i = 0; words[i] != NULL; i++) {
+        p = stpcpy(p, words[i]);
+        *p++ = words[i + 1] != NULL ? ' ' : '\n';
+    }
+    if (p == line) {
+        *p++ = '\n';
+    }
+
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_set, &old_set);
+    result = sh_write_all(coproc->input, line, p - line);
+    if (result == -1 && errno == EPIPE) {
+        struct timespec none = {0, 0};
+
+        sigtimedwait(&pipe_set, NULL, &none);
+        errno = EPIPE;
+    }
+    if (result == -1) {
+        fprintf(stderr, "sh: coproc: %s: %s\n", coproc->name, strerror(errno));
+    }
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+    return result;
+}
+
 /**
- * @brief Builtin command: change directory.
- * @param args List of args. args[0] is "cd". args[1] is the directory.
+ * @brief Copy one line of a coprocess's output to stdout.
+ * @param coproc The coprocess.
+ * @return 0 on success, -1 at the end of its output.
+ */
+int sh_coproc_receive(struct sh_coproc *coproc) {
+    size_t len;
+    char *line = sh_reader_line(&coproc->output, &len);
+
+    if (line == NULL) {
+        return -1;
+    }
+    fwrite(line, 1, len, stdout);
+    putchar('\n');
+    return 0;
+}
+
+/**
+ * @brief Builtin command: start and talk to coprocesses.
+ * @param args List of args. args[0] is "coproc". Forms:
+ * "coproc name command [args...]" starts one, unless name is running;
+ * "coproc -w name [words...]" sends a line to it;
+ * "coproc -r name" prints a line from it (status 1 at its end);
+ * "coproc -q name [words...]" sends a line, then prints the reply;
+ * "coproc -c name" closes its input and waits for it to exit;
+ * "coproc" alone lists the pool.
  * @return Always returns 1, to continue executing.
  */
-int sh_cd(char **args) {
+int sh_coproc(char **args) {
+    struct sh_coproc *coproc;
+    char option = '\0';
+
     if (args[1] == NULL) {
-        fprintf(stderr, "sh: expected argument to \"cd\"\n");
-    } else {
-        if (chdir(args[1]) != 0) {
-            perror("sh");
+        for (coproc = sh_coprocs; coproc != NULL; coproc = coproc->next) {
+            printf("%s\t%ld\t%s\n", coproc->name, (long) coproc->pid,
+                   sh_coproc_alive(coproc) ? "running" : "done");
+        }
+        return 1;
+    }
+    if (args[1][0] == '-' && args[1][1] != '\0' && args[1][2] == '\0' &&
+        strchr("wrqc", args[1][1]) != NULL) {
+        option = args[1][1];
+        args++;
+    }
+    if (args[1] == NULL || (option == '\0' && args[2] == NULL) ||
+        ((option == 'r' || option == 'c') && args[2] != NULL)) {
+        fprintf(stderr, "sh: coproc: usage: coproc name command [args...] | -w|-q name [words...] | -r|-c name\n");
+        sh_last_status = 2;
+        return 1;
+    }
+
+    if (option == '\0') {
+        sh_last_status = sh_coproc_start(args[1], args + 2) == NULL;
+        return 1;
+    }
+    if ((coproc = sh_coproc_find(args[1])) == NULL) {
+        fprintf(stderr, "sh: coproc: %s: no such coprocess\n", args[1]);
+        sh_last_status = 1;
+        return 1;
+    }
+
+    switch (option) {
+    case 'w':
+        sh_last_status = sh_coproc_send(coproc, args + 2) == -1;
+        break;
+    case 'q':
+        sh_last_status = sh_coproc_send(coproc, args + 2) == -1 || sh_coproc_receive(coproc) == -1;
+        break;
+    case 'r':
+        sh_last_status = sh_coproc_receive(coproc) == -1;
+        break;
+    case 'c': {
+        pid_t pid = coproc->pid;
+        struct sh_job *job;
+        char spec[32];
+
+        close(coproc->input);
+        coproc->input = -1;
+        snprintf(spec, sizeof(spec), "%ld", (long) pid);
+        if ((job = sh_job_find(spec)) != NULL) {
+            while (job->state == SH_JOB_RUNNING) {
+                sh_reap_wait();
+            }
+            sh_last_status = sh_job_status(job);
+            if (job->state == SH_JOB_DONE) {
+                sh_job_free(job);
+            }
         }
+        sh_coproc_free(coproc);
+        break;
+    }
     }
     return 1;
 }
 
+/*
+ * Script cache. With $SH_SCRIPT_CACHE naming a directory, a script is parsed
+ * once into a relocatable image, stored there and keyed by the script's
+ * path, mtime and size. Reruns of an unchanged script map the image and run
+ * it directly, without reading, lexing or parsing the script.
+ *
+ * An image is one contiguous block addressed only by offsets from its start:
+ * a header, the script's code, the pipeline table, the command table, the
+ * argument table, the redirection table and a pool of NUL-terminated
+ * strings. The code is the script's lists compiled one after another, as
+ * struct sh_op, with pipeline and jump args made image-wide. Words keep
+ * their expansion markers and are expanded each time they run. It is only
+ * ever read on the host that wrote it, so fields are in native byte order.
+ */
+#define SH_IMAGE_MAGIC "SHIMAGE"
+#define SH_IMAGE_VERSION 8
+
+struct sh_image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t total_size;
+    uint64_t script_size;
+    int64_t script_mtime_sec;
+    int64_t script_mtime_nsec;
+    uint64_t script_dev;
+    uint64_t script_ino;
+    uint32_t path;            // string offset of the script's real path
+    uint32_t code;            // offset of the code
+    uint32_t ncode;
+    uint32_t depth;           // deepest loop nesting in it
+    uint32_t pipelines;       // offset of the pipeline table
+    uint32_t npipelines;
+    uint32_t commands;        // offset of the command table
+    uint32_t ncommands;
+    uint32_t args;            // offset of the argument table
+    uint32_t nargs;
+    uint32_t redirects;       // offset of the redirection table
+    uint32_t nredirects;
+    uint32_t strings;         // offset of the string pool
+    uint32_t strings_size;
+};
+
+#define SH_IMAGE_BACKGROUND 1
+
+struct sh_image_pipeline {
+    uint32_t first_command;
+    uint32_t ncommands;
+    uint32_t flags;
+};
+
+#define SH_IMAGE_EXPAND 1
+
+// A command's assignments come first in the argument table, then its argv.
+struct sh_image_command {
+    uint32_t first_arg;
+    uint32_t nassigns;
+    uint32_t argc;
+    uint32_t first_redirect;
+    uint32_t nredirects;
+    uint32_t flags;
+};
+
+struct sh_image_redirect {
+    int32_t fd;
+    uint32_t kind;
+    uint32_t target; // string offset
+};
+
+struct sh_image_builder {
+    struct sh_op *code;
+    size_t ncode, code_size;
+    int depth;
+    struct sh_image_pipeline *pipelines;
+    size_t npipelines, pipelines_size;
+    struct sh_image_command *commands;
+    size_t ncommands, commands_size;
+    uint32_t *args; // offsets into strings, fixed up when serialized
+    size_t nargs, args_size;
+    struct sh_image_redirect *redirects; // targets fixed up likewise
+    size_t nredirects, redirects_size;
+    char *strings;
+    size_t strings_len, strings_size;
+    uint32_t *interned; // open addressing set of string offsets, plus one
+    size_t interned_count, interned_size;
+};
+
 /**
- * @brief Builtin command: print help.
- * @param args List of args. Not examined.
- * @return Always returns 1, to continue executing.
+ * @brief Add a string to the image being built.
+ *
+ * Scripts repeat the same words over and over, so each distinct string is
+ * stored once and shared.
+ * @param builder The builder.
+ * @param str The string.
+ * @return Its offset in the string pool.
  */
-int sh_help(char **args) {
-    int i;
-    printf("SH\n");
-    printf("Type program names and arguments, and hit enter.\n");
-    printf("The following are built in:\n");
+uint32_t sh_image_add_string(struct sh_image_builder *builder, const char *str) {
+    size_t len = strlen(str) + 1;
+    size_t offset = builder->strings_len;
+    size_t slot;
+
+    if (2 * (builder->interned_count + 1) > builder->interned_size) {
+        size_t old_size = builder->interned_size;
+        uint32_t *old = builder->interned;
+
+        builder->interned_size = old_size ? old_size * 2 : 1024;
+        builder->interned = sh_xcalloc(builder->interned_size, sizeof(uint32_t));
+        for (size_t i = 0; i < old_size; i++) {
+            if (old[i] != 0) {
+                slot = sh_hash_string(builder->strings + old[i] - 1) & (builder->interned_size - 1);
+                while (builder->interned[slot] != 0) {
+                    slot = (slot + 1) & (builder->interned_size - 1);
+                }
+                builder->interned[slot] = old[i];
+            }
+        }
+        free(old);
+    }
 
-    for (int i = 0; i < sh_num_builtins(); i++) {
-        printf("  %s\n", builtin_str[i]);
+    slot = sh_hash_string(str) & (builder->interned_size - 1);
+    while (builder->interned[slot] != 0) {
+        if (strcmp(builder->strings + builder->interned[slot] - 1, str) == 0) {
+            return builder->interned[slot] - 1;
+        }
+        slot = (slot + 1) & (builder->interned_size - 1);
     }
 
-    printf("Use the man command for information on other programs.\n");
-    return 1;
+    while (builder->strings_len + len > builder->strings_size) {
+        builder->strings_size = builder->strings_size ? builder->strings_size * 2 : 4096;
+        builder->strings = sh_xrealloc(builder->strings, builder->strings_size);
+    }
+    memcpy(builder->strings + offset, str, len);
+    builder->strings_len += len;
+    builder->interned[slot] = offset + 1;
+    builder->interned_count++;
+    return offset;
 }
 
 /**
- * @brief Builtin command: exit.
- * @param args List of args. Not examined.
- * @return Always returns 0, to terminate execution.
+ * @brief Append a parsed pipeline to the image being built.
+ * @param builder The builder.
+ * @param pipeline The pipeline.
  */
-int sh_exit(char **args) {
-    return 0;
+void sh_image_add_pipeline(struct sh_image_builder *builder, struct sh_pipeline *pipeline) {
+    struct sh_image_pipeline *entry;
+
+    builder->pipelines = sh_grow(builder->pipelines, &builder->pipelines_size,
+                                 builder->npipelines, sizeof(*builder->pipelines));
+    entry = &builder->pipelines[builder->npipelines++];
+    entry->first_command = builder->ncommands;
+    entry->ncommands = pipeline->count;
+    entry->flags = pipeline->background ? SH_IMAGE_BACKGROUND : 0;
+
+    for (int i = 0; i < pipeline->count; i++) {
+        struct sh_command *command = &pipeline->commands[i];
+
+        builder->commands = sh_grow(builder->commands, &builder->commands_size,
+                                    builder->ncommands, sizeof(*builder->commands));
+        builder->commands[builder->ncommands].first_arg = builder->nargs;
+        builder->commands[builder->ncommands].nassigns = command->nassigns;
+        builder->commands[builder->ncommands].argc = command->argc;
+        builder->commands[builder->ncommands].first_redirect = builder->nredirects;
+        builder->commands[builder->ncommands].nredirects = command->nredirects;
+        builder->commands[builder->ncommands].flags = command->expand ? SH_IMAGE_EXPAND : 0;
+        builder->ncommands++;
+
+        for (int j = 0; j < command->nassigns + command->argc; j++) {
+            builder->args = sh_grow(builder->args, &builder->args_size,
+                                    builder->nargs, sizeof(*builder->args));
+            builder->args[builder->nargs++] = sh_image_add_string(
+                    builder, j < command->nassigns ? command->assigns[j] : command->argv[j - command->nassigns]);
+        }
+        for (int j = 0; j < command->nredirects; j++) {
+            struct sh_image_redirect *redirect;
+
+            builder->redirects = sh_grow(builder->redirects, &builder->redirects_size,
+                                         builder->nredirects, sizeof(*builder->redirects));
+            redirect = &builder->redirects[builder->nredirects++];
+            redirect->fd = command->redirects[j].fd;
+            redirect->kind = command->redirects[j].kind;
+            redirect->target = sh_image_add_string(builder, command->redirects[j].target);
+        }
+    }
 }
 
 /**
- * @brief Launch a program and wait for it to terminate.
- * @param args Null terminated list of arguments (including program).
- * @return Always return 1, to continue execution.
+ * @brief Append a parsed list, and its code, to the image being built.
+ * @param builder The builder.
+ * @param list The list.
  */
-int sh_launch(char **args) {
-    pid_t pid, wpid;
-    int status;
+void sh_image_add_list(struct sh_image_builder *builder, struct sh_list *list) {
+    uint32_t first_pipeline = builder->npipelines, first_op = builder->ncode;
 
-    pid = fork();
-    if (pid == 0) {
-        // Child process
-        if (execvp(args[0], args) == -1) {
-            perror("sh");
-        }
-        exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        // Error forking
-        perror("sh");
-    } else {
-        // Parent process
-        do {
-            wpid = waitpid(pid, &status, WUNTRACED);
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+    for (int i = 0; i < list->count; i++) {
+        sh_image_add_pipeline(builder, &list->pipelines[i]);
     }
+    for (int i = 0; i < list->ncode; i++) {
+        struct sh_op op = list->code[i];
 
-    return 1;
+        if (op.code == SH_OP_RUN || op.code == SH_OP_FOR) {
+            op.arg += first_pipeline;
+        } else if (op.code != SH_OP_TRUE && op.code != SH_OP_LOOP) {
+            op.arg += first_op;
+        }
+        builder->code = sh_grow(builder->code, &builder->code_size, builder->ncode, sizeof(*builder->code));
+        builder->code[builder->ncode++] = op;
+    }
+    if (list->depth > builder->depth) {
+        builder->depth = list->depth;
+    }
 }
 
 /**
- * @brief Execute shell built-in or launch program.
- * @param args Null terminated list of arguments.
- * @return 1 if the shell should continue running, 0 if it should terminate
+ * @brief Lay out a built image as one contiguous block.
+ * @param builder The builder. Its arrays are freed.
+ * @param st Stat of the script the image was built from.
+ * @param path Real path of the script.
+ * @return The image (malloc'ed), or NULL if it is too large to address.
  */
-int sh_execute(char **args) {
-    int i;
+char *sh_image_finish(struct sh_image_builder *builder, const struct stat *st, const char *path) {
+    struct sh_image_header header = {SH_IMAGE_MAGIC, SH_IMAGE_VERSION};
+    size_t total;
+    char *image = NULL;
 
-    if (args[0] == NULL) {
-        // An empty command was entered.
-        return 1;
-    }
+    header.path = sh_image_add_string(builder, path);
+    header.code = sizeof(header);
+    header.ncode = builder->ncode;
+    header.depth = builder->depth;
+    header.pipelines = header.code + builder->ncode * sizeof(struct sh_op);
+    header.npipelines = builder->npipelines;
+    header.commands = header.pipelines + builder->npipelines * sizeof(struct sh_image_pipeline);
+    header.ncommands = builder->ncommands;
+    header.args = header.commands + builder->ncommands * sizeof(struct sh_image_command);
+    header.nargs = builder->nargs;
+    header.redirects = header.args + builder->nargs * sizeof(uint32_t);
+    header.nredirects = builder->nredirects;
+    total = (size_t) header.redirects + builder->nredirects * sizeof(struct sh_image_redirect) +
+            builder->strings_len;
+
+    if (total <= UINT32_MAX) {
+        header.strings = header.redirects + builder->nredirects * sizeof(struct sh_image_redirect);
+        header.strings_size = builder->strings_len;
+        header.path += header.strings;
+        header.total_size = total;
+        header.script_size = st->st_size;
+        header.script_mtime_sec = st->st_mtim.tv_sec;
+        header.script_mtime_nsec = st->st_mtim.tv_nsec;
+        header.script_dev = st->st_dev;
+        header.script_ino = st->st_ino;
+
+        // String offsets become offsets from the start of the image.
+        for (size_t i = 0; i < builder->nargs; i++) {
+            builder->args[i] += header.strings;
+        }
+        for (size_t i = 0; i < builder->nredirects; i++) {
+            builder->redirects[i].target += header.strings;
+        }
 
-    for (i = 0; i < sh_num_builtins(); i++) {
-        if (strcmp(args[0], builtin_str[i]) == 0) {
-            return (*builtin_func[i])(args);
+        image = sh_xmalloc(total);
+        memcpy(image, &header, sizeof(header));
+        if (builder->ncode > 0) {
+            memcpy(image + header.code, builder->code, builder->ncode * sizeof(struct sh_op));
         }
+        memcpy(image + header.pipelines, builder->pipelines, builder->npipelines * sizeof(struct sh_image_pipeline));
+        memcpy(image + header.commands, builder->commands, builder->ncommands * sizeof(struct sh_image_command));
+        memcpy(image + header.args, builder->args, builder->nargs * sizeof(uint32_t));
+        if (builder->nredirects > 0) {
+            memcpy(image + header.redirects, builder->redirects,
+                   builder->nredirects * sizeof(struct sh_image_redirect));
+        }
+        memcpy(image + header.strings, builder->strings, builder->strings_len);
     }
 
-    return sh_launch(args);
+    free(builder->code);
+    free(builder->pipelines);
+    free(builder->commands);
+    free(builder->args);
+    free(builder->redirects);
+    free(builder->strings);
+    free(builder->interned);
+    return image;
 }
 
-#define SH_TOKEN_BUFFER_SIZE 64
-#define SH_TOKEN_DELIMITER " \t\r\n\a"
-
 /**
- * @brief Split a line into tokens (very naively).
- * @param line The line.
- * @return Null-terminated array of tokens.
+ * @brief Check that an image is intact and was built from a script.
+ *
+ * Every table and offset is bounds checked, so a truncated or corrupted
+ * cache file is rejected instead of being run.
+ * @param image The image.
+ * @param size Size of the image in bytes.
+ * @param st Stat of the script.
+ * @return 1 if the image can be run in place of the script, 0 otherwise.
  */
-char **sh_split_line(char *line) {
-    int buffer_size = SH_TOKEN_BUFFER_SIZE, position = 0;
-    char **tokens = malloc(buffer_size * sizeof(char *));
-    char *token;
+int sh_image_valid(const char *image, size_t size, const struct stat *st) {
+    const struct sh_image_header *header = (const struct sh_image_header *) image;
+    const struct sh_op *code;
+    const struct sh_image_pipeline *pipelines;
+    const struct sh_image_command *commands;
+    const struct sh_image_redirect *redirects;
+    const uint32_t *args;
 
-    if (!tokens) {
-        fprintf(stderr, "sh: allocation error\n");
-        exit(EXIT_FAILURE);
+    if (size < sizeof(*header) || memcmp(header->magic, SH_IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SH_IMAGE_VERSION || header->total_size != size) {
+        return 0;
+    }
+    if (header->script_size != (uint64_t) st->st_size ||
+        header->script_mtime_sec != st->st_mtim.tv_sec ||
+        header->script_mtime_nsec != st->st_mtim.tv_nsec ||
+        header->script_dev != (uint64_t) st->st_dev ||
+        header->script_ino != (uint64_t) st->st_ino) {
+        return 0;
     }
 
-    token = strtok(line, SH_TOKEN_DELIMITER);
+    if (header->code != sizeof(*header) ||
+        header->pipelines != header->code + (uint64_t) header->ncode * sizeof(*code) ||
+        header->commands != header->pipelines + (uint64_t) header->npipelines * sizeof(*pipelines) ||
+        header->args != header->commands + (uint64_t) header->ncommands * sizeof(*commands) ||
+        header->redirects != header->args + (uint64_t) header->nargs * sizeof(*args) ||
+        header->strings != header->redirects + (uint64_t) header->nredirects * sizeof(*redirects) ||
+        (uint64_t) header->strings + header->strings_size != size ||
+        header->strings_size == 0 || image[size - 1] != '\0' ||
+        header->path < header->strings || header->path >= size) {
+        return 0;
+    }
 
-    while (token != NULL) {
-        tokens[position] = token;
-        position++;
+    code = (const struct sh_op *) (image + header->code);
+    pipelines = (const struct sh_image_pipeline *) (image + header->pipelines);
+    commands = (const struct sh_image_command *) (image + header->commands);
+    args = (const uint32_t *) (image + header->args);
+    redirects = (const struct sh_image_redirect *) (image + header->redirects);
+    if (header->depth > SH_NESTING_MAX) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < header->ncode; i++) {
+        int loop_op = code[i].code >= SH_OP_LOOP && code[i].code <= SH_OP_NEXT;
 
-        if (position >= buffer_size) {
-            buffer_size += SH_TOKEN_BUFFER_SIZE;
-            tokens = realloc(tokens, buffer_size * sizeof(char *));
-            if (!tokens) {
-                fprintf(stderr, "sh: allocation error\n");
-                exit(EXIT_FAILURE);
+        if (code[i].code >= SH_NUM_OPS || code[i].loop > header->depth || (loop_op && code[i].loop == 0)) {
+            return 0;
+        }
+        if (code[i].code == SH_OP_RUN || code[i].code == SH_OP_FOR) {
+            if (code[i].arg >= header->npipelines) {
+                return 0;
+            }
+            // A for loop's name is its one assignment word.
+            if (code[i].code == SH_OP_FOR && (pipelines[code[i].arg].ncommands != 1 ||
+                                              pipelines[code[i].arg].first_command >= header->ncommands ||
+                                              commands[pipelines[code[i].arg].first_command].nassigns != 1)) {
+                return 0;
             }
+        } else if (code[i].code != SH_OP_TRUE && code[i].code != SH_OP_LOOP && code[i].arg > header->ncode) {
+            return 0;
+        }
+    }
+    for (uint32_t i = 0; i < header->npipelines; i++) {
+        if (pipelines[i].ncommands == 0 ||
+            (uint64_t) pipelines[i].first_command + pipelines[i].ncommands > header->ncommands) {
+            return 0;
+        }
+    }
+    for (uint32_t i = 0; i < header->ncommands; i++) {
+        if ((uint64_t) commands[i].nassigns + commands[i].argc + commands[i].nredirects == 0 ||
+            (uint64_t) commands[i].first_arg + commands[i].nassigns + commands[i].argc > header->nargs ||
+            (uint64_t) commands[i].first_redirect + commands[i].nredirects > header->nredirects) {
+            return 0;
+        }
+    }
+    for (uint32_t i = 0; i < header->nredirects; i++) {
+        if (redirects[i].fd < 0 || redirects[i].kind > SH_REDIRECT_DUP_OUTPUT ||
+            redirects[i].target < header->strings || redirects[i].target >= size) {
+            return 0;
+        }
+    }
+    for (uint32_t i = 0; i < header->nargs; i++) {
+        if (args[i] < header->strings || args[i] >= size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Build one of an image's pipelines, for sh_execute_code.
+ *
+ * Arguments point straight into the image; only the argv arrays are
+ * built, from sh_parse_arena.
+ * @param source The image, already validated.
+ * @param index Index of the pipeline.
+ * @return The pipeline.
+ */
+struct sh_pipeline *sh_image_pipeline(void *source, uint32_t index) {
+    char *image = source;
+    const struct sh_image_header *header = (const struct sh_image_header *) image;
+    const struct sh_image_pipeline *entry = (const struct sh_image_pipeline *) (image + header->pipelines) + index;
+    const struct sh_image_command *commands = (const struct sh_image_command *) (image + header->commands);
+    const uint32_t *args = (const uint32_t *) (image + header->args);
+    const struct sh_image_redirect *redirects = (const struct sh_image_redirect *) (image + header->redirects);
+    struct sh_pipeline *pipeline = sh_arena_alloc(&sh_parse_arena, sizeof(*pipeline));
+
+    pipeline->count = entry->ncommands;
+    pipeline->background = (entry->flags & SH_IMAGE_BACKGROUND) != 0;
+    pipeline->commands = sh_arena_alloc(&sh_parse_arena, pipeline->count * sizeof(struct sh_command));
+    for (int j = 0; j < pipeline->count; j++) {
+        const struct sh_image_command *command = &commands[entry->first_command + j];
+        char **words = sh_arena_alloc(&sh_parse_arena, (command->nassigns + command->argc + 1) * sizeof(char *));
+
+        for (uint32_t k = 0; k < command->nassigns + command->argc; k++) {
+            words[k] = image + args[command->first_arg + k];
         }
+        words[command->nassigns + command->argc] = NULL;
+        pipeline->commands[j].assigns = words;
+        pipeline->commands[j].nassigns = command->nassigns;
+        pipeline->commands[j].argv = words + command->nassigns;
+        pipeline->commands[j].argc = command->argc;
+        pipeline->commands[j].expand = (command->flags & SH_IMAGE_EXPAND) != 0;
+
+        pipeline->commands[j].nredirects = command->nredirects;
+        pipeline->commands[j].redirects = sh_arena_alloc(&sh_parse_arena,
+                                                         command->nredirects * sizeof(struct sh_redirect));
+        for (uint32_t k = 0; k < command->nredirects; k++) {
+            const struct sh_image_redirect *redirect = &redirects[command->first_redirect + k];
 
-        token = strtok(NULL, SH_TOKEN_DELIMITER);
+            pipeline->commands[j].redirects[k].fd = redirect->fd;
+            pipeline->commands[j].redirects[k].kind = redirect->kind;
+            pipeline->commands[j].redirects[k].target = image + redirect->target;
+        }
     }
+    return pipeline;
+}
+
+/**
+ * @brief Run an image.
+ * @param image The image, already validated.
+ * @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int sh_image_run(char *image) {
+    const struct sh_image_header *header = (const struct sh_image_header *) image;
 
-    tokens[position] = NULL;
-    return tokens;
+    return sh_execute_code((const struct sh_op *) (image + header->code), header->ncode, header->depth,
+                           &sh_image_pipeline, image);
 }
 
+/**
+ * @brief Get the cache file that holds the image of a script.
+ * @param dir The cache directory.
+ * @param path Real path of the script.
+ * @return Newly allocated path.
+ */
+char *sh_cache_file(const char *dir, const char *path) {
+    // Different scripts may share a name; the header records the full path.
+    char *file = sh_xmalloc(strlen(dir) + 32);
 
-#define SH_READ_LINE_BUFFER_SIZE 1024
+    sprintf(file, "%s/%08x.shi", dir, sh_hash_string(path));
+    return file;
+}
 
 /**
- * @brief Read a line of input from stdin.
- * @return The line from stdin.
+ * @brief Store an image in the cache, replacing any older one atomically.
+ * @param file The cache file.
+ * @param image The image.
  */
-char *sh_read_line() {
-#ifdef SH_USE_STD_GETLINE
-    char *line = NULL;
-    ssize_t buffer_size = 0; // have getline allocate a buffer for us
-    if (getline(&line, &buffer_size, stdin) == -1) {
-        if (feof(stdin)) {
-            exit(EXIT_SUCCESS); // We received an EOF
-        } else {
-            perror("sh: getline\n");
-            exit(EXIT_FAILURE);
+void sh_cache_store(const char *file, const char *image) {
+    const struct sh_image_header *header = (const struct sh_image_header *) image;
+    char *tmp = sh_xmalloc(strlen(file) + 32);
+    size_t written = 0;
+    int fd;
+
+    sprintf(tmp, "%s.%ld", file, (long) getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd != -1) {
+        while (written < header->total_size) {
+            ssize_t count = write(fd, image + written, header->total_size - written);
+            if (count <= 0) {
+                if (count == -1 && errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            written += count;
+        }
+        close(fd);
+        // A cache that cannot be written is not an error; the script
+        // still runs, it is just parsed again next time.
+        if (written != header->total_size || rename(tmp, file) == -1) {
+            unlink(tmp);
         }
     }
-    return line;
-#else
-#define SH_READ_LINE_BUFFER_SIZE 1024
-    int buffer_size = SH_READ_LINE_BUFFER_SIZE;
-    int position = 0;
-    char *buffer = malloc(sizeof(char) * buffer_size);
-    int c;
-
-    if (!buffer) {
-        fprintf(stderr, "sh: allocation error\n");
-        exit(EXIT_FAILURE);
-    }
+    free(tmp);
+}
 
-    while (1) {
-        // Read a character
-        c = getchar();
-
-        if (c == EOF) {
-            exit(EXIT_SUCCESS);
-        } else if (c == '\n') {
-            buffer[position] = '\0';
-            return buffer;
-        } else {
-            buffer[position] = c;
-        }
-        position++;
+/**
+ * @brief Run a script through the script cache.
+ * @param dir The cache directory.
+ * @param script Path of the script.
+ * @return 1 if the script ran, 0 if it ran and asked the shell to exit,
+ * -1 if it could not be run from the cache (the caller runs it line by
+ * line instead).
+ */
+int sh_cache_run(const char *dir, const char *script) {
+    struct sh_image_builder builder = {0};
+    struct sh_reader reader;
+    struct stat st, image_st;
+    struct sh_list *list;
+    char *path, *file, *image;
+    int fd, status, more;
 
-        // If we have exceeded the buffer, reallocate.
-        if (position >= buffer_size) {
-            buffer_size += SH_READ_LINE_BUFFER_SIZE;
-            buffer = realloc(buffer, buffer_size);
-            if (!buffer) {
-                fprintf(stderr, "sh: allocation error\n");
-                exit(EXIT_FAILURE);
+    path = realpath(script, NULL);
+    if (path == NULL || stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+        free(path);
+        return -1;
+    }
+    file = sh_cache_file(dir, path);
+
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        if (fstat(fd, &image_st) == 0 && image_st.st_size > 0) {
+            image = mmap(NULL, image_st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+            if (image != MAP_FAILED) {
+                if (sh_image_valid(image, image_st.st_size, &st) &&
+                    strcmp(image + ((struct sh_image_header *) image)->path, path) == 0) {
+                    close(fd);
+                    free(file);
+                    free(path);
+                    status = sh_image_run(image);
+                    munmap(image, image_st.st_size);
+                    return status;
+                }
+                munmap(image, image_st.st_size);
             }
         }
+        close(fd);
     }
-#endif
+
+    // Miss: parse the whole script into a new image. A syntax error leaves
+    // the script to the line-by-line path, which reports it in context.
+    if (sh_reader_map(&reader, path) == -1) {
+        free(file);
+        free(path);
+        return -1;
+    }
+    sh_syntax_quiet = 1;
+    while ((more = sh_read_list(&reader, NULL, &list)) && list != NULL) {
+        sh_image_add_list(&builder, list);
+        sh_arena_reset(&sh_parse_arena);
+    }
+    sh_syntax_quiet = 0;
+    sh_arena_reset(&sh_parse_arena);
+
+    if (reader.fd == -1) {
+        munmap(reader.buffer, reader.size);
+    } else {
+        close(reader.fd);
+        free(reader.buffer);
+    }
+    if (more) {
+        free(sh_image_finish(&builder, &st, path));
+        free(file);
+        free(path);
+        return -1;
+    }
+
+    image = sh_image_finish(&builder, &st, path);
+    free(path);
+    if (image == NULL) {
+        free(file);
+        return -1;
+    }
+    mkdir(dir, 0700);
+    sh_cache_store(file, image);
+    free(file);
+
+    status = sh_image_run(image);
+    free(image);
+    return status;
 }
 
 /**
- * @brief Loop getting input and executing it.
+ * @brief Run a script file in the shell itself, through the script cache
+ * when $SH_SCRIPT_CACHE names one.
+ * @param path The script.
+ * @param missing_ok Whether a script that does not exist is silently
+ * skipped.
+ * @return 1 if the script ran, 0 if it asked the shell to exit, -1 if it
+ * could not be read (reported unless missing and missing_ok).
  */
-void sh_loop() {
-    char *line;
-    char **args;
+int sh_source(const char *path, int missing_ok) {
+    const char *cache_dir = getenv("SH_SCRIPT_CACHE");
+    struct sh_reader script = {-1};
     int status;
 
-    do {
-        printf("> ");
-
-        // Read the command from standard input.
-        line = sh_read_line();
-
-        // Separate the command string into a program and arguments.
-        args = sh_split_line(line);
+    if (cache_dir != NULL && *cache_dir != '\0' &&
+        (status = sh_cache_run(cache_dir, path)) != -1) {
+        return status;
+    }
+    if (sh_reader_map(&script, path) == -1) {
+        if (!missing_ok || errno != ENOENT) {
+            fprintf(stderr, "sh: %s: %s\n", path, strerror(errno));
+        }
+        return -1;
+    }
+    status = sh_loop(&script);
+    if (script.fd == -1) {
+        munmap(script.buffer, script.size);
+    } else {
+        close(script.fd);
+        free(script.buffer);
+    }
+    return status;
+}
 
-        // Run the parsed command.
-        status = sh_execute(args);
+/**
+ * @brief Run the rc file of an interactive shell: $ENV, or ~/.shrc.
+ * @return 1 to go on, 0 if it asked the shell to exit.
+ */
+int sh_run_rc() {
+    const char *env = sh_var_get("ENV"), *home = sh_var_get("HOME");
+    char *path;
+    int status;
 
-        free(line);
-        free(args);
-    } while (status);
+    if (env != NULL) {
+        return *env != '\0' ? sh_source(env, 0) != 0 : 1;
+    }
+    if (home == NULL) {
+        return 1;
+    }
+    path = sh_xmalloc(strlen(home) + 8);
+    sprintf(path, "%s/.shrc", home);
+    status = sh_source(path, 1) != 0;
+    free(path);
+    return status;
 }
 
 /**
  * @brief Main entry point.
+ *
+ * "sh" reads commands from stdin, "sh -c string" runs string, and
+ * "sh file" runs the script in file. An interactive shell first runs its
+ * rc file. "sh --batch [-j jobs] [fd]" runs the lines read from fd (stdin
+ * by default) as independent commands; see sh_batch_main. "--startup-trace"
+ * before any of these reports the time each phase of startup took.
+ *
+ * Everything else is set up on first use: the builtin table, the command
+ * hash, variables, history and the SIGCHLD handler, so a shell started to
+ * run one command does little more than start it.
  * @param argc Argument count.
  * @param argv Argument vector.
  * @return status code.
  */
 int main(int argc, char **argv) {
-    // Load config files, if any.
+    struct sh_reader script = {-1};
+    struct sh_reader *input = &sh_stdin;
+
+    if (argc > 1 && strcmp(argv[1], "--startup-trace") == 0) {
+        sh_startup_trace = 1;
+        sh_startup_ns = sh_clock_ns();
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+
+    sh_launch_init();
+    sh_pipe_init();
+    sh_interactive = argc == 1 && isatty(STDIN_FILENO);
+    if (!isatty(STDOUT_FILENO)) {
+        // Utility builtins write through this; children get it flushed.
+        setvbuf(stdout, NULL, _IOFBF, SH_OUTPUT_BUFFER_SIZE);
+    }
+    sh_jobs_init(sh_interactive);
+    sh_shell_pid = getpid();
+    sh_name = argc > 1 && argv[1][0] != '-' ? argv[1] : argv[0];
+    sh_trace_startup("init");
+
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+        return sh_batch_main(argc - 1, argv + 1);
+    }
+
+    if (sh_interactive) {
+        if (!sh_run_rc()) {
+            return sh_last_status;
+        }
+        sh_trace_startup("rc file");
+    }
+
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "sh: -c: option requires an argument\n");
+            return 2;
+        }
+        sh_reader_string(&script, argv[2]);
+        input = &script;
+    } else if (argc > 1) {
+        if (sh_source(argv[1], 0) == -1) {
+            return 127;
+        }
+        return sh_last_status;
+    }
+    sh_trace_startup("ready");
 
     // Run command loop.
-    sh_loop();
+    sh_loop(input);
 
     // Perform any shutdown/cleanup.
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    return sh_last_status;
+}